@@ -0,0 +1,798 @@
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include "ipforest_types.h"
+#include "ipforest_radix_tree.h"
+#include "ipforest_loader.h"
+#include "ipforest_poptrie.h"
+#include "ipforest_interval.h"
+#include "ipforest_dag.h"
+#include "ipforest_bsearch.h"
+#include "ipforest_mmdb.h"
+#include "ipforest_shm.h"
+#include "ipforest_engine.h"
+
+static void *
+_poptrie_build(ipforest_radix_tree_t *tree)
+{
+    return ipforest_poptrie_build(tree);
+}
+
+static IPFOREST_BOOLEAN
+_poptrie_lookup(const void *compiled, uint32_t addr)
+{
+    return ipforest_poptrie_lookup(compiled, addr);
+}
+
+static void
+_poptrie_free(void *compiled)
+{
+    ipforest_poptrie_free(compiled);
+}
+
+static void *
+_interval_build(ipforest_radix_tree_t *tree)
+{
+    return ipforest_interval_build_from_tree(tree);
+}
+
+static IPFOREST_BOOLEAN
+_interval_lookup(const void *compiled, uint32_t addr)
+{
+    return ipforest_interval_lookup(compiled, addr);
+}
+
+static void
+_interval_free(void *compiled)
+{
+    ipforest_interval_free(compiled);
+}
+
+static void *
+_dag_build(ipforest_radix_tree_t *tree)
+{
+    return ipforest_dag_freeze(tree);
+}
+
+static IPFOREST_BOOLEAN
+_dag_lookup(const void *compiled, uint32_t addr)
+{
+    return ipforest_dag_lookup(compiled, addr);
+}
+
+static void
+_dag_free(void *compiled)
+{
+    ipforest_dag_free(compiled);
+}
+
+static void *
+_bsearch_build(ipforest_radix_tree_t *tree)
+{
+    return ipforest_bsearch_build(tree);
+}
+
+static IPFOREST_BOOLEAN
+_bsearch_lookup(const void *compiled, uint32_t addr)
+{
+    return ipforest_bsearch_lookup(compiled, addr);
+}
+
+static void
+_bsearch_free(void *compiled)
+{
+    ipforest_bsearch_free(compiled);
+}
+
+static const ipforest_engine_t ipforest_engines[] = {
+    { "poptrie", _poptrie_build, _poptrie_lookup, _poptrie_free },
+    { "interval", _interval_build, _interval_lookup, _interval_free },
+    { "dag", _dag_build, _dag_lookup, _dag_free },
+    { "bsearch", _bsearch_build, _bsearch_lookup, _bsearch_free },
+    { NULL, NULL, NULL, NULL }
+};
+
+/*
+ * matcher generated by ipforest-compile, loaded from a shared object
+ */
+typedef struct ipforest_so_s {
+    void *dl;
+    int (*match)(uint32_t addr);
+} ipforest_so_t;
+
+static IPFOREST_BOOLEAN
+_so_lookup(const void *compiled, uint32_t addr)
+{
+    return ((const ipforest_so_t *)compiled)->match(addr) ? IPFOREST_TRUE : IPFOREST_FALSE;
+}
+
+static void
+_so_free(void *compiled)
+{
+    dlclose(((ipforest_so_t *)compiled)->dl);
+    free(compiled);
+}
+
+/* can not be built from a tree, so not in ipforest_engines */
+static const ipforest_engine_t ipforest_so_engine = {
+    "so", NULL, _so_lookup, _so_free
+};
+
+static IPFOREST_BOOLEAN
+_mmdb_lookup(const void *compiled, uint32_t addr)
+{
+    return ipforest_mmdb_lookup(compiled, addr, NULL);
+}
+
+static void
+_mmdb_free(void *compiled)
+{
+    ipforest_mmdb_close(compiled);
+}
+
+/* MaxMind DB file served in place, not in ipforest_engines either */
+static const ipforest_engine_t ipforest_mmdb_engine = {
+    "mmdb", NULL, _mmdb_lookup, _mmdb_free
+};
+
+static IPFOREST_BOOLEAN
+_shm_lookup(const void *compiled, uint32_t addr)
+{
+    return ipforest_shm_lookup(compiled, addr);
+}
+
+static void
+_shm_free(void *compiled)
+{
+    ipforest_shm_close(compiled);
+}
+
+/* radix tree in shared memory, changed through the forest by its writer only */
+static const ipforest_engine_t ipforest_shm_engine = {
+    "shm", NULL, _shm_lookup, _shm_free
+};
+
+/*
+ * resolve engine by name, "radix" or no name at all stands for the plain
+ * radix tree which yields NULL
+ */
+IPFOREST_BOOLEAN
+ipforest_find_engine(const char *name, const ipforest_engine_t **pengine)
+{
+    const ipforest_engine_t *engine;
+
+    *pengine = NULL;
+
+    if (!name || strcmp(name, "radix") == 0) {
+        return IPFOREST_TRUE;
+    }
+
+    for (engine = ipforest_engines; engine->name != NULL; engine++) {
+        if (strcmp(engine->name, name) == 0) {
+            *pengine = engine;
+            return IPFOREST_TRUE;
+        }
+    }
+
+    return IPFOREST_FALSE;
+}
+
+inline static void
+_uncompile(ipforest_t *forest)
+{
+    if (forest->compiled) {
+        forest->engine->free(forest->compiled);
+        forest->compiled = NULL;
+    }
+}
+
+/*
+ * few prefix lengths take few probes by length, else poptrie does better
+ */
+inline static const ipforest_engine_t *
+_auto_engine(ipforest_radix_tree_t *tree)
+{
+    const ipforest_engine_t *engine;
+
+    if (ipforest_bsearch_lengths(tree) <= IPFOREST_BSEARCH_SPARSE) {
+        ipforest_find_engine("bsearch", &engine);
+    } else {
+        ipforest_find_engine("poptrie", &engine);
+    }
+
+    return engine;
+}
+
+/*
+ * (re)build the selected engine from the radix tree
+ */
+inline static IPFOREST_BOOLEAN
+_build(ipforest_t *forest)
+{
+    _uncompile(forest);
+
+    if (forest->automatic) {
+        forest->engine = _auto_engine(forest->tree);
+    }
+
+    if (!forest->engine) {
+        return IPFOREST_TRUE;
+    }
+
+    forest->compiled = forest->engine->build(forest->tree);
+
+    return forest->compiled != NULL;
+}
+
+/* contents no longer match any file */
+inline static void
+_forget_source(ipforest_t *forest)
+{
+    free(forest->source.fname);
+    forest->source.fname = NULL;
+}
+
+inline static void
+_set_source_stat(ipforest_t *forest, const struct stat *st)
+{
+    forest->source.dev = st->st_dev;
+    forest->source.ino = st->st_ino;
+    forest->source.size = st->st_size;
+    forest->source.mtime = st->st_mtim.tv_sec;
+    forest->source.mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+/*
+ * take over a tree just built, the old one goes away
+ */
+inline static IPFOREST_BOOLEAN
+_replace_tree(ipforest_t *forest, ipforest_radix_tree_t *tree)
+{
+    _uncompile(forest);
+    _forget_source(forest);
+    ipforest_radix_tree_free(forest->tree);
+    forest->tree = tree;
+
+    return _build(forest);
+}
+
+/* what engine name compiled forest into, NULL if it is another one */
+void *
+ipforest_compiled(const ipforest_t *forest, const char *name)
+{
+    if (forest->compiled && strcmp(forest->engine->name, name) == 0) {
+        return forest->compiled;
+    }
+    return NULL;
+}
+
+/* segment forest writes into, NULL unless it is a shm writer */
+inline static ipforest_shm_t *
+_shm_writer(ipforest_t *forest)
+{
+    ipforest_shm_t *shm;
+
+    if (forest->engine != &ipforest_shm_engine) {
+        return NULL;
+    }
+
+    shm = forest->compiled;
+    return shm->writable ? shm : NULL;
+}
+
+/*
+ * parse first so that the segment changes once or not at all
+ */
+inline static IPFOREST_BOOLEAN
+_shm_append(ipforest_shm_t *shm, const char *const *lines, size_t count)
+{
+    size_t total;
+    ipforest_ipaddr_t *paddr;
+    IPFOREST_BOOLEAN ret;
+
+    paddr = ipforest_parse_lines(lines, count, &total);
+    if (!paddr) {
+        return IPFOREST_FALSE;
+    }
+
+    ret = ipforest_shm_insert(shm, paddr, total);
+
+    free(paddr);
+    return ret;
+}
+
+/* ownership of tree is taken if created */
+ipforest_t *
+ipforest_wrap_tree(ipforest_radix_tree_t *tree)
+{
+    ipforest_t *forest;
+
+    forest = malloc(sizeof(ipforest_t));
+    if (forest) {
+        forest->tree = tree;
+        forest->engine = NULL;
+        forest->compiled = NULL;
+        forest->automatic = IPFOREST_FALSE;
+        forest->frozen = IPFOREST_FALSE;
+        memset(&forest->source, 0, sizeof(ipforest_source_t));
+    }
+
+    return forest;
+}
+
+/* a frozen forest answering through compiled only, taken if created */
+ipforest_t *
+ipforest_wrap_compiled(const ipforest_engine_t *engine, void *compiled)
+{
+    ipforest_t *forest;
+
+    forest = ipforest_wrap_tree(NULL);
+    if (forest) {
+        forest->engine = engine;
+        forest->compiled = compiled;
+        forest->frozen = IPFOREST_TRUE;
+    }
+
+    return forest;
+}
+
+ipforest_t *
+ipforest_create(void)
+{
+    ipforest_t *forest;
+    ipforest_radix_tree_t *tree;
+
+    tree = ipforest_radix_tree_alloc();
+    if (!tree) {
+        return NULL;
+    }
+
+    forest = ipforest_wrap_tree(tree);
+    if (!forest) {
+        ipforest_radix_tree_free(tree);
+    }
+
+    return forest;
+}
+
+void
+ipforest_free(ipforest_t *forest)
+{
+    _uncompile(forest);
+    _forget_source(forest);
+    if (forest->tree) {
+        ipforest_radix_tree_free(forest->tree);
+    }
+    free(forest);
+}
+
+int
+ipforest_load(ipforest_t *forest, const char *fname)
+{
+    char *source;
+    uint64_t hash;
+    struct stat st;
+    ipforest_radix_tree_t *tree;
+
+    if (forest->frozen) {
+        return IPFOREST_FALSE;
+    }
+
+    source = strdup(fname);
+    if (!source) {
+        return IPFOREST_FALSE;
+    }
+
+    tree = ipforest_load_file_source(fname, &st, &hash);
+    if (!tree) {
+        free(source);
+        return IPFOREST_FALSE;
+    }
+
+    if (!_replace_tree(forest, tree)) {
+        free(source);
+        return IPFOREST_FALSE;
+    }
+
+    forest->source.fname = source;
+    forest->source.hash = hash;
+    _set_source_stat(forest, &st);
+
+    return IPFOREST_TRUE;
+}
+
+int
+ipforest_unchanged(ipforest_t *forest, const char *fname)
+{
+    uint64_t hash;
+    struct stat st;
+
+    if (!forest->source.fname || strcmp(forest->source.fname, fname) != 0) {
+        return IPFOREST_FALSE;
+    }
+
+    if (stat(fname, &st) != 0) {
+        return IPFOREST_FALSE;
+    }
+
+    if (st.st_dev == forest->source.dev && st.st_ino == forest->source.ino
+        && st.st_size == forest->source.size && st.st_mtim.tv_sec == forest->source.mtime
+        && st.st_mtim.tv_nsec == forest->source.mtime_nsec) {
+        return IPFOREST_TRUE;
+    }
+
+    /* touched or replaced, the content may still be the same */
+    if (st.st_size != forest->source.size
+        || !ipforest_hash_file(fname, &st, &hash) || hash != forest->source.hash) {
+        return IPFOREST_FALSE;
+    }
+
+    _set_source_stat(forest, &st);
+    return IPFOREST_TRUE;
+}
+
+int
+ipforest_load_cached(ipforest_t *forest, const char *fname, int *rebuilt)
+{
+    if (ipforest_unchanged(forest, fname)) {
+        if (rebuilt) {
+            *rebuilt = 0;
+        }
+        return IPFOREST_TRUE;
+    }
+
+    if (rebuilt) {
+        *rebuilt = 1;
+    }
+    return ipforest_load(forest, fname);
+}
+
+int
+ipforest_load_string(ipforest_t *forest, const char *data, size_t len)
+{
+    ipforest_radix_tree_t *tree;
+
+    if (forest->frozen) {
+        return IPFOREST_FALSE;
+    }
+
+    tree = ipforest_load_buffer(data, len);
+    if (!tree) {
+        return IPFOREST_FALSE;
+    }
+
+    return _replace_tree(forest, tree);
+}
+
+int
+ipforest_insert(ipforest_t *forest, uint32_t addr, int plen)
+{
+    uint32_t mask;
+    ipforest_shm_t *shm;
+    ipforest_ipaddr_t prefix;
+
+    if (plen < 0 || plen > 32) {
+        return IPFOREST_FALSE;
+    }
+
+    mask = plen ? 0xffffffff << (32 - plen) : 0;
+
+    shm = _shm_writer(forest);
+    if (shm) {
+        prefix.addr = addr & mask;
+        prefix.mask = mask;
+        return ipforest_shm_insert(shm, &prefix, 1);
+    }
+
+    if (forest->frozen) {
+        return IPFOREST_FALSE;
+    }
+
+    if (!ipforest_radix_tree_insert(forest->tree, addr & mask, mask)) {
+        return IPFOREST_FALSE;
+    }
+
+    /* compiled engine is stale now */
+    _uncompile(forest);
+    _forget_source(forest);
+    return IPFOREST_TRUE;
+}
+
+int
+ipforest_append(ipforest_t *forest, const char *line)
+{
+    ipforest_shm_t *shm;
+
+    shm = _shm_writer(forest);
+    if (shm) {
+        return _shm_append(shm, &line, 1);
+    }
+
+    if (forest->frozen || !ipforest_load_line(forest->tree, line)) {
+        return IPFOREST_FALSE;
+    }
+
+    /* compiled engine is stale now */
+    _uncompile(forest);
+    _forget_source(forest);
+    return IPFOREST_TRUE;
+}
+
+int
+ipforest_append_many(ipforest_t *forest, const char *const *lines, size_t count)
+{
+    ipforest_shm_t *shm;
+
+    shm = _shm_writer(forest);
+    if (shm) {
+        return _shm_append(shm, lines, count);
+    }
+
+    if (forest->frozen || !ipforest_load_lines(forest->tree, lines, count)) {
+        return IPFOREST_FALSE;
+    }
+
+    /* compiled engine is stale now */
+    _uncompile(forest);
+    _forget_source(forest);
+    return IPFOREST_TRUE;
+}
+
+void
+ipforest_compact(ipforest_t *forest)
+{
+    if (forest->tree) {
+        ipforest_radix_tree_compact(forest->tree);
+    }
+}
+
+int
+ipforest_compact_lossy(ipforest_t *forest, uint32_t max_nodes, uint64_t *extra, uint32_t *nodes)
+{
+    if (!forest->tree || forest->frozen) {
+        return IPFOREST_FALSE;
+    }
+
+    if (!ipforest_radix_tree_compact_lossy(forest->tree, max_nodes, extra, nodes)) {
+        return IPFOREST_FALSE;
+    }
+
+    /* a laid out block keeps its size until laid out again */
+    if (forest->tree->block) {
+        ipforest_radix_tree_relayout(forest->tree);
+    }
+
+    /* no longer what the file holds */
+    _forget_source(forest);
+    return _build(forest);
+}
+
+int
+ipforest_optimize(ipforest_t *forest)
+{
+    /* a frozen tree may be read by other threads */
+    if (!forest->tree || forest->frozen) {
+        return IPFOREST_FALSE;
+    }
+
+    return ipforest_radix_tree_relayout(forest->tree);
+}
+
+int
+ipforest_compile(ipforest_t *forest, const char *name)
+{
+    IPFOREST_BOOLEAN automatic;
+    const ipforest_engine_t *engine;
+
+    if (forest->frozen) {
+        return IPFOREST_FALSE;
+    }
+
+    /* "auto" is resolved on every build */
+    automatic = name && strcmp(name, "auto") == 0;
+    if (!automatic && !ipforest_find_engine(name, &engine)) {
+        return IPFOREST_FALSE;
+    }
+
+    if (name) {
+        _uncompile(forest);
+        forest->engine = automatic ? NULL : engine;
+        forest->automatic = automatic;
+    }
+
+    return _build(forest);
+}
+
+int
+ipforest_freeze(ipforest_t *forest, const char *name)
+{
+    if (forest->frozen) {
+        return IPFOREST_FALSE;
+    }
+
+    if (name || (forest->engine && !forest->compiled)) {
+        if (!ipforest_compile(forest, name)) {
+            return IPFOREST_FALSE;
+        }
+    }
+
+    /* lookups never reach the radix tree past this point */
+    if (forest->compiled) {
+        ipforest_radix_tree_free(forest->tree);
+        forest->tree = NULL;
+    } else {
+        ipforest_radix_tree_compact(forest->tree);
+    }
+
+    forest->frozen = IPFOREST_TRUE;
+    return IPFOREST_TRUE;
+}
+
+int
+ipforest_load_compiled(ipforest_t *forest, const char *path)
+{
+    ipforest_so_t *so;
+
+    so = malloc(sizeof(ipforest_so_t));
+    if (!so) {
+        goto fail;
+    }
+
+    so->dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!so->dl) {
+        goto dl_error;
+    }
+
+    *(void **)(&so->match) = dlsym(so->dl, "ipforest_compiled_match");
+    if (!so->match) {
+        goto sym_error;
+    }
+
+    _uncompile(forest);
+    if (forest->tree) {
+        ipforest_radix_tree_free(forest->tree);
+        forest->tree = NULL;
+    }
+
+    _forget_source(forest);
+    forest->engine = &ipforest_so_engine;
+    forest->automatic = IPFOREST_FALSE;
+    forest->compiled = so;
+    forest->frozen = IPFOREST_TRUE;
+
+    return IPFOREST_TRUE;
+
+sym_error:
+    dlclose(so->dl);
+
+dl_error:
+    free(so);
+
+fail:
+    return IPFOREST_FALSE;
+}
+
+int
+ipforest_load_mmdb(ipforest_t *forest, const char *path)
+{
+    ipforest_mmdb_t *mmdb;
+
+    mmdb = ipforest_mmdb_open(path);
+    if (!mmdb) {
+        return IPFOREST_FALSE;
+    }
+
+    _uncompile(forest);
+    if (forest->tree) {
+        ipforest_radix_tree_free(forest->tree);
+        forest->tree = NULL;
+    }
+
+    _forget_source(forest);
+    forest->engine = &ipforest_mmdb_engine;
+    forest->automatic = IPFOREST_FALSE;
+    forest->compiled = mmdb;
+    forest->frozen = IPFOREST_TRUE;
+
+    return IPFOREST_TRUE;
+}
+
+/*
+ * drop the contents for a shm engine, frozen for anything but the changes
+ * the writer makes through ipforest_insert and friends
+ */
+inline static void
+_set_shm(ipforest_t *forest, ipforest_shm_t *shm)
+{
+    _uncompile(forest);
+    if (forest->tree) {
+        ipforest_radix_tree_free(forest->tree);
+        forest->tree = NULL;
+    }
+
+    _forget_source(forest);
+    forest->engine = &ipforest_shm_engine;
+    forest->automatic = IPFOREST_FALSE;
+    forest->compiled = shm;
+    forest->frozen = IPFOREST_TRUE;
+}
+
+int
+ipforest_create_shm(ipforest_t *forest, const char *name, uint32_t nodes)
+{
+    ipforest_shm_t *shm;
+
+    shm = ipforest_shm_create(name, nodes);
+    if (!shm) {
+        return IPFOREST_FALSE;
+    }
+
+    _set_shm(forest, shm);
+    return IPFOREST_TRUE;
+}
+
+int
+ipforest_attach_shm(ipforest_t *forest, const char *name)
+{
+    ipforest_shm_t *shm;
+
+    shm = ipforest_shm_attach(name);
+    if (!shm) {
+        return IPFOREST_FALSE;
+    }
+
+    _set_shm(forest, shm);
+    return IPFOREST_TRUE;
+}
+
+int
+ipforest_clear_shm(ipforest_t *forest)
+{
+    ipforest_shm_t *shm;
+
+    shm = _shm_writer(forest);
+    return shm && ipforest_shm_clear(shm);
+}
+
+int
+ipforest_unlink_shm(const char *name)
+{
+    return ipforest_shm_unlink(name);
+}
+
+int
+ipforest_lookup(const ipforest_t *forest, uint32_t addr)
+{
+    if (forest->compiled) {
+        return forest->engine->lookup(forest->compiled, addr);
+    }
+
+    return ipforest_radix_tree_lookup(forest->tree, addr, 0xffffffff);
+}
+
+size_t
+ipforest_lookup_batch(const ipforest_t *forest, const uint32_t *addrs,
+                      size_t count, unsigned char *results)
+{
+    size_t i, matched;
+    IPFOREST_BOOLEAN (*lookup)(const void *compiled, uint32_t addr);
+
+    matched = 0;
+
+    /* pick the engine once for the whole batch */
+    if (forest->compiled) {
+        lookup = forest->engine->lookup;
+        for (i = 0; i < count; i++) {
+            results[i] = lookup(forest->compiled, addrs[i]) ? 1 : 0;
+            matched += results[i];
+        }
+    } else {
+        for (i = 0; i < count; i++) {
+            results[i] = ipforest_radix_tree_lookup(forest->tree, addrs[i], 0xffffffff) ? 1 : 0;
+            matched += results[i];
+        }
+    }
+
+    return matched;
+}
@@ -0,0 +1,138 @@
+#ifndef IPFOREST_H
+#define IPFOREST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * libipforest, ip list matching for C programs, the lua module is a binding
+ * over it. link with -lipforest -lpthread -ldl -lrt.
+ *
+ * addresses are IPv4 in host byte order. functions returning int yield 1 on
+ * success or match, 0 otherwise. lists are in the format ipforest.load
+ * takes: hosts, cidrs, netmasks and ranges, one per line.
+ *
+ * thread safety: an ipforest_t has no lock of its own. lookups never write
+ * to it, so any number of threads may call ipforest_lookup and
+ * ipforest_lookup_batch at once as long as no thread modifies it at the
+ * same time. a frozen forest can not be modified any more and is safe to
+ * share once ipforest_freeze returned. distinct forests are independent,
+ * the few process wide structures behind them are locked internally.
+ */
+
+/* the library is built with hidden visibility, it exports these alone */
+#if defined(__GNUC__) && __GNUC__ >= 4
+#define IPFOREST_API __attribute__((visibility("default")))
+#else
+#define IPFOREST_API
+#endif
+
+typedef struct ipforest_s ipforest_t;
+
+/* an empty forest, NULL if out of memory */
+IPFOREST_API ipforest_t * ipforest_create(void);
+IPFOREST_API void ipforest_free(ipforest_t *forest);
+
+/* replace the contents with a list from a file or from memory */
+IPFOREST_API int ipforest_load(ipforest_t *forest, const char *fname);
+IPFOREST_API int ipforest_load_string(ipforest_t *forest, const char *data, size_t len);
+
+/*
+ * tell if forest still holds exactly what fname has: it was loaded from
+ * fname, not changed since, and the file has the same inode, size and
+ * mtime or else the same content hash
+ */
+IPFOREST_API int ipforest_unchanged(ipforest_t *forest, const char *fname);
+
+/*
+ * ipforest_load unless ipforest_unchanged, rebuilt tells which if not NULL
+ */
+IPFOREST_API int ipforest_load_cached(ipforest_t *forest, const char *fname, int *rebuilt);
+
+/*
+ * add addr/plen or a single list line. the compiled engine is dropped,
+ * lookups go through the radix tree until ipforest_compile is called again
+ */
+IPFOREST_API int ipforest_insert(ipforest_t *forest, uint32_t addr, int plen);
+IPFOREST_API int ipforest_append(ipforest_t *forest, const char *line);
+
+/*
+ * append many list lines at once, faster than one by one. all lines are
+ * parsed first, nothing is added if one of them is invalid
+ */
+IPFOREST_API int ipforest_append_many(ipforest_t *forest, const char *const *lines, size_t count);
+
+/* release memory kept aside for inserts */
+IPFOREST_API void ipforest_compact(ipforest_t *forest);
+
+/*
+ * trade exactness for size: turn the deepest inner nodes into leaves until
+ * the radix tree has no more than max_nodes nodes. extra gets the number of
+ * addresses matched now that were not, nodes the number of nodes left
+ */
+IPFOREST_API int ipforest_compact_lossy(ipforest_t *forest, uint32_t max_nodes, uint64_t *extra, uint32_t *nodes);
+
+/*
+ * copy the radix tree into one block in cache friendly order, as done on
+ * load. worth calling after many inserts, not on a frozen forest
+ */
+IPFOREST_API int ipforest_optimize(ipforest_t *forest);
+
+/*
+ * select a lookup engine and build it: "radix", "poptrie", "interval",
+ * "dag" or "bsearch". "auto" picks "bsearch" for trees with up to three
+ * prefix lengths and "poptrie" for others, again on every rebuild. NULL
+ * rebuilds the engine already selected
+ */
+IPFOREST_API int ipforest_compile(ipforest_t *forest, const char *engine);
+
+/*
+ * make forest read only, with engine selected as by ipforest_compile. the
+ * radix tree is dropped unless the engine is "radix"
+ */
+IPFOREST_API int ipforest_freeze(ipforest_t *forest, const char *engine);
+
+/* replace the contents with a matcher built from ipforest-compile output */
+IPFOREST_API int ipforest_load_compiled(ipforest_t *forest, const char *path);
+
+/*
+ * replace the contents with a MaxMind DB file, mapped and served in place.
+ * addresses with data in the file match
+ */
+IPFOREST_API int ipforest_load_mmdb(ipforest_t *forest, const char *path);
+
+/*
+ * replace the contents with a tree in the POSIX shared memory segment name,
+ * one copy for every process on the host. ipforest_create_shm makes forest
+ * the only writer, the segment is created with room for nodes tree nodes
+ * (8 bytes each), 1M if 0. an existing one keeps its size, it fails unless
+ * nodes is 0 or that size. it fails while another forest writes.
+ * ipforest_insert and ipforest_append on the writer are seen at once by
+ * forests attached with ipforest_attach_shm, which take no lock to look up.
+ * an append that runs out of room fails with the lines before the one that
+ * did not fit added
+ */
+IPFOREST_API int ipforest_create_shm(ipforest_t *forest, const char *name, uint32_t nodes);
+IPFOREST_API int ipforest_attach_shm(ipforest_t *forest, const char *name);
+
+/* empty the segment a shm writer holds */
+IPFOREST_API int ipforest_clear_shm(ipforest_t *forest);
+
+/* remove the name, mapped segments live on until closed */
+IPFOREST_API int ipforest_unlink_shm(const char *name);
+
+IPFOREST_API int ipforest_lookup(const ipforest_t *forest, uint32_t addr);
+
+/* results[i] is set to 1 if addrs[i] matches, 0 if not, return matches */
+IPFOREST_API size_t ipforest_lookup_batch(const ipforest_t *forest, const uint32_t *addrs,
+                                          size_t count, unsigned char *results);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
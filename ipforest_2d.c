@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "ipforest_types.h"
+#include "ipforest_parser.h"
+#include "ipforest_radix_tree.h"
+#include "ipforest_2d.h"
+
+ipforest_2d_t *
+ipforest_2d_alloc()
+{
+    ipforest_2d_t *c;
+
+    c = malloc(sizeof(ipforest_2d_t));
+    if (c) {
+        memset(c, 0, sizeof(ipforest_2d_t));
+    }
+
+    return c;
+}
+
+static void
+_free_children(ipforest_2d_node_t *node)
+{
+    int i;
+    ipforest_2d_node_t *child;
+
+    for (i = 0; i < 2; i++) {
+        child = node->child[i];
+        if (child) {
+            _free_children(child);
+            if (child->dst) {
+                ipforest_radix_tree_free(child->dst);
+            }
+            free(child);
+        }
+    }
+}
+
+void
+ipforest_2d_free(ipforest_2d_t *c)
+{
+    _free_children(&c->root);
+    if (c->root.dst) {
+        ipforest_radix_tree_free(c->root.dst);
+    }
+    free(c);
+}
+
+static IPFOREST_BOOLEAN
+_copy_leaf(uint32_t addr, uint32_t mask, void *ctx)
+{
+    return ipforest_radix_tree_insert(ctx, addr, mask);
+}
+
+inline static IPFOREST_BOOLEAN
+_insert_dsts(ipforest_radix_tree_t *tree, const ipforest_ipaddr_t *dsts, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (!ipforest_radix_tree_insert(tree, dsts[i].addr & dsts[i].mask, dsts[i].mask)) {
+            return IPFOREST_FALSE;
+        }
+    }
+
+    return IPFOREST_TRUE;
+}
+
+/*
+ * set pruning, every rule ending below node gets dsts as well
+ */
+static IPFOREST_BOOLEAN
+_push_down(ipforest_2d_node_t *node, const ipforest_ipaddr_t *dsts, int count)
+{
+    int i;
+    ipforest_2d_node_t *child;
+
+    for (i = 0; i < 2; i++) {
+        child = node->child[i];
+        if (!child) {
+            continue;
+        }
+        if (child->dst && !_insert_dsts(child->dst, dsts, count)) {
+            return IPFOREST_FALSE;
+        }
+        if (!_push_down(child, dsts, count)) {
+            return IPFOREST_FALSE;
+        }
+    }
+
+    return IPFOREST_TRUE;
+}
+
+IPFOREST_BOOLEAN
+ipforest_2d_insert(ipforest_2d_t *c, uint32_t src, uint32_t src_mask,
+                   const ipforest_ipaddr_t *dsts, int count)
+{
+    int i;
+    uint32_t bit;
+    ipforest_2d_node_t *node, *child;
+    ipforest_radix_tree_t *inherit;
+
+    node = &c->root;
+    inherit = NULL;
+
+    for (bit = 0x80000000; bit & src_mask; bit >>= 1) {
+        /* nearest rule above, its dst tree is copied if one starts here */
+        if (node->dst) {
+            inherit = node->dst;
+        }
+
+        i = (src & bit) ? 1 : 0;
+        if (!node->child[i]) {
+            child = malloc(sizeof(ipforest_2d_node_t));
+            if (!child) {
+                return IPFOREST_FALSE;
+            }
+            memset(child, 0, sizeof(ipforest_2d_node_t));
+            node->child[i] = child;
+        }
+        node = node->child[i];
+    }
+
+    if (!node->dst) {
+        node->dst = ipforest_radix_tree_alloc();
+        if (!node->dst) {
+            return IPFOREST_FALSE;
+        }
+        if (inherit && !ipforest_radix_tree_walk(inherit, _copy_leaf, node->dst)) {
+            return IPFOREST_FALSE;
+        }
+    }
+
+    if (!_insert_dsts(node->dst, dsts, count) || !_push_down(node, dsts, count)) {
+        return IPFOREST_FALSE;
+    }
+
+    c->rules += count;
+    return IPFOREST_TRUE;
+}
+
+/*
+ * prefixes of a single spec, NULL if it does not parse
+ */
+inline static ipforest_ipaddr_t *
+_parse_spec(const char *spec, int *count)
+{
+    ipforest_ipaddr_t *paddr;
+
+    *count = ipforest_parse_ip_line(spec, NULL);
+    if (*count <= 0) {
+        return NULL;
+    }
+
+    paddr = malloc(*count * sizeof(ipforest_ipaddr_t));
+    if (paddr) {
+        ipforest_parse_ip_line(spec, paddr);
+    }
+
+    return paddr;
+}
+
+IPFOREST_BOOLEAN
+ipforest_2d_insert_spec(ipforest_2d_t *c, const char *src, const char *dst)
+{
+    int i, nsrcs, ndsts;
+    ipforest_ipaddr_t *srcs, *dsts;
+    IPFOREST_BOOLEAN ret;
+
+    srcs = _parse_spec(src, &nsrcs);
+    dsts = _parse_spec(dst, &ndsts);
+
+    ret = srcs && dsts;
+    for (i = 0; ret && i < nsrcs; i++) {
+        ret = ipforest_2d_insert(c, srcs[i].addr & srcs[i].mask, srcs[i].mask, dsts, ndsts);
+    }
+
+    /* safe to free NULL */
+    free(srcs);
+    free(dsts);
+    return ret;
+}
+
+/*
+ * split a rule line into its two specs in place
+ */
+inline static IPFOREST_BOOLEAN
+_split_rule(char *line, char **src, char **dst)
+{
+    char *p;
+
+    *src = line;
+    p = line + strcspn(line, " \t");
+    if (*p == '\0') {
+        return IPFOREST_FALSE;
+    }
+    *p++ = '\0';
+
+    *dst = p + strspn(p, " \t");
+    p = *dst + strcspn(*dst, " \t");
+
+    return **dst != '\0' && *p == '\0';
+}
+
+ipforest_2d_t *
+ipforest_2d_load_file(const char *fname)
+{
+    size_t len;
+    char buf[LINE_MAX], *src, *dst;
+    FILE *stream;
+    ipforest_2d_t *c;
+
+    stream = fopen(fname, "r");
+    if (!stream) {
+        return NULL;
+    }
+
+    c = ipforest_2d_alloc();
+    if (!c) {
+        goto fail;
+    }
+
+    while (fgets(buf, LINE_MAX, stream)) {
+        len = strlen(buf);
+
+        /* longer than the buffer */
+        if (len > 0 && buf[len - 1] != '\n' && !feof(stream)) {
+            goto fail;
+        }
+
+        while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r')) {
+            buf[--len] = '\0';
+        }
+
+        /* ignore empty line and comments */
+        if (buf[0] == '#' || buf[0] == '\0') {
+            continue;
+        }
+
+        if (!_split_rule(buf, &src, &dst) || !ipforest_2d_insert_spec(c, src, dst)) {
+            goto fail;
+        }
+    }
+
+    if (ferror(stream)) {
+        goto fail;
+    }
+
+    fclose(stream);
+    return c;
+
+fail:
+    if (c) {
+        ipforest_2d_free(c);
+    }
+    fclose(stream);
+    return NULL;
+}
+
+IPFOREST_BOOLEAN
+ipforest_2d_lookup(const ipforest_2d_t *c, uint32_t src, uint32_t dst)
+{
+    uint32_t bit;
+    const ipforest_2d_node_t *node;
+    ipforest_radix_tree_t *best;
+
+    node = &c->root;
+    best = node->dst;
+
+    /* the deepest rule on the way has the dst prefixes of all above it */
+    for (bit = 0x80000000; bit; bit >>= 1) {
+        node = node->child[(src & bit) ? 1 : 0];
+        if (!node) {
+            break;
+        }
+        if (node->dst) {
+            best = node->dst;
+        }
+    }
+
+    return best && ipforest_radix_tree_lookup(best, dst, 0xffffffff);
+}
@@ -0,0 +1,38 @@
+#ifndef IPFOREST_2D
+#define IPFOREST_2D
+
+#include "ipforest_types.h"
+#include "ipforest_radix_tree.h"
+
+/*
+ * two dimensional classifier, matches (src, dst) pairs against rules made
+ * of a src prefix and a dst prefix.
+ *
+ * hierarchical trie with set pruning: a binary trie over src prefixes, the
+ * nodes where a rule ends hold a radix tree of dst prefixes. a node's dst
+ * tree also has the dst prefixes of every rule ending above it, so a
+ * lookup follows src down to the deepest such node and asks its dst tree
+ * once. that is 32 src nodes and 32 dst nodes at most.
+ */
+
+typedef struct ipforest_2d_node_s {
+    struct ipforest_2d_node_s *child[2];
+    ipforest_radix_tree_t *dst;    /* NULL if no rule ends here */
+} ipforest_2d_node_t;
+
+typedef struct ipforest_2d_s {
+    ipforest_2d_node_t root;
+    uint32_t rules;                /* src x dst prefix pairs added */
+} ipforest_2d_t;
+
+ipforest_2d_t * ipforest_2d_alloc();
+void ipforest_2d_free(ipforest_2d_t *c);
+IPFOREST_BOOLEAN ipforest_2d_insert(ipforest_2d_t *c, uint32_t src, uint32_t src_mask,
+                                    const ipforest_ipaddr_t *dsts, int count);
+/* one spec of the list format per dimension */
+IPFOREST_BOOLEAN ipforest_2d_insert_spec(ipforest_2d_t *c, const char *src, const char *dst);
+/* a rule per line, src and dst spec separated by blanks */
+ipforest_2d_t * ipforest_2d_load_file(const char *fname);
+IPFOREST_BOOLEAN ipforest_2d_lookup(const ipforest_2d_t *c, uint32_t src, uint32_t dst);
+
+#endif
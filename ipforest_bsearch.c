@@ -0,0 +1,259 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ipforest_types.h"
+#include "ipforest_radix_tree.h"
+#include "ipforest_bsearch.h"
+
+#define IPFOREST_BSEARCH_EMPTY 0
+#define IPFOREST_BSEARCH_PREFIX 1
+#define IPFOREST_BSEARCH_MARKER 2
+
+/* leaves gathered while building */
+typedef struct ipforest_bsearch_leaves_s {
+    ipforest_ipaddr_t *leaves;     /* mask holds the prefix length */
+    uint32_t count;
+    uint32_t cap;
+    uint32_t lengths[33];
+} ipforest_bsearch_leaves_t;
+
+inline static int
+_mask_plen(uint32_t mask)
+{
+    return mask == 0xffffffff ? 32 : __builtin_clz(~mask);
+}
+
+inline static uint32_t
+_key(uint32_t addr, int plen)
+{
+    return plen ? addr >> (32 - plen) : 0;
+}
+
+inline static uint32_t
+_hash(const ipforest_bsearch_table_t *table, uint32_t key)
+{
+    return (key * 0x9e3779b1) >> table->shift;
+}
+
+static IPFOREST_BOOLEAN
+_count_leaf(uint32_t addr, uint32_t mask, void *ctx)
+{
+    (void)addr;
+    ((uint32_t *)ctx)[_mask_plen(mask)]++;
+    return IPFOREST_TRUE;
+}
+
+static IPFOREST_BOOLEAN
+_push_leaf(uint32_t addr, uint32_t mask, void *ctx)
+{
+    uint32_t cap;
+    ipforest_ipaddr_t *leaves;
+    ipforest_bsearch_leaves_t *list;
+
+    list = ctx;
+
+    if (list->count == list->cap) {
+        cap = list->cap ? list->cap << 1 : 64;
+        leaves = realloc(list->leaves, cap * sizeof(ipforest_ipaddr_t));
+        if (!leaves) {
+            return IPFOREST_FALSE;
+        }
+        list->leaves = leaves;
+        list->cap = cap;
+    }
+
+    list->leaves[list->count].addr = addr;
+    list->leaves[list->count].mask = _mask_plen(mask);
+    list->lengths[_mask_plen(mask)]++;
+    list->count++;
+
+    return IPFOREST_TRUE;
+}
+
+int
+ipforest_bsearch_lengths(ipforest_radix_tree_t *tree)
+{
+    int plen, count;
+    uint32_t lengths[33];
+
+    memset(lengths, 0, sizeof(lengths));
+    ipforest_radix_tree_walk(tree, _count_leaf, lengths);
+
+    count = 0;
+    for (plen = 0; plen <= 32; plen++) {
+        count += lengths[plen] ? 1 : 0;
+    }
+
+    return count;
+}
+
+inline static void
+_add(ipforest_bsearch_table_t *table, uint32_t key, uint32_t kind)
+{
+    uint32_t i;
+
+    for (i = _hash(table, key); table->slots[i].kind != IPFOREST_BSEARCH_EMPTY;
+         i = (i + 1) & table->mask) {
+        if (table->slots[i].key == key) {
+            return;
+        }
+    }
+
+    table->slots[i].key = key;
+    table->slots[i].kind = kind;
+}
+
+inline static uint32_t
+_find(const ipforest_bsearch_table_t *table, uint32_t key)
+{
+    uint32_t i;
+
+    for (i = _hash(table, key); table->slots[i].kind != IPFOREST_BSEARCH_EMPTY;
+         i = (i + 1) & table->mask) {
+        if (table->slots[i].key == key) {
+            return table->slots[i].kind;
+        }
+    }
+
+    return IPFOREST_BSEARCH_EMPTY;
+}
+
+/*
+ * put a prefix of table j and the markers its search passes by, or only
+ * count the entries each table gets if sizes is not NULL
+ */
+static void
+_place(ipforest_bsearch_t *bs, int j, uint32_t addr, uint32_t *sizes)
+{
+    int lo, hi, mid;
+
+    lo = 0;
+    hi = bs->count - 1;
+
+    while (lo <= hi) {
+        mid = (lo + hi) >> 1;
+        if (mid == j) {
+            break;
+        }
+
+        /* going longer from mid needs a marker there */
+        if (mid < j) {
+            if (sizes) {
+                sizes[mid]++;
+            } else {
+                _add(&bs->tables[mid], _key(addr, bs->tables[mid].plen), IPFOREST_BSEARCH_MARKER);
+            }
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    if (sizes) {
+        sizes[j]++;
+    } else {
+        _add(&bs->tables[j], _key(addr, bs->tables[j].plen), IPFOREST_BSEARCH_PREFIX);
+    }
+}
+
+ipforest_bsearch_t *
+ipforest_bsearch_build(ipforest_radix_tree_t *tree)
+{
+    int i, plen, index[33];
+    uint32_t n, bits, sizes[33];
+    ipforest_bsearch_t *bs;
+    ipforest_bsearch_leaves_t list;
+
+    bs = NULL;
+    memset(&list, 0, sizeof(ipforest_bsearch_leaves_t));
+
+    if (!ipforest_radix_tree_walk(tree, _push_leaf, &list)) {
+        goto fail;
+    }
+
+    bs = malloc(sizeof(ipforest_bsearch_t));
+    if (!bs) {
+        goto fail;
+    }
+    memset(bs, 0, sizeof(ipforest_bsearch_t));
+
+    for (plen = 0; plen <= 32; plen++) {
+        if (list.lengths[plen]) {
+            index[plen] = bs->count;
+            bs->tables[bs->count++].plen = plen;
+        }
+    }
+
+    memset(sizes, 0, sizeof(sizes));
+    for (n = 0; n < list.count; n++) {
+        _place(bs, index[list.leaves[n].mask], list.leaves[n].addr, sizes);
+    }
+
+    /* at most half full, markers shared by prefixes only count once */
+    for (i = 0; i < bs->count; i++) {
+        bits = 2;
+        while (bits < 31 && (1u << bits) < sizes[i] * 2) {
+            bits++;
+        }
+        bs->tables[i].mask = (1u << bits) - 1;
+        bs->tables[i].shift = 32 - bits;
+        bs->tables[i].slots = calloc(1u << bits, sizeof(ipforest_bsearch_slot_t));
+        if (!bs->tables[i].slots) {
+            goto fail;
+        }
+    }
+
+    for (n = 0; n < list.count; n++) {
+        _place(bs, index[list.leaves[n].mask], list.leaves[n].addr, NULL);
+    }
+
+    free(list.leaves);
+    return bs;
+
+fail:
+    if (bs) {
+        ipforest_bsearch_free(bs);
+    }
+    free(list.leaves);
+    return NULL;
+}
+
+void
+ipforest_bsearch_free(ipforest_bsearch_t *bs)
+{
+    int i;
+
+    for (i = 0; i < bs->count; i++) {
+        free(bs->tables[i].slots);
+    }
+    free(bs);
+}
+
+IPFOREST_BOOLEAN
+ipforest_bsearch_lookup(const ipforest_bsearch_t *bs, uint32_t addr)
+{
+    int lo, hi, mid;
+    uint32_t kind;
+    const ipforest_bsearch_table_t *table;
+
+    lo = 0;
+    hi = bs->count - 1;
+
+    while (lo <= hi) {
+        mid = (lo + hi) >> 1;
+        table = &bs->tables[mid];
+
+        kind = _find(table, _key(addr, table->plen));
+        if (kind == IPFOREST_BSEARCH_PREFIX) {
+            return IPFOREST_TRUE;
+        }
+
+        /* a longer prefix starts with these bits, no shorter one can match */
+        if (kind == IPFOREST_BSEARCH_MARKER) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return IPFOREST_FALSE;
+}
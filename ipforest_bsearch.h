@@ -0,0 +1,43 @@
+#ifndef IPFOREST_BSEARCH
+#define IPFOREST_BSEARCH
+
+#include "ipforest_types.h"
+#include "ipforest_radix_tree.h"
+
+/*
+ * read only binary search on prefix lengths (Waldvogel et al.).
+ *
+ * one open addressing hash table per prefix length present, ordered by
+ * length. a lookup probes the middle length and goes longer on a marker,
+ * shorter on a miss, so it takes about log2(lengths) probes. markers are
+ * put where the search for a longer prefix passes. leaves of the radix tree
+ * never overlap, so a marker needs no best match of its own.
+ */
+
+/* auto selection picks this engine up to that many prefix lengths */
+#define IPFOREST_BSEARCH_SPARSE 3
+
+typedef struct ipforest_bsearch_slot_s {
+    uint32_t key;              /* the prefix bits, right aligned */
+    uint32_t kind;             /* empty, prefix or marker */
+} ipforest_bsearch_slot_t;
+
+typedef struct ipforest_bsearch_table_s {
+    ipforest_bsearch_slot_t *slots;
+    uint32_t mask;             /* number of slots - 1 */
+    uint32_t shift;            /* 32 - log2(slots) */
+    int plen;
+} ipforest_bsearch_table_t;
+
+typedef struct ipforest_bsearch_s {
+    ipforest_bsearch_table_t tables[33];   /* by length, the first count used */
+    int count;
+} ipforest_bsearch_t;
+
+/* number of distinct prefix lengths of the leaves of tree */
+int ipforest_bsearch_lengths(ipforest_radix_tree_t *tree);
+ipforest_bsearch_t * ipforest_bsearch_build(ipforest_radix_tree_t *tree);
+void ipforest_bsearch_free(ipforest_bsearch_t *bs);
+IPFOREST_BOOLEAN ipforest_bsearch_lookup(const ipforest_bsearch_t *bs, uint32_t addr);
+
+#endif
@@ -0,0 +1,153 @@
+/* ipforest-compile - turn a static ip list into a C matcher
+ *
+ * usage: ipforest-compile <list file> <output .c file>
+ *
+ * the list is parsed and aggregated like ipforest.load does, then emitted as
+ * a balanced tree of constant compares over its disjoint address intervals.
+ * build the output into a shared object and hand it to ipforest.load_compiled:
+ *
+ *   cc -O2 -fpic -shared -o list.so list.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ipforest_types.h"
+#include "ipforest_radix_tree.h"
+#include "ipforest_loader.h"
+
+typedef struct ipforest_compile_ctx_s {
+    uint32_t *lows;
+    uint32_t *highs;
+    uint32_t count;
+    uint32_t cap;
+} ipforest_compile_ctx_t;
+
+/* merge in order leaves into disjoint intervals */
+static IPFOREST_BOOLEAN
+_push_leaf(uint32_t addr, uint32_t mask, void *data)
+{
+    uint32_t cap;
+    ipforest_compile_ctx_t *ctx;
+
+    ctx = data;
+
+    if (ctx->count > 0 && ctx->highs[ctx->count - 1] != 0xffffffff
+        && addr == ctx->highs[ctx->count - 1] + 1) {
+        ctx->highs[ctx->count - 1] = addr | ~mask;
+        return IPFOREST_TRUE;
+    }
+
+    if (ctx->count == ctx->cap) {
+        cap = ctx->cap ? ctx->cap << 1 : 256;
+        ctx->lows = realloc(ctx->lows, cap * sizeof(uint32_t));
+        ctx->highs = realloc(ctx->highs, cap * sizeof(uint32_t));
+        if (!ctx->lows || !ctx->highs) {
+            return IPFOREST_FALSE;
+        }
+        ctx->cap = cap;
+    }
+
+    ctx->lows[ctx->count] = addr;
+    ctx->highs[ctx->count] = addr | ~mask;
+    ctx->count++;
+
+    return IPFOREST_TRUE;
+}
+
+inline static void
+_indent(FILE *out, int depth)
+{
+    fprintf(out, "%*s", (depth + 1) * 4, "");
+}
+
+/*
+ * emit the decision for intervals [lo, hi], a is known to be >= floor
+ */
+static void
+_emit(FILE *out, ipforest_compile_ctx_t *ctx, int64_t lo, int64_t hi,
+      uint32_t floor, int depth)
+{
+    int64_t mid;
+
+    if (lo > hi) {
+        _indent(out, depth);
+        fprintf(out, "return 0;\n");
+        return;
+    }
+
+    if (lo == hi) {
+        _indent(out, depth);
+        if (ctx->lows[lo] <= floor && ctx->highs[lo] == 0xffffffff) {
+            fprintf(out, "return 1;\n");
+        } else if (ctx->lows[lo] <= floor) {
+            fprintf(out, "return a <= 0x%08xu;\n", ctx->highs[lo]);
+        } else if (ctx->highs[lo] == 0xffffffff) {
+            fprintf(out, "return a >= 0x%08xu;\n", ctx->lows[lo]);
+        } else {
+            fprintf(out, "return a >= 0x%08xu && a <= 0x%08xu;\n",
+                    ctx->lows[lo], ctx->highs[lo]);
+        }
+        return;
+    }
+
+    mid = (lo + hi + 1) / 2;
+
+    _indent(out, depth);
+    fprintf(out, "if (a < 0x%08xu) {\n", ctx->lows[mid]);
+    _emit(out, ctx, lo, mid - 1, floor, depth + 1);
+    _indent(out, depth);
+    fprintf(out, "} else {\n");
+    _emit(out, ctx, mid, hi, ctx->lows[mid], depth + 1);
+    _indent(out, depth);
+    fprintf(out, "}\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    FILE *out;
+    ipforest_radix_tree_t *tree;
+    ipforest_compile_ctx_t ctx;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <list file> <output .c file>\n", argv[0]);
+        return 1;
+    }
+
+    tree = ipforest_load_file(argv[1]);
+    if (!tree) {
+        fprintf(stderr, "%s: failed to load %s\n", argv[0], argv[1]);
+        return 1;
+    }
+
+    memset(&ctx, 0, sizeof(ipforest_compile_ctx_t));
+    if (!ipforest_radix_tree_walk(tree, _push_leaf, &ctx)) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+
+    out = fopen(argv[2], "w");
+    if (!out) {
+        fprintf(stderr, "%s: failed to open %s\n", argv[0], argv[2]);
+        return 1;
+    }
+
+    fprintf(out, "/* generated by ipforest-compile from %s, do not edit */\n\n", argv[1]);
+    fprintf(out, "#include <stdint.h>\n\n");
+    fprintf(out, "/* %u disjoint intervals */\n", ctx.count);
+    fprintf(out, "int\nipforest_compiled_match(uint32_t a)\n{\n");
+    _emit(out, &ctx, 0, (int64_t)ctx.count - 1, 0, 0);
+    fprintf(out, "}\n");
+
+    if (fclose(out) != 0) {
+        fprintf(stderr, "%s: failed to write %s\n", argv[0], argv[2]);
+        return 1;
+    }
+
+    free(ctx.lows);
+    free(ctx.highs);
+    ipforest_radix_tree_free(tree);
+
+    return 0;
+}
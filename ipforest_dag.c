@@ -0,0 +1,314 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "ipforest_types.h"
+#include "ipforest_radix_tree.h"
+#include "ipforest_dag.h"
+
+/* one node stands for every fully listed subtree, it is never freed */
+static ipforest_dag_node_t ipforest_dag_leaf;
+
+#define IPFOREST_DAG_LEAF (&ipforest_dag_leaf)
+
+/* guards the node table and every reference count */
+static pthread_mutex_t ipforest_dag_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ipforest_dag_node_t **ipforest_dag_buckets = NULL;
+static uint32_t ipforest_dag_mask = 0;
+static uint32_t ipforest_dag_count = 0;
+
+inline static uint32_t
+_hash_children(ipforest_dag_node_t *l, ipforest_dag_node_t *r)
+{
+    uint64_t key;
+
+    key = (uint64_t)(uintptr_t)l * 0x9e3779b97f4a7c15ULL ^ (uint64_t)(uintptr_t)r;
+
+    /* murmur3 finalizer */
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+
+    return (uint32_t)key;
+}
+
+/*
+ * double the buckets, keep chains short, lock should be held
+ */
+inline static IPFOREST_BOOLEAN
+_grow()
+{
+    uint32_t i, nbuckets;
+    ipforest_dag_node_t **buckets, *node, *next;
+
+    nbuckets = ipforest_dag_buckets ? (ipforest_dag_mask + 1) << 1 : 1024;
+    buckets = calloc(nbuckets, sizeof(ipforest_dag_node_t *));
+    if (!buckets) {
+        return IPFOREST_FALSE;
+    }
+
+    if (ipforest_dag_buckets) {
+        for (i = 0; i <= ipforest_dag_mask; i++) {
+            for (node = ipforest_dag_buckets[i]; node; node = next) {
+                next = node->next;
+                node->next = buckets[node->hash & (nbuckets - 1)];
+                buckets[node->hash & (nbuckets - 1)] = node;
+            }
+        }
+        free(ipforest_dag_buckets);
+    }
+
+    ipforest_dag_buckets = buckets;
+    ipforest_dag_mask = nbuckets - 1;
+
+    return IPFOREST_TRUE;
+}
+
+/*
+ * drop a reference, a node nobody points to goes away with the references
+ * it holds on its children. lock should be held
+ */
+static void
+_release(ipforest_dag_node_t *node)
+{
+    ipforest_dag_node_t **pp;
+
+    if (!node || node == IPFOREST_DAG_LEAF) {
+        return;
+    }
+
+    if (--node->refs > 0) {
+        return;
+    }
+
+    for (pp = &ipforest_dag_buckets[node->hash & ipforest_dag_mask]; *pp != node; pp = &(*pp)->next);
+    *pp = node->next;
+    ipforest_dag_count--;
+
+    _release(node->l);
+    _release(node->r);
+    free(node);
+}
+
+/*
+ * the node with children l and r, taking over the references on them.
+ * lock should be held
+ */
+static ipforest_dag_node_t *
+_intern(ipforest_dag_node_t *l, ipforest_dag_node_t *r, IPFOREST_BOOLEAN *failed)
+{
+    uint32_t hash;
+    ipforest_dag_node_t *node;
+
+    /* same normal form whatever shape the radix tree was left in */
+    if (!l && !r) {
+        return NULL;
+    }
+    if (l == IPFOREST_DAG_LEAF && r == IPFOREST_DAG_LEAF) {
+        return IPFOREST_DAG_LEAF;
+    }
+
+    hash = _hash_children(l, r);
+
+    for (node = ipforest_dag_buckets[hash & ipforest_dag_mask]; node; node = node->next) {
+        if (node->l == l && node->r == r) {
+            /* it already holds its own references on them */
+            _release(l);
+            _release(r);
+            node->refs++;
+            return node;
+        }
+    }
+
+    if (ipforest_dag_count >= ipforest_dag_mask && !_grow()) {
+        goto fail;
+    }
+
+    node = malloc(sizeof(ipforest_dag_node_t));
+    if (!node) {
+        goto fail;
+    }
+
+    node->l = l;
+    node->r = r;
+    node->hash = hash;
+    node->refs = 1;
+    node->next = ipforest_dag_buckets[hash & ipforest_dag_mask];
+    ipforest_dag_buckets[hash & ipforest_dag_mask] = node;
+    ipforest_dag_count++;
+
+    return node;
+
+fail:
+    _release(l);
+    _release(r);
+    *failed = IPFOREST_TRUE;
+    return NULL;
+}
+
+/* post order, children are interned before their parent */
+static ipforest_dag_node_t *
+_freeze_node(ipforest_radix_tree_node_t *node, IPFOREST_BOOLEAN *failed)
+{
+    ipforest_dag_node_t *l, *r;
+
+    if (!node) {
+        return NULL;
+    }
+
+    if (IPFOREST_RADIX_TREE_IS_LEAF(node)) {
+        return IPFOREST_DAG_LEAF;
+    }
+
+    l = _freeze_node(node->l, failed);
+    if (*failed) {
+        return NULL;
+    }
+
+    r = _freeze_node(node->r, failed);
+    if (*failed) {
+        _release(l);
+        return NULL;
+    }
+
+    return _intern(l, r, failed);
+}
+
+/*
+ * turn tree into its shared form, tree is left untouched
+ */
+ipforest_dag_t *
+ipforest_dag_freeze(ipforest_radix_tree_t *tree)
+{
+    IPFOREST_BOOLEAN failed;
+    ipforest_dag_t *dag;
+
+    dag = malloc(sizeof(ipforest_dag_t));
+    if (!dag) {
+        return NULL;
+    }
+
+    failed = IPFOREST_FALSE;
+
+    pthread_mutex_lock(&ipforest_dag_lock);
+
+    if (!ipforest_dag_buckets && !_grow()) {
+        failed = IPFOREST_TRUE;
+    } else {
+        dag->root = _freeze_node(&tree->root, &failed);
+    }
+
+    pthread_mutex_unlock(&ipforest_dag_lock);
+
+    if (failed) {
+        free(dag);
+        return NULL;
+    }
+
+    return dag;
+}
+
+void
+ipforest_dag_free(ipforest_dag_t *dag)
+{
+    pthread_mutex_lock(&ipforest_dag_lock);
+    _release(dag->root);
+    pthread_mutex_unlock(&ipforest_dag_lock);
+
+    free(dag);
+}
+
+IPFOREST_BOOLEAN
+ipforest_dag_lookup(const ipforest_dag_t *dag, uint32_t addr)
+{
+    const ipforest_dag_node_t *cur;
+
+    cur = dag->root;
+
+    /* depth never goes past 32, a node there is always the leaf */
+    while (cur && cur != IPFOREST_DAG_LEAF) {
+        cur = (addr & 0x80000000) ? cur->r : cur->l;
+        addr = addr << 1;
+    }
+
+    return cur == IPFOREST_DAG_LEAF;
+}
+
+/* last address under a prefix of depth bits at addr */
+#define IPFOREST_DAG_END(addr, depth) \
+    ((addr) | ((depth) ? ~(0xffffffff << (32 - (depth))) : 0xffffffff))
+
+/* first prefix below node not ending before from, listed or empty as asked */
+static IPFOREST_BOOLEAN
+_first_node(const ipforest_dag_node_t *node, IPFOREST_BOOLEAN listed,
+            uint32_t addr, int depth, uint32_t from, uint32_t *paddr, int *plen)
+{
+    if (IPFOREST_DAG_END(addr, depth) < from) {
+        return IPFOREST_FALSE;
+    }
+
+    if ((listed && node == IPFOREST_DAG_LEAF) || (!listed && !node)) {
+        *paddr = addr;
+        *plen = depth;
+        return IPFOREST_TRUE;
+    }
+
+    if (!node || node == IPFOREST_DAG_LEAF) {
+        return IPFOREST_FALSE;
+    }
+
+    return _first_node(node->l, listed, addr, depth + 1, from, paddr, plen)
+        || _first_node(node->r, listed, addr | (1u << (31 - depth)), depth + 1, from, paddr, plen);
+}
+
+static IPFOREST_BOOLEAN
+_diff_node(const ipforest_dag_node_t *a, const ipforest_dag_node_t *b,
+           uint32_t addr, int depth, uint32_t from,
+           uint32_t *paddr, int *plen, IPFOREST_BOOLEAN *added)
+{
+    /* identical subtrees are one node, nothing below differs */
+    if (a == b || IPFOREST_DAG_END(addr, depth) < from) {
+        return IPFOREST_FALSE;
+    }
+
+    if (!a || !b) {
+        *added = !a;
+        return _first_node(a ? a : b, IPFOREST_TRUE, addr, depth, from, paddr, plen);
+    }
+
+    /* what the other side leaves empty below a covered prefix */
+    if (a == IPFOREST_DAG_LEAF || b == IPFOREST_DAG_LEAF) {
+        *added = a == IPFOREST_DAG_LEAF ? IPFOREST_FALSE : IPFOREST_TRUE;
+        return _first_node(a == IPFOREST_DAG_LEAF ? b : a, IPFOREST_FALSE,
+                           addr, depth, from, paddr, plen);
+    }
+
+    return _diff_node(a->l, b->l, addr, depth + 1, from, paddr, plen, added)
+        || _diff_node(a->r, b->r, addr | (1u << (31 - depth)), depth + 1, from, paddr, plen, added);
+}
+
+/*
+ * as ipforest_radix_tree_diff_next, but subtrees both trees share are
+ * skipped without a look, the walk only goes where they differ
+ */
+IPFOREST_BOOLEAN
+ipforest_dag_diff_next(const ipforest_dag_t *odag, const ipforest_dag_t *ndag,
+                       uint32_t from, uint32_t *paddr, int *plen, IPFOREST_BOOLEAN *added)
+{
+    return _diff_node(odag->root, ndag->root, 0, 0, from, paddr, plen, added);
+}
+
+/* number of distinct nodes across every frozen tree */
+uint32_t
+ipforest_dag_nodes()
+{
+    uint32_t count;
+
+    pthread_mutex_lock(&ipforest_dag_lock);
+    count = ipforest_dag_count;
+    pthread_mutex_unlock(&ipforest_dag_lock);
+
+    return count;
+}
@@ -0,0 +1,34 @@
+#ifndef IPFOREST_DAG
+#define IPFOREST_DAG
+
+#include "ipforest_types.h"
+#include "ipforest_radix_tree.h"
+
+/*
+ * frozen trees with identical subtrees stored once, process wide.
+ *
+ * a node is hash-consed on its two children, so two subtrees of the same
+ * shape are the same node whichever tree or lua_State they come from. nodes
+ * are reference counted and never change once made, lookups need no lock.
+ */
+
+typedef struct ipforest_dag_node_s {
+    struct ipforest_dag_node_s *l;      /* NULL if nothing listed below */
+    struct ipforest_dag_node_s *r;
+    struct ipforest_dag_node_s *next;   /* next in hash bucket */
+    uint32_t hash;
+    uint32_t refs;                      /* parents + trees */
+} ipforest_dag_node_t;
+
+typedef struct ipforest_dag_s {
+    ipforest_dag_node_t *root;          /* NULL for an empty tree */
+} ipforest_dag_t;
+
+ipforest_dag_t * ipforest_dag_freeze(ipforest_radix_tree_t *tree);
+void ipforest_dag_free(ipforest_dag_t *dag);
+IPFOREST_BOOLEAN ipforest_dag_lookup(const ipforest_dag_t *dag, uint32_t addr);
+IPFOREST_BOOLEAN ipforest_dag_diff_next(const ipforest_dag_t *odag, const ipforest_dag_t *ndag,
+                                        uint32_t from, uint32_t *paddr, int *plen, IPFOREST_BOOLEAN *added);
+uint32_t ipforest_dag_nodes();
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef IPFOREST_ENGINE
+#define IPFOREST_ENGINE
+
+#include <sys/types.h>
+#include "ipforest_types.h"
+#include "ipforest_radix_tree.h"
+#include "ipforest.h"
+
+/*
+ * library internals shared with the lua binding, not installed
+ */
+
+/* read only lookup engine compiled from a radix tree */
+typedef struct ipforest_engine_s {
+    const char *name;
+    void * (*build)(ipforest_radix_tree_t *tree);
+    IPFOREST_BOOLEAN (*lookup)(const void *compiled, uint32_t addr);
+    void (*free)(void *compiled);
+} ipforest_engine_t;
+
+/* the file a forest holds exactly, as it was when loaded */
+typedef struct ipforest_source_s {
+    char *fname;                       /* NULL if none or changed since */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+    uint64_t hash;                     /* FNV-1a of the content */
+} ipforest_source_t;
+
+/*
+ * the radix tree takes inserts, the compiled engine if any answers lookups
+ * in its place. a frozen forest keeps whichever is needed for lookups only
+ */
+struct ipforest_s {
+    ipforest_radix_tree_t *tree;       /* NULL once frozen into an engine */
+    const ipforest_engine_t *engine;   /* selected engine, NULL for radix */
+    void *compiled;                    /* NULL if not compiled or stale */
+    IPFOREST_BOOLEAN automatic;        /* engine picked from the tree on build */
+    IPFOREST_BOOLEAN frozen;
+    ipforest_source_t source;
+};
+
+IPFOREST_BOOLEAN ipforest_find_engine(const char *name, const ipforest_engine_t **pengine);
+ipforest_t * ipforest_wrap_tree(ipforest_radix_tree_t *tree);
+ipforest_t * ipforest_wrap_compiled(const ipforest_engine_t *engine, void *compiled);
+void * ipforest_compiled(const ipforest_t *forest, const char *name);
+
+#endif
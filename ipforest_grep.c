@@ -0,0 +1,469 @@
+/* ipforest-grep - print or count log lines whose address is listed
+ *
+ * usage: ipforest-grep [-c] [-v] [-j threads] [-f field] [-d delim]
+ *                      [-o offset] -l list [-l list ...] file ...
+ *
+ *   -l list    ip list file in the format ipforest.load takes, repeatable
+ *   -f field   1 based field holding the address, 1 by default
+ *   -d delim   field delimiter, a single character, space by default
+ *   -o offset  the address starts at this byte of every line, overrides -f
+ *   -j threads worker threads, number of online cpus by default
+ *   -c         print the number of matching lines per file instead
+ *   -v         select lines that do not match
+ *
+ * lists are merged into one radix tree and turned into a poptrie, which
+ * lookups only read so threads share it without locking. every log is mapped
+ * and cut into chunks that threads pick in turn, a chunk owns the lines
+ * starting inside it. matching lines are written straight from the mapping
+ * in input order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ipforest_types.h"
+#include "ipforest_radix_tree.h"
+#include "ipforest_loader.h"
+#include "ipforest_poptrie.h"
+
+#define IPFOREST_GREP_CHUNK (8 * 1024 * 1024)
+
+/* a matching line to write out */
+typedef struct ipforest_grep_span_s {
+    const char *start;
+    size_t len;
+} ipforest_grep_span_t;
+
+typedef struct ipforest_grep_chunk_s {
+    ipforest_grep_span_t *spans;
+    uint32_t count;
+    uint32_t cap;
+    IPFOREST_BOOLEAN done;
+} ipforest_grep_chunk_t;
+
+typedef struct ipforest_grep_s {
+    const ipforest_poptrie_t *trie;
+    int field;
+    char delim;
+    long offset;               /* -1 if by field */
+    IPFOREST_BOOLEAN count_only;
+    IPFOREST_BOOLEAN invert;
+
+    /* the file being scanned */
+    const char *data;
+    size_t size;
+    uint32_t nchunks;
+    uint32_t next;             /* next chunk to pick, atomic */
+    uint64_t matched;          /* atomic */
+    ipforest_grep_chunk_t *chunks;
+
+    /* chunks before flushed are written out, guarded by lock */
+    pthread_mutex_t lock;
+    uint32_t flushed;
+    IPFOREST_BOOLEAN failed;
+} ipforest_grep_t;
+
+/*
+ * dotted quad at p, strict enough to reject what is not an address but no
+ * more, the address may be followed by anything but a digit or '.'
+ */
+inline static IPFOREST_BOOLEAN
+_parse_addr(const char *p, const char *end, uint32_t *paddr)
+{
+    int i, digits;
+    uint32_t addr, octet;
+
+    addr = 0;
+
+    for (i = 0; i < 4; i++) {
+        if (i > 0) {
+            if (p >= end || *p != '.') {
+                return IPFOREST_FALSE;
+            }
+            p++;
+        }
+
+        octet = 0;
+        digits = 0;
+        while (p < end && *p >= '0' && *p <= '9' && digits < 3) {
+            octet = octet * 10 + (*p - '0');
+            digits++;
+            p++;
+        }
+
+        if (digits == 0 || octet > 255) {
+            return IPFOREST_FALSE;
+        }
+
+        addr = (addr << 8) | octet;
+    }
+
+    if (p < end && ((*p >= '0' && *p <= '9') || *p == '.')) {
+        return IPFOREST_FALSE;
+    }
+
+    *paddr = addr;
+    return IPFOREST_TRUE;
+}
+
+/* tell if line [p, end) selects, '\n' excluded */
+inline static IPFOREST_BOOLEAN
+_select_line(ipforest_grep_t *grep, const char *p, const char *end)
+{
+    int field;
+    uint32_t addr;
+    IPFOREST_BOOLEAN hit;
+
+    if (grep->offset >= 0) {
+        p += grep->offset;
+    } else {
+        for (field = 1; field < grep->field && p; field++) {
+            p = memchr(p, grep->delim, end - p);
+            if (p) {
+                p++;
+            }
+        }
+    }
+
+    hit = p && p < end && _parse_addr(p, end, &addr)
+        && ipforest_poptrie_lookup(grep->trie, addr);
+
+    return hit != grep->invert;
+}
+
+inline static IPFOREST_BOOLEAN
+_push_span(ipforest_grep_chunk_t *chunk, const char *start, size_t len)
+{
+    uint32_t cap;
+    ipforest_grep_span_t *spans;
+
+    if (chunk->count == chunk->cap) {
+        cap = chunk->cap ? chunk->cap << 1 : 256;
+        spans = realloc(chunk->spans, cap * sizeof(ipforest_grep_span_t));
+        if (!spans) {
+            return IPFOREST_FALSE;
+        }
+        chunk->spans = spans;
+        chunk->cap = cap;
+    }
+
+    chunk->spans[chunk->count].start = start;
+    chunk->spans[chunk->count].len = len;
+    chunk->count++;
+
+    return IPFOREST_TRUE;
+}
+
+/* first line starting at or after pos */
+inline static const char *
+_line_start(ipforest_grep_t *grep, size_t pos)
+{
+    const char *p;
+
+    if (pos == 0) {
+        return grep->data;
+    }
+    if (pos >= grep->size) {
+        return grep->data + grep->size;
+    }
+
+    p = memchr(grep->data + pos - 1, '\n', grep->size - pos + 1);
+    return p ? p + 1 : grep->data + grep->size;
+}
+
+static IPFOREST_BOOLEAN
+_scan_chunk(ipforest_grep_t *grep, uint32_t i, uint64_t *matched)
+{
+    const char *p, *end, *eol, *last;
+    ipforest_grep_chunk_t *chunk;
+
+    chunk = &grep->chunks[i];
+    p = _line_start(grep, (size_t)i * IPFOREST_GREP_CHUNK);
+    end = _line_start(grep, (size_t)(i + 1) * IPFOREST_GREP_CHUNK);
+    last = grep->data + grep->size;
+
+    while (p < end) {
+        eol = memchr(p, '\n', last - p);
+        if (!eol) {
+            eol = last;
+        }
+
+        if (_select_line(grep, p, eol)) {
+            *matched += 1;
+            /* keep the '\n' if there is one */
+            if (!grep->count_only && !_push_span(chunk, p, eol - p + (eol < last))) {
+                return IPFOREST_FALSE;
+            }
+        }
+
+        p = eol + 1;
+    }
+
+    return IPFOREST_TRUE;
+}
+
+/*
+ * write out every finished chunk in order, whoever finishes the chunk the
+ * writer waits for does the writing
+ */
+static void
+_flush_chunks(ipforest_grep_t *grep, uint32_t i)
+{
+    uint32_t j;
+    ipforest_grep_chunk_t *chunk;
+
+    pthread_mutex_lock(&grep->lock);
+
+    grep->chunks[i].done = IPFOREST_TRUE;
+
+    while (grep->flushed < grep->nchunks && grep->chunks[grep->flushed].done) {
+        chunk = &grep->chunks[grep->flushed];
+
+        for (j = 0; j < chunk->count; j++) {
+            fwrite(chunk->spans[j].start, 1, chunk->spans[j].len, stdout);
+        }
+        /* a last line without '\n' still ends in one */
+        if (chunk->count > 0) {
+            j = chunk->count - 1;
+            if (chunk->spans[j].start[chunk->spans[j].len - 1] != '\n') {
+                fputc('\n', stdout);
+            }
+        }
+
+        free(chunk->spans);
+        chunk->spans = NULL;
+        grep->flushed++;
+    }
+
+    pthread_mutex_unlock(&grep->lock);
+}
+
+static void *
+_worker(void *data)
+{
+    uint32_t i;
+    uint64_t matched;
+    ipforest_grep_t *grep;
+
+    grep = data;
+    matched = 0;
+
+    while ((i = __sync_fetch_and_add(&grep->next, 1)) < grep->nchunks) {
+        if (!_scan_chunk(grep, i, &matched)) {
+            grep->failed = IPFOREST_TRUE;
+        }
+        if (!grep->count_only) {
+            _flush_chunks(grep, i);
+        }
+    }
+
+    __sync_fetch_and_add(&grep->matched, matched);
+    return NULL;
+}
+
+static IPFOREST_BOOLEAN
+_grep_file(ipforest_grep_t *grep, const char *fname, int nthreads, IPFOREST_BOOLEAN show_name)
+{
+    int fd, i, started;
+    struct stat st;
+    void *data;
+    pthread_t *threads;
+
+    fd = open(fname, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        goto fail;
+    }
+
+    data = NULL;
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            goto fail;
+        }
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    fd = -1;
+
+    grep->data = data;
+    grep->size = st.st_size;
+    grep->nchunks = (grep->size + IPFOREST_GREP_CHUNK - 1) / IPFOREST_GREP_CHUNK;
+    grep->next = 0;
+    grep->matched = 0;
+    grep->flushed = 0;
+    grep->failed = IPFOREST_FALSE;
+    grep->chunks = calloc(grep->nchunks ? grep->nchunks : 1, sizeof(ipforest_grep_chunk_t));
+    threads = malloc((nthreads ? nthreads : 1) * sizeof(pthread_t));
+
+    if (!grep->chunks || !threads) {
+        grep->failed = IPFOREST_TRUE;
+        grep->nchunks = 0;
+    }
+
+    /* no more threads than chunks */
+    if ((uint32_t)nthreads > grep->nchunks) {
+        nthreads = grep->nchunks;
+    }
+
+    for (started = 0; started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, _worker, grep) != 0) {
+            break;
+        }
+    }
+
+    /* the current thread does its share, or all of it */
+    _worker(grep);
+
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (grep->count_only && !grep->failed) {
+        if (show_name) {
+            printf("%s:", fname);
+        }
+        printf("%llu\n", (unsigned long long)grep->matched);
+    }
+
+    free(threads);
+    if (grep->chunks) {
+        for (i = 0; (uint32_t)i < grep->nchunks; i++) {
+            free(grep->chunks[i].spans);
+        }
+        free(grep->chunks);
+    }
+    if (data) {
+        munmap(data, st.st_size);
+    }
+
+    return !grep->failed;
+
+fail:
+    if (fd >= 0) {
+        close(fd);
+    }
+    return IPFOREST_FALSE;
+}
+
+static IPFOREST_BOOLEAN
+_merge_leaf(uint32_t addr, uint32_t mask, void *ctx)
+{
+    return ipforest_radix_tree_insert(ctx, addr, mask);
+}
+
+static void
+_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-c] [-v] [-j threads] [-f field] [-d delim] "
+            "[-o offset] -l list [-l list ...] file ...\n", name);
+}
+
+int
+main(int argc, char **argv)
+{
+    int opt, i, nthreads, status;
+    ipforest_radix_tree_t *tree, *list;
+    ipforest_poptrie_t *trie;
+    ipforest_grep_t grep;
+
+    memset(&grep, 0, sizeof(ipforest_grep_t));
+    grep.field = 1;
+    grep.delim = ' ';
+    grep.offset = -1;
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    tree = NULL;
+
+    while ((opt = getopt(argc, argv, "cvj:f:d:o:l:")) != -1) {
+        switch (opt) {
+        case 'c':
+            grep.count_only = IPFOREST_TRUE;
+            break;
+        case 'v':
+            grep.invert = IPFOREST_TRUE;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'f':
+            grep.field = atoi(optarg);
+            break;
+        case 'd':
+            if (strlen(optarg) != 1) {
+                _usage(argv[0]);
+                return 2;
+            }
+            grep.delim = optarg[0];
+            break;
+        case 'o':
+            grep.offset = atol(optarg);
+            break;
+        case 'l':
+            list = ipforest_load_file(optarg);
+            if (!list) {
+                fprintf(stderr, "%s: failed to load %s\n", argv[0], optarg);
+                return 2;
+            }
+            if (!tree) {
+                tree = list;
+                break;
+            }
+            if (!ipforest_radix_tree_walk(list, _merge_leaf, tree)) {
+                fprintf(stderr, "%s: out of memory\n", argv[0]);
+                return 2;
+            }
+            ipforest_radix_tree_free(list);
+            break;
+        default:
+            _usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (!tree || optind >= argc || grep.field < 1 || grep.offset < -1) {
+        _usage(argv[0]);
+        return 2;
+    }
+
+    /* the caller thread is a worker too */
+    nthreads = nthreads > 1 ? nthreads - 1 : 0;
+
+    trie = ipforest_poptrie_build(tree);
+    ipforest_radix_tree_free(tree);
+    if (!trie) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 2;
+    }
+    grep.trie = trie;
+
+    if (pthread_mutex_init(&grep.lock, NULL) != 0) {
+        return 2;
+    }
+
+    /* like grep, 0 if any line selected, 1 if none, 2 on error */
+    status = 1;
+    for (i = optind; i < argc; i++) {
+        if (!_grep_file(&grep, argv[i], nthreads, argc - optind > 1)) {
+            fprintf(stderr, "%s: failed to scan %s\n", argv[0], argv[i]);
+            status = 2;
+            continue;
+        }
+        if (grep.matched > 0 && status == 1) {
+            status = 0;
+        }
+    }
+
+    if (fflush(stdout) != 0) {
+        status = 2;
+    }
+
+    pthread_mutex_destroy(&grep.lock);
+    ipforest_poptrie_free(trie);
+
+    return status;
+}
@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ipforest_types.h"
+#include "ipforest_hash.h"
+
+inline static uint32_t
+_hash_key(uint64_t key)
+{
+    /* murmur3 finalizer */
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+
+    return (uint32_t)key;
+}
+
+inline static ipforest_hash_entry_t *
+_alloc_slots(uint32_t nslots)
+{
+    uint32_t i;
+    ipforest_hash_entry_t *slots;
+
+    slots = malloc(nslots * sizeof(ipforest_hash_entry_t));
+    if (slots) {
+        for (i = 0; i < nslots; i++) {
+            slots[i].key = IPFOREST_HASH_EMPTY;
+        }
+    }
+
+    return slots;
+}
+
+/*
+ * double the slots, keep load factor under 1/2
+ */
+inline static IPFOREST_BOOLEAN
+_grow(ipforest_hash_t *hash)
+{
+    uint32_t i, j, nslots;
+    ipforest_hash_entry_t *slots;
+
+    nslots = (hash->mask + 1) << 1;
+    slots = _alloc_slots(nslots);
+    if (!slots) {
+        return IPFOREST_FALSE;
+    }
+
+    for (i = 0; i <= hash->mask; i++) {
+        if (hash->slots[i].key == IPFOREST_HASH_EMPTY) {
+            continue;
+        }
+
+        j = _hash_key(hash->slots[i].key) & (nslots - 1);
+        while (slots[j].key != IPFOREST_HASH_EMPTY) {
+            j = (j + 1) & (nslots - 1);
+        }
+        slots[j] = hash->slots[i];
+    }
+
+    free(hash->slots);
+    hash->slots = slots;
+    hash->mask = nslots - 1;
+
+    return IPFOREST_TRUE;
+}
+
+ipforest_hash_t *
+ipforest_hash_alloc(uint32_t hint)
+{
+    uint32_t nslots;
+    ipforest_hash_t *hash;
+
+    hash = malloc(sizeof(ipforest_hash_t));
+    if (!hash) {
+        return NULL;
+    }
+    memset(hash, 0, sizeof(ipforest_hash_t));
+
+    nslots = 16;
+    while (nslots < hint * 2) {
+        nslots = nslots << 1;
+    }
+
+    hash->slots = _alloc_slots(nslots);
+    if (!hash->slots) {
+        free(hash);
+        return NULL;
+    }
+    hash->mask = nslots - 1;
+
+    return hash;
+}
+
+void
+ipforest_hash_free(ipforest_hash_t *hash)
+{
+    free(hash->slots);
+    free(hash);
+}
+
+void
+ipforest_hash_clear(ipforest_hash_t *hash)
+{
+    uint32_t i;
+
+    for (i = 0; i <= hash->mask; i++) {
+        hash->slots[i].key = IPFOREST_HASH_EMPTY;
+    }
+    hash->count = 0;
+    memset(hash->lengths, 0, sizeof(hash->lengths));
+}
+
+uint64_t *
+ipforest_hash_find(ipforest_hash_t *hash, uint32_t addr, int plen)
+{
+    uint32_t i;
+    uint64_t key;
+
+    key = IPFOREST_HASH_KEY(addr, plen);
+    i = _hash_key(key) & hash->mask;
+
+    while (hash->slots[i].key != IPFOREST_HASH_EMPTY) {
+        if (hash->slots[i].key == key) {
+            return &hash->slots[i].value;
+        }
+        i = (i + 1) & hash->mask;
+    }
+
+    return NULL;
+}
+
+/*
+ * find or create entry, a created one has value 0. the returned pointer is
+ * only valid until the next insert
+ */
+uint64_t *
+ipforest_hash_insert(ipforest_hash_t *hash, uint32_t addr, int plen, IPFOREST_BOOLEAN *created)
+{
+    uint32_t i;
+    uint64_t key;
+
+    *created = IPFOREST_FALSE;
+
+    if ((hash->count + 1) * 2 > hash->mask + 1) {
+        if (!_grow(hash)) {
+            return NULL;
+        }
+    }
+
+    key = IPFOREST_HASH_KEY(addr, plen);
+    i = _hash_key(key) & hash->mask;
+
+    while (hash->slots[i].key != IPFOREST_HASH_EMPTY) {
+        if (hash->slots[i].key == key) {
+            return &hash->slots[i].value;
+        }
+        i = (i + 1) & hash->mask;
+    }
+
+    hash->slots[i].key = key;
+    hash->slots[i].value = 0;
+    hash->count++;
+    hash->lengths[plen]++;
+    *created = IPFOREST_TRUE;
+
+    return &hash->slots[i].value;
+}
+
+/*
+ * remove the entry in slot, entries after it in the probe run are shifted
+ * back so they stay reachable
+ */
+void
+ipforest_hash_remove_slot(ipforest_hash_t *hash, uint32_t slot)
+{
+    uint32_t i, j, k;
+
+    hash->count--;
+    hash->lengths[IPFOREST_HASH_KEY_PLEN(hash->slots[slot].key)]--;
+
+    i = slot;
+    j = slot;
+
+    do {
+        j = (j + 1) & hash->mask;
+        if (hash->slots[j].key == IPFOREST_HASH_EMPTY) {
+            break;
+        }
+
+        k = _hash_key(hash->slots[j].key) & hash->mask;
+
+        /* home slot in (i, j], entry can stay */
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+
+        hash->slots[i] = hash->slots[j];
+        i = j;
+    } while (IPFOREST_TRUE);
+
+    hash->slots[i].key = IPFOREST_HASH_EMPTY;
+}
+
+IPFOREST_BOOLEAN
+ipforest_hash_remove(ipforest_hash_t *hash, uint32_t addr, int plen)
+{
+    uint64_t *value;
+
+    value = ipforest_hash_find(hash, addr, plen);
+    if (!value) {
+        return IPFOREST_FALSE;
+    }
+
+    ipforest_hash_remove_slot(hash, CONTAINER_OF(value, value, ipforest_hash_entry_t) - hash->slots);
+    return IPFOREST_TRUE;
+}
@@ -0,0 +1,41 @@
+#ifndef IPFOREST_HASH
+#define IPFOREST_HASH
+
+#include "ipforest_types.h"
+
+/*
+ * open addressing hash of prefixes, (addr, prefix length) -> 64 bit value.
+ * linear probing with backward shift deletion, so no tombstones are left.
+ */
+
+#define IPFOREST_HASH_EMPTY ((uint64_t)-1)
+#define IPFOREST_HASH_KEY(addr, plen) (((uint64_t)(plen) << 32) | (addr))
+#define IPFOREST_HASH_KEY_ADDR(key) ((uint32_t)(key))
+#define IPFOREST_HASH_KEY_PLEN(key) ((int)((key) >> 32))
+
+/* prefix length <-> contiguous leading ones mask, as the radix tree sees it */
+#define IPFOREST_PLEN_MASK(plen) ((plen) ? (uint32_t)0xffffffff << (32 - (plen)) : 0)
+#define IPFOREST_MASK_PLEN(mask) \
+    ((uint32_t)(mask) == 0xffffffff ? 32 : __builtin_clz(~(uint32_t)(mask)))
+
+typedef struct ipforest_hash_entry_s {
+    uint64_t key;
+    uint64_t value;
+} ipforest_hash_entry_t;
+
+typedef struct ipforest_hash_s {
+    ipforest_hash_entry_t *slots;
+    uint32_t mask;           /* number of slots - 1 */
+    uint32_t count;
+    uint32_t lengths[33];    /* number of entries per prefix length */
+} ipforest_hash_t;
+
+ipforest_hash_t * ipforest_hash_alloc(uint32_t hint);
+void ipforest_hash_free(ipforest_hash_t *hash);
+void ipforest_hash_clear(ipforest_hash_t *hash);
+uint64_t * ipforest_hash_find(ipforest_hash_t *hash, uint32_t addr, int plen);
+uint64_t * ipforest_hash_insert(ipforest_hash_t *hash, uint32_t addr, int plen, IPFOREST_BOOLEAN *created);
+void ipforest_hash_remove_slot(ipforest_hash_t *hash, uint32_t slot);
+IPFOREST_BOOLEAN ipforest_hash_remove(ipforest_hash_t *hash, uint32_t addr, int plen);
+
+#endif
@@ -0,0 +1,275 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "ipforest_types.h"
+#include "ipforest_hash.h"
+#include "ipforest_hhh.h"
+
+/* weights stay under 2^IPFOREST_HHH_RESCALE before counts are rescaled */
+#define IPFOREST_HHH_RESCALE 32
+
+inline static double
+_age(const ipforest_hhh_t *hhh, uint64_t now)
+{
+    return now > hhh->landmark ? (double)(now - hhh->landmark) / hhh->half_life : 0;
+}
+
+/* put item at pos and tell the index where it went */
+inline static void
+_place(ipforest_hhh_t *hhh, ipforest_hhh_level_t *level, uint32_t pos, ipforest_hhh_item_t *item)
+{
+    level->heap[pos] = *item;
+    *ipforest_hash_find(hhh->index, item->addr, level->plen) = pos;
+}
+
+static void
+_sift_up(ipforest_hhh_t *hhh, ipforest_hhh_level_t *level, uint32_t pos)
+{
+    uint32_t parent;
+    ipforest_hhh_item_t item;
+
+    item = level->heap[pos];
+
+    while (pos > 0) {
+        parent = (pos - 1) / 2;
+        if (level->heap[parent].count <= item.count) {
+            break;
+        }
+        _place(hhh, level, pos, &level->heap[parent]);
+        pos = parent;
+    }
+
+    _place(hhh, level, pos, &item);
+}
+
+static void
+_sift_down(ipforest_hhh_t *hhh, ipforest_hhh_level_t *level, uint32_t pos)
+{
+    uint32_t child;
+    ipforest_hhh_item_t item;
+
+    item = level->heap[pos];
+
+    while ((child = pos * 2 + 1) < level->size) {
+        if (child + 1 < level->size && level->heap[child + 1].count < level->heap[child].count) {
+            child++;
+        }
+        if (item.count <= level->heap[child].count) {
+            break;
+        }
+        _place(hhh, level, pos, &level->heap[child]);
+        pos = child;
+    }
+
+    _place(hhh, level, pos, &item);
+}
+
+/* move the landmark to now, every count shrinks alike */
+static void
+_rescale(ipforest_hhh_t *hhh, uint64_t now)
+{
+    int i;
+    uint32_t j;
+    double factor;
+    ipforest_hhh_level_t *level;
+
+    factor = exp2(-_age(hhh, now));
+
+    for (i = 0; i < hhh->nlevels; i++) {
+        level = &hhh->levels[i];
+        for (j = 0; j < level->size; j++) {
+            level->heap[j].count *= factor;
+            level->heap[j].error *= factor;
+        }
+    }
+
+    hhh->total *= factor;
+    hhh->landmark = now;
+}
+
+ipforest_hhh_t *
+ipforest_hhh_alloc(const int *plens, int nlevels, uint32_t capacity,
+                   double half_life, uint64_t now)
+{
+    int i, j;
+    ipforest_hhh_t *hhh;
+
+    if (nlevels <= 0 || nlevels > IPFOREST_HHH_LEVELS || capacity == 0
+        || capacity > (1u << 24) || !(half_life > 0)) {
+        return NULL;
+    }
+
+    /* a prefix length twice would share index entries */
+    for (i = 0; i < nlevels; i++) {
+        if (plens[i] < 0 || plens[i] > 32) {
+            return NULL;
+        }
+        for (j = 0; j < i; j++) {
+            if (plens[i] == plens[j]) {
+                return NULL;
+            }
+        }
+    }
+
+    hhh = malloc(sizeof(ipforest_hhh_t));
+    if (!hhh) {
+        return NULL;
+    }
+    memset(hhh, 0, sizeof(ipforest_hhh_t));
+
+    hhh->nlevels = nlevels;
+    hhh->capacity = capacity;
+    hhh->half_life = half_life;
+    hhh->landmark = now;
+
+    /* sized up front, it never grows once every level is full */
+    hhh->index = ipforest_hash_alloc(capacity * nlevels);
+    if (!hhh->index) {
+        goto fail;
+    }
+
+    for (i = 0; i < nlevels; i++) {
+        hhh->levels[i].plen = plens[i];
+        hhh->levels[i].heap = malloc(capacity * sizeof(ipforest_hhh_item_t));
+        if (!hhh->levels[i].heap) {
+            goto fail;
+        }
+    }
+
+    return hhh;
+
+fail:
+    ipforest_hhh_free(hhh);
+    return NULL;
+}
+
+void
+ipforest_hhh_free(ipforest_hhh_t *hhh)
+{
+    int i;
+
+    for (i = 0; i < hhh->nlevels; i++) {
+        free(hhh->levels[i].heap);
+    }
+    if (hhh->index) {
+        ipforest_hash_free(hhh->index);
+    }
+    free(hhh);
+}
+
+/*
+ * count weight hits of addr at now on every level
+ */
+IPFOREST_BOOLEAN
+ipforest_hhh_count(ipforest_hhh_t *hhh, uint32_t addr, double weight, uint64_t now)
+{
+    int i;
+    uint32_t prefix;
+    uint64_t *pos;
+    double age, w;
+    IPFOREST_BOOLEAN created;
+    ipforest_hhh_item_t item;
+    ipforest_hhh_level_t *level;
+
+    age = _age(hhh, now);
+    if (age > IPFOREST_HHH_RESCALE) {
+        _rescale(hhh, now);
+        age = 0;
+    }
+
+    w = weight * exp2(age);
+    hhh->total += w;
+
+    for (i = 0; i < hhh->nlevels; i++) {
+        level = &hhh->levels[i];
+        prefix = addr & IPFOREST_PLEN_MASK(level->plen);
+
+        pos = ipforest_hash_find(hhh->index, prefix, level->plen);
+        if (pos) {
+            level->heap[*pos].count += w;
+            _sift_down(hhh, level, (uint32_t)*pos);
+            continue;
+        }
+
+        if (level->size < hhh->capacity) {
+            pos = ipforest_hash_insert(hhh->index, prefix, level->plen, &created);
+            if (!pos) {
+                return IPFOREST_FALSE;
+            }
+            level->heap[level->size].addr = prefix;
+            level->heap[level->size].count = w;
+            level->heap[level->size].error = 0;
+            _sift_up(hhh, level, level->size++);
+            continue;
+        }
+
+        /* the least counted prefix makes room, its count is the error */
+        ipforest_hash_remove(hhh->index, level->heap[0].addr, level->plen);
+        if (!ipforest_hash_insert(hhh->index, prefix, level->plen, &created)) {
+            return IPFOREST_FALSE;
+        }
+
+        item.addr = prefix;
+        item.count = level->heap[0].count + w;
+        item.error = level->heap[0].count;
+        level->heap[0] = item;
+        _sift_down(hhh, level, 0);
+    }
+
+    return IPFOREST_TRUE;
+}
+
+/* decayed number of hits counted so far */
+double
+ipforest_hhh_total(const ipforest_hhh_t *hhh, uint64_t now)
+{
+    return hhh->total * exp2(-_age(hhh, now));
+}
+
+static int
+_hitter_cmp(const void *a, const void *b)
+{
+    const ipforest_hhh_hitter_t *x = a, *y = b;
+
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    return x->addr < y->addr ? -1 : (x->addr > y->addr);
+}
+
+/*
+ * prefixes with a decayed count of threshold at least, level after level
+ * and the most counted first in each. hitters should have room for
+ * capacity times the number of levels, return how many were put there
+ */
+uint32_t
+ipforest_hhh_heavy(const ipforest_hhh_t *hhh, double threshold, uint64_t now,
+                   ipforest_hhh_hitter_t *hitters)
+{
+    int i;
+    uint32_t j, n, start;
+    double factor;
+    const ipforest_hhh_level_t *level;
+
+    factor = exp2(-_age(hhh, now));
+    n = 0;
+
+    for (i = 0; i < hhh->nlevels; i++) {
+        level = &hhh->levels[i];
+        start = n;
+
+        for (j = 0; j < level->size; j++) {
+            if (level->heap[j].count * factor >= threshold) {
+                hitters[n].addr = level->heap[j].addr;
+                hitters[n].plen = level->plen;
+                hitters[n].count = level->heap[j].count * factor;
+                hitters[n].error = level->heap[j].error * factor;
+                n++;
+            }
+        }
+
+        qsort(hitters + start, n - start, sizeof(ipforest_hhh_hitter_t), _hitter_cmp);
+    }
+
+    return n;
+}
@@ -0,0 +1,63 @@
+#ifndef IPFOREST_HHH
+#define IPFOREST_HHH
+
+#include "ipforest_types.h"
+#include "ipforest_hash.h"
+
+/*
+ * streaming heavy hitters per prefix length, in bounded memory.
+ *
+ * every level keeps at most capacity prefixes in a min heap on count
+ * (space saving): a new prefix meeting a full level takes the place of the
+ * least counted one and inherits its count as error, so a count is never
+ * under the true one and at most error over it.
+ *
+ * counts decay by half every half_life ticks. rather than touching every
+ * counter, later hits weigh more, 2^(age / half_life) from a landmark, and
+ * counts are scaled back to it on read. when weights grow too large all
+ * counts are rescaled at once, order and so the heaps stay untouched.
+ *
+ * times are opaque monotonic ticks chosen by the caller.
+ */
+
+#define IPFOREST_HHH_LEVELS 8
+
+typedef struct ipforest_hhh_item_s {
+    uint32_t addr;
+    double count;              /* landmark weighted */
+    double error;
+} ipforest_hhh_item_t;
+
+typedef struct ipforest_hhh_level_s {
+    int plen;
+    uint32_t size;
+    ipforest_hhh_item_t *heap;
+} ipforest_hhh_level_t;
+
+typedef struct ipforest_hhh_s {
+    ipforest_hhh_level_t levels[IPFOREST_HHH_LEVELS];
+    int nlevels;
+    uint32_t capacity;         /* per level */
+    ipforest_hash_t *index;    /* prefix -> heap position in its level */
+    double half_life;
+    double total;              /* landmark weighted, of every level alike */
+    uint64_t landmark;
+} ipforest_hhh_t;
+
+/* a prefix and its decayed estimate */
+typedef struct ipforest_hhh_hitter_s {
+    uint32_t addr;
+    int plen;
+    double count;
+    double error;
+} ipforest_hhh_hitter_t;
+
+ipforest_hhh_t * ipforest_hhh_alloc(const int *plens, int nlevels, uint32_t capacity,
+                                    double half_life, uint64_t now);
+void ipforest_hhh_free(ipforest_hhh_t *hhh);
+IPFOREST_BOOLEAN ipforest_hhh_count(ipforest_hhh_t *hhh, uint32_t addr, double weight, uint64_t now);
+double ipforest_hhh_total(const ipforest_hhh_t *hhh, uint64_t now);
+uint32_t ipforest_hhh_heavy(const ipforest_hhh_t *hhh, double threshold, uint64_t now,
+                            ipforest_hhh_hitter_t *hitters);
+
+#endif
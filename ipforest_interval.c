@@ -0,0 +1,236 @@
+#include <stdlib.h>
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "ipforest_types.h"
+#include "ipforest_radix_tree.h"
+#include "ipforest_interval.h"
+
+#define BIAS(x) ((int32_t)((x) ^ 0x80000000))
+
+/* growable list of intervals used while building */
+typedef struct ipforest_interval_list_s {
+    ipforest_interval_pair_t *pairs;
+    uint32_t count;
+    uint32_t cap;
+} ipforest_interval_list_t;
+
+inline static IPFOREST_BOOLEAN
+_list_push(ipforest_interval_list_t *list, uint32_t low, uint32_t high)
+{
+    uint32_t cap;
+    ipforest_interval_pair_t *pairs, *last;
+
+    if (list->count > 0) {
+        last = &list->pairs[list->count - 1];
+
+        /* already covering up to the end */
+        if (last->high == 0xffffffff) {
+            return IPFOREST_TRUE;
+        }
+
+        /* adjacent or overlapping with the last one, extend it */
+        if (low <= last->high + 1) {
+            if (high > last->high) {
+                last->high = high;
+            }
+            return IPFOREST_TRUE;
+        }
+    }
+
+    if (list->count == list->cap) {
+        cap = list->cap ? list->cap << 1 : 64;
+        pairs = realloc(list->pairs, cap * sizeof(ipforest_interval_pair_t));
+        if (!pairs) {
+            return IPFOREST_FALSE;
+        }
+        list->pairs = pairs;
+        list->cap = cap;
+    }
+
+    list->pairs[list->count].low = low;
+    list->pairs[list->count].high = high;
+    list->count++;
+
+    return IPFOREST_TRUE;
+}
+
+/*
+ * in order fill of the implicit B-tree, block k has its i-th child at
+ * k * (B + 1) + i + 1, slots past the last interval get the max key
+ */
+static void
+_fill(ipforest_interval_t *iv, const ipforest_interval_pair_t *pairs,
+      uint32_t k, uint32_t *t)
+{
+    uint32_t i, slot;
+
+    if (k >= iv->nblocks) {
+        return;
+    }
+
+    for (i = 0; i < IPFOREST_INTERVAL_BLOCK; i++) {
+        _fill(iv, pairs, k * (IPFOREST_INTERVAL_BLOCK + 1) + i + 1, t);
+
+        slot = k * IPFOREST_INTERVAL_BLOCK + i;
+        if (*t < iv->count) {
+            iv->lows[slot] = BIAS(pairs[*t].low);
+            iv->highs[slot] = pairs[*t].high;
+            *t += 1;
+        } else {
+            iv->lows[slot] = BIAS(0xffffffff);
+            iv->highs[slot] = 0;
+        }
+    }
+
+    _fill(iv, pairs, k * (IPFOREST_INTERVAL_BLOCK + 1) + IPFOREST_INTERVAL_BLOCK + 1, t);
+}
+
+/*
+ * lay sorted disjoint intervals out, list is consumed
+ */
+static ipforest_interval_t *
+_layout(ipforest_interval_list_t *list)
+{
+    uint32_t t;
+    size_t nslots;
+    void *lows;
+    ipforest_interval_t *iv;
+
+    iv = malloc(sizeof(ipforest_interval_t));
+    if (!iv) {
+        goto fail;
+    }
+    memset(iv, 0, sizeof(ipforest_interval_t));
+
+    iv->count = list->count;
+    iv->nblocks = (list->count + IPFOREST_INTERVAL_BLOCK - 1) / IPFOREST_INTERVAL_BLOCK;
+    iv->has_max = list->count > 0 && list->pairs[list->count - 1].high == 0xffffffff;
+
+    /* keep at least one block so lookups need no special case */
+    nslots = (iv->nblocks ? iv->nblocks : 1) * IPFOREST_INTERVAL_BLOCK;
+
+    /* one block per cache line */
+    if (posix_memalign(&lows, 64, nslots * sizeof(int32_t)) != 0) {
+        goto fail;
+    }
+    iv->lows = lows;
+
+    iv->highs = malloc(nslots * sizeof(uint32_t));
+    if (!iv->highs) {
+        goto fail;
+    }
+
+    t = 0;
+    _fill(iv, list->pairs, 0, &t);
+
+    free(list->pairs);
+    return iv;
+
+fail:
+    free(list->pairs);
+    if (iv) {
+        ipforest_interval_free(iv);
+    }
+    return NULL;
+}
+
+static IPFOREST_BOOLEAN
+_push_leaf(uint32_t addr, uint32_t mask, void *ctx)
+{
+    return _list_push(ctx, addr, addr | ~mask);
+}
+
+/*
+ * build from tree, leaves are walked in order and never overlap
+ */
+ipforest_interval_t *
+ipforest_interval_build_from_tree(ipforest_radix_tree_t *tree)
+{
+    ipforest_interval_list_t list;
+
+    memset(&list, 0, sizeof(ipforest_interval_list_t));
+
+    if (!ipforest_radix_tree_walk(tree, _push_leaf, &list)) {
+        free(list.pairs);
+        return NULL;
+    }
+
+    return _layout(&list);
+}
+
+void
+ipforest_interval_free(ipforest_interval_t *iv)
+{
+    free(iv->lows);
+    free(iv->highs);
+    free(iv);
+}
+
+/*
+ * number of keys in block not greater than x, both biased
+ */
+inline static uint32_t
+_rank(const int32_t *keys, int32_t x)
+{
+#if defined(__AVX2__)
+    __m256i xv, gt0, gt1;
+
+    xv = _mm256_set1_epi32(x);
+    gt0 = _mm256_cmpgt_epi32(_mm256_load_si256((const __m256i *)keys), xv);
+    gt1 = _mm256_cmpgt_epi32(_mm256_load_si256((const __m256i *)(keys + 8)), xv);
+
+    return IPFOREST_INTERVAL_BLOCK
+        - __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(gt0)))
+        - __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(gt1)));
+#elif defined(__SSE2__)
+    __m128i xv, gt0, gt1, gt2, gt3;
+
+    xv = _mm_set1_epi32(x);
+    gt0 = _mm_cmpgt_epi32(_mm_load_si128((const __m128i *)keys), xv);
+    gt1 = _mm_cmpgt_epi32(_mm_load_si128((const __m128i *)(keys + 4)), xv);
+    gt2 = _mm_cmpgt_epi32(_mm_load_si128((const __m128i *)(keys + 8)), xv);
+    gt3 = _mm_cmpgt_epi32(_mm_load_si128((const __m128i *)(keys + 12)), xv);
+
+    /* pack 4 x 32 bit masks into 16 x 8 bit lanes */
+    gt0 = _mm_packs_epi16(_mm_packs_epi32(gt0, gt1), _mm_packs_epi32(gt2, gt3));
+
+    return IPFOREST_INTERVAL_BLOCK - __builtin_popcount(_mm_movemask_epi8(gt0));
+#else
+    uint32_t i, count;
+
+    count = 0;
+    for (i = 0; i < IPFOREST_INTERVAL_BLOCK; i++) {
+        count += keys[i] <= x;
+    }
+    return count;
+#endif
+}
+
+IPFOREST_BOOLEAN
+ipforest_interval_lookup(const ipforest_interval_t *iv, uint32_t addr)
+{
+    int32_t x;
+    uint32_t k, i, pos;
+
+    /* max key is also the padding, tell it apart */
+    if (addr == 0xffffffff) {
+        return iv->has_max;
+    }
+
+    x = BIAS(addr);
+    k = 0;
+    pos = 0xffffffff;
+
+    /* a deeper block only holds keys above the last candidate */
+    while (k < iv->nblocks) {
+        i = _rank(&iv->lows[k * IPFOREST_INTERVAL_BLOCK], x);
+        if (i > 0) {
+            pos = k * IPFOREST_INTERVAL_BLOCK + i - 1;
+        }
+        k = k * (IPFOREST_INTERVAL_BLOCK + 1) + i + 1;
+    }
+
+    return pos != 0xffffffff && addr <= iv->highs[pos];
+}
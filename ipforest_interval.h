@@ -0,0 +1,34 @@
+#ifndef IPFOREST_INTERVAL
+#define IPFOREST_INTERVAL
+
+#include "ipforest_types.h"
+#include "ipforest_radix_tree.h"
+
+/*
+ * read only sorted array of disjoint [low, high] intervals.
+ *
+ * lows are laid out as an implicit static B-tree of 16 key blocks, one
+ * cache line each, which is searched by comparing a whole block at once
+ * (SSE2/AVX2 when available). highs share the slot of their low.
+ */
+
+#define IPFOREST_INTERVAL_BLOCK 16
+
+typedef struct ipforest_interval_pair_s {
+    uint32_t low;
+    uint32_t high;
+} ipforest_interval_pair_t;
+
+typedef struct ipforest_interval_s {
+    int32_t *lows;         /* biased by 0x80000000 for signed compares */
+    uint32_t *highs;
+    uint32_t nblocks;
+    uint32_t count;        /* number of disjoint intervals */
+    IPFOREST_BOOLEAN has_max;  /* 255.255.255.255 is covered */
+} ipforest_interval_t;
+
+ipforest_interval_t * ipforest_interval_build_from_tree(ipforest_radix_tree_t *tree);
+void ipforest_interval_free(ipforest_interval_t *iv);
+IPFOREST_BOOLEAN ipforest_interval_lookup(const ipforest_interval_t *iv, uint32_t addr);
+
+#endif
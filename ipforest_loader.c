@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "ipforest_types.h"
+#include "ipforest_parser.h"
+#include "ipforest_radix_tree.h"
+#include "ipforest_loader.h"
+
+#define IPFOREST_LOAD_CHUNK 65536
+
+#define IPFOREST_FNV_OFFSET 0xcbf29ce484222325ULL
+#define IPFOREST_FNV_PRIME 0x100000001b3ULL
+
+/* FNV-1a over another chunk of a file */
+inline static uint64_t
+_hash_chunk(uint64_t hash, const char *data, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * IPFOREST_FNV_PRIME;
+    }
+
+    return hash;
+}
+
+/*
+ * parse a single host / network / range line and insert it into tree
+ */
+IPFOREST_BOOLEAN
+ipforest_load_line(ipforest_radix_tree_t *tree, const char *line)
+{
+    int i, count;
+    ipforest_ipaddr_t *paddr;
+
+    /* initial ipforest_ipaddr_t array size */
+    count = 0;
+    paddr = NULL;
+
+    count = ipforest_parse_ip_line(line, NULL);
+    if (count <= 0 ) {
+        goto fail;
+    }
+
+    paddr = malloc(count * sizeof(ipforest_ipaddr_t));
+    if (!paddr) {
+        goto fail;
+    }
+
+    ipforest_parse_ip_line(line, paddr);
+
+    for (i = 0; i < count; i++) {
+        if (!ipforest_radix_tree_insert(tree, paddr[i].addr, paddr[i].mask)) {
+            goto fail;
+        }
+    }
+
+    free(paddr);
+    return IPFOREST_TRUE;
+
+fail:
+    /* safe to free NULL */
+    free(paddr);
+    return IPFOREST_FALSE;
+}
+
+/*
+ * prefixes of all lines in one array, NULL if a line does not parse or out
+ * of memory. an empty array is not NULL
+ */
+ipforest_ipaddr_t *
+ipforest_parse_lines(const char *const *lines, size_t count, size_t *total)
+{
+    int n;
+    size_t i;
+    ipforest_ipaddr_t *paddr;
+
+    *total = 0;
+
+    for (i = 0; i < count; i++) {
+        n = ipforest_parse_ip_line(lines[i], NULL);
+        if (n <= 0) {
+            return NULL;
+        }
+        *total += n;
+    }
+
+    paddr = malloc((*total ? *total : 1) * sizeof(ipforest_ipaddr_t));
+    if (!paddr) {
+        return NULL;
+    }
+
+    *total = 0;
+    for (i = 0; i < count; i++) {
+        *total += ipforest_parse_ip_line(lines[i], paddr + *total);
+    }
+
+    return paddr;
+}
+
+/*
+ * parse every line before touching tree, then merge the prefixes in one
+ * sorted pass. nothing is inserted if a line does not parse
+ */
+IPFOREST_BOOLEAN
+ipforest_load_lines(ipforest_radix_tree_t *tree, const char *const *lines, size_t count)
+{
+    size_t total;
+    ipforest_ipaddr_t *paddr;
+    IPFOREST_BOOLEAN ret;
+
+    paddr = ipforest_parse_lines(lines, count, &total);
+    if (!paddr) {
+        return IPFOREST_FALSE;
+    }
+
+    ret = ipforest_radix_tree_insert_many(tree, paddr, total);
+
+    free(paddr);
+    return ret;
+}
+
+/*
+ * deal with a complete line in builder line buffer, without its '\n'
+ */
+inline static IPFOREST_BOOLEAN
+_builder_line(ipforest_builder_t *builder)
+{
+    char *buf;
+    size_t len;
+
+    buf = builder->line;
+    len = builder->len;
+    builder->len = 0;
+
+    if (len > 0 && buf[len - 1] == '\r') {
+        len--;
+    }
+    buf[len] = '\0';
+
+    /* ignore empty line and comments */
+    if (buf[0] == '#' || buf[0] == '\0') {
+        return IPFOREST_TRUE;
+    }
+
+    /* a nul inside the line would hide the rest of it from the parser */
+    if (strlen(buf) != len) {
+        return IPFOREST_FALSE;
+    }
+
+    return ipforest_load_line(builder->tree, buf);
+}
+
+/*
+ * append data to the partial line, fail if it gets longer than what a
+ * LINE_MAX buffer of fgets would hold
+ */
+inline static IPFOREST_BOOLEAN
+_builder_append(ipforest_builder_t *builder, const char *data, size_t len)
+{
+    if (builder->len + len >= LINE_MAX - 1) {
+        return IPFOREST_FALSE;
+    }
+
+    memcpy(builder->line + builder->len, data, len);
+    builder->len += len;
+
+    return IPFOREST_TRUE;
+}
+
+ipforest_builder_t *
+ipforest_builder_alloc()
+{
+    ipforest_builder_t *builder;
+
+    builder = malloc(sizeof(ipforest_builder_t));
+    if (builder) {
+        builder->tree = NULL;
+        builder->len = 0;
+        builder->failed = IPFOREST_FALSE;
+    }
+
+    return builder;
+}
+
+void
+ipforest_builder_free(ipforest_builder_t *builder)
+{
+    if (builder->tree) {
+        ipforest_radix_tree_free(builder->tree);
+    }
+    free(builder);
+}
+
+/*
+ * parse every complete line of data, once failed every feed fails until
+ * ipforest_builder_finish
+ */
+IPFOREST_BOOLEAN
+ipforest_builder_feed(ipforest_builder_t *builder, const char *data, size_t len)
+{
+    const char *p, *end;
+
+    if (builder->failed) {
+        return IPFOREST_FALSE;
+    }
+
+    if (!builder->tree) {
+        builder->tree = ipforest_radix_tree_alloc();
+        if (!builder->tree) {
+            goto fail;
+        }
+    }
+
+    end = data + len;
+
+    while (data < end) {
+        p = memchr(data, '\n', end - data);
+        if (!p) {
+            /* carry over to the next feed */
+            if (!_builder_append(builder, data, end - data)) {
+                goto fail;
+            }
+            break;
+        }
+
+        if (!_builder_append(builder, data, p - data)) {
+            goto fail;
+        }
+
+        if (!_builder_line(builder)) {
+            goto fail;
+        }
+
+        data = p + 1;
+    }
+
+    return IPFOREST_TRUE;
+
+fail:
+    builder->failed = IPFOREST_TRUE;
+    return IPFOREST_FALSE;
+}
+
+/*
+ * deal with the last line which may have no '\n', return the compacted
+ * tree, NULL if anything failed. builder is ready to build another tree
+ */
+ipforest_radix_tree_t *
+ipforest_builder_finish(ipforest_builder_t *builder)
+{
+    ipforest_radix_tree_t *tree;
+
+    /* an empty input still makes an empty tree */
+    if (!builder->failed && !builder->tree) {
+        builder->tree = ipforest_radix_tree_alloc();
+    }
+
+    if (!builder->failed && builder->tree && builder->len > 0) {
+        if (!_builder_line(builder)) {
+            builder->failed = IPFOREST_TRUE;
+        }
+    }
+
+    tree = builder->tree;
+    builder->tree = NULL;
+
+    if (builder->failed || !tree) {
+        goto fail;
+    }
+
+    /* lay the tree out for lookups, it is only compacted if out of memory */
+    if (!ipforest_radix_tree_relayout(tree)) {
+        ipforest_radix_tree_compact(tree);
+    }
+
+    builder->len = 0;
+    builder->failed = IPFOREST_FALSE;
+    return tree;
+
+fail:
+    if (tree) {
+        ipforest_radix_tree_free(tree);
+    }
+    builder->len = 0;
+    builder->failed = IPFOREST_FALSE;
+    return NULL;
+}
+
+/* return a new compacted tree built from data, NULL if failed */
+ipforest_radix_tree_t *
+ipforest_load_buffer(const char *data, size_t len)
+{
+    ipforest_builder_t *builder;
+    ipforest_radix_tree_t *tree;
+
+    builder = ipforest_builder_alloc();
+    if (!builder) {
+        return NULL;
+    }
+
+    ipforest_builder_feed(builder, data, len);
+    tree = ipforest_builder_finish(builder);
+
+    ipforest_builder_free(builder);
+    return tree;
+}
+
+/* return a new compacted tree built from file, NULL if failed */
+ipforest_radix_tree_t *
+ipforest_load_file(const char *fname)
+{
+    return ipforest_load_file_source(fname, NULL, NULL);
+}
+
+/*
+ * as ipforest_load_file, st and hash if not NULL get what the file was when
+ * opened and the hash of what was read, as ipforest_hash_file gives them
+ */
+ipforest_radix_tree_t *
+ipforest_load_file_source(const char *fname, struct stat *st, uint64_t *hash)
+{
+    size_t len;
+    uint64_t h;
+    char buf[IPFOREST_LOAD_CHUNK];
+    FILE *stream;
+    ipforest_builder_t *builder;
+    ipforest_radix_tree_t *tree;
+
+    stream = fopen(fname, "r");
+    if (!stream) {
+        return NULL;
+    }
+
+    if (st && fstat(fileno(stream), st) != 0) {
+        fclose(stream);
+        return NULL;
+    }
+
+    builder = ipforest_builder_alloc();
+    if (!builder) {
+        fclose(stream);
+        return NULL;
+    }
+
+    h = IPFOREST_FNV_OFFSET;
+
+    while ((len = fread(buf, 1, IPFOREST_LOAD_CHUNK, stream)) > 0) {
+        if (hash) {
+            h = _hash_chunk(h, buf, len);
+        }
+        if (!ipforest_builder_feed(builder, buf, len)) {
+            break;
+        }
+    }
+
+    tree = NULL;
+    if (!ferror(stream)) {
+        tree = ipforest_builder_finish(builder);
+    }
+
+    if (hash) {
+        *hash = h;
+    }
+
+    ipforest_builder_free(builder);
+    fclose(stream);
+
+    return tree;
+}
+
+/* stat and hash a file without parsing it */
+IPFOREST_BOOLEAN
+ipforest_hash_file(const char *fname, struct stat *st, uint64_t *hash)
+{
+    size_t len;
+    uint64_t h;
+    char buf[IPFOREST_LOAD_CHUNK];
+    FILE *stream;
+    IPFOREST_BOOLEAN ret;
+
+    stream = fopen(fname, "r");
+    if (!stream) {
+        return IPFOREST_FALSE;
+    }
+
+    if (fstat(fileno(stream), st) != 0) {
+        fclose(stream);
+        return IPFOREST_FALSE;
+    }
+
+    h = IPFOREST_FNV_OFFSET;
+    while ((len = fread(buf, 1, IPFOREST_LOAD_CHUNK, stream)) > 0) {
+        h = _hash_chunk(h, buf, len);
+    }
+
+    ret = ferror(stream) ? IPFOREST_FALSE : IPFOREST_TRUE;
+    fclose(stream);
+
+    *hash = h;
+    return ret;
+}
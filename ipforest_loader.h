@@ -0,0 +1,35 @@
+#ifndef IPFOREST_LOADER
+#define IPFOREST_LOADER
+
+#include "ipforest_types.h"
+#include "ipforest_radix_tree.h"
+
+#include <limits.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/*
+ * builds a tree from data arriving in arbitrary chunks, a line split across
+ * chunks is carried over to the next feed
+ */
+typedef struct ipforest_builder_s {
+    ipforest_radix_tree_t *tree;   /* allocated on first feed */
+    char line[LINE_MAX];           /* partial line carried over */
+    size_t len;
+    IPFOREST_BOOLEAN failed;       /* sticky until finished */
+} ipforest_builder_t;
+
+IPFOREST_BOOLEAN ipforest_load_line(ipforest_radix_tree_t *tree, const char *line);
+ipforest_ipaddr_t * ipforest_parse_lines(const char *const *lines, size_t count, size_t *total);
+IPFOREST_BOOLEAN ipforest_load_lines(ipforest_radix_tree_t *tree, const char *const *lines, size_t count);
+ipforest_radix_tree_t * ipforest_load_file(const char *fname);
+ipforest_radix_tree_t * ipforest_load_file_source(const char *fname, struct stat *st, uint64_t *hash);
+IPFOREST_BOOLEAN ipforest_hash_file(const char *fname, struct stat *st, uint64_t *hash);
+ipforest_radix_tree_t * ipforest_load_buffer(const char *data, size_t len);
+
+ipforest_builder_t * ipforest_builder_alloc();
+void ipforest_builder_free(ipforest_builder_t *builder);
+IPFOREST_BOOLEAN ipforest_builder_feed(ipforest_builder_t *builder, const char *data, size_t len);
+ipforest_radix_tree_t * ipforest_builder_finish(ipforest_builder_t *builder);
+
+#endif
@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ipforest_types.h"
+#include "ipforest_metrics.h"
+
+ipforest_metrics_t *
+ipforest_metrics_alloc(uint32_t sample)
+{
+    ipforest_metrics_t *metrics;
+
+    metrics = malloc(sizeof(ipforest_metrics_t));
+    if (metrics) {
+        memset(metrics, 0, sizeof(ipforest_metrics_t));
+        metrics->sample = sample ? sample : 1;
+        metrics->countdown = metrics->sample;
+    }
+
+    return metrics;
+}
+
+void
+ipforest_metrics_free(ipforest_metrics_t *metrics)
+{
+    free(metrics);
+}
+
+/* monotonic nanoseconds */
+uint64_t
+ipforest_metrics_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * depth is the number of radix tree levels walked, negative if the lookup
+ * did not go through the radix tree
+ */
+void
+ipforest_metrics_record(ipforest_metrics_t *metrics, IPFOREST_BOOLEAN hit, int depth)
+{
+    metrics->calls++;
+
+    if (hit) {
+        metrics->hits++;
+    } else {
+        metrics->misses++;
+    }
+
+    if (depth >= 0 && depth < IPFOREST_METRICS_DEPTHS) {
+        metrics->depth[depth]++;
+    }
+}
+
+void
+ipforest_metrics_latency(ipforest_metrics_t *metrics, uint64_t ns)
+{
+    int i;
+
+    /* bit length of ns */
+    i = ns ? 64 - __builtin_clzll(ns) : 0;
+    if (i >= IPFOREST_METRICS_BUCKETS) {
+        i = IPFOREST_METRICS_BUCKETS - 1;
+    }
+
+    metrics->latency[i]++;
+    metrics->latency_sum += ns;
+    metrics->latency_count++;
+}
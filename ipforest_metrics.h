@@ -0,0 +1,44 @@
+#ifndef IPFOREST_METRICS
+#define IPFOREST_METRICS
+
+#include "ipforest_types.h"
+
+/*
+ * per tree lookup telemetry. every call is counted, one call out of sample
+ * is timed into log2 scale nanosecond buckets: bucket i holds latencies in
+ * [2^(i-1), 2^i), the last one everything above.
+ */
+
+#define IPFOREST_METRICS_BUCKETS 24
+#define IPFOREST_METRICS_DEPTHS 33
+
+typedef struct ipforest_metrics_s {
+    uint64_t calls;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t depth[IPFOREST_METRICS_DEPTHS];    /* radix lookups only */
+    uint64_t latency[IPFOREST_METRICS_BUCKETS];
+    uint64_t latency_sum;      /* ns of timed calls */
+    uint64_t latency_count;    /* number of timed calls */
+    uint32_t sample;
+    uint32_t countdown;
+} ipforest_metrics_t;
+
+ipforest_metrics_t * ipforest_metrics_alloc(uint32_t sample);
+void ipforest_metrics_free(ipforest_metrics_t *metrics);
+uint64_t ipforest_metrics_now();
+void ipforest_metrics_record(ipforest_metrics_t *metrics, IPFOREST_BOOLEAN hit, int depth);
+void ipforest_metrics_latency(ipforest_metrics_t *metrics, uint64_t ns);
+
+/* tell if this call should be timed */
+inline static IPFOREST_BOOLEAN
+ipforest_metrics_sample(ipforest_metrics_t *metrics)
+{
+    if (--metrics->countdown == 0) {
+        metrics->countdown = metrics->sample;
+        return IPFOREST_TRUE;
+    }
+    return IPFOREST_FALSE;
+}
+
+#endif
@@ -0,0 +1,504 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ipforest_types.h"
+#include "ipforest_mmdb.h"
+
+#define IPFOREST_MMDB_MARKER "\xab\xcd\xefMaxMind.com"
+#define IPFOREST_MMDB_MARKER_LEN 14
+#define IPFOREST_MMDB_METADATA_MAX (128 * 1024)
+
+/* nesting allowed in values, also bounds pointer loops */
+#define IPFOREST_MMDB_MAX_DEPTH 64
+
+/* a part of the file values are decoded from, pointers are relative to it */
+typedef struct ipforest_mmdb_section_s {
+    const uint8_t *base;
+    uint32_t size;
+} ipforest_mmdb_section_t;
+
+inline static uint64_t
+_read_be(const uint8_t *p, uint32_t n)
+{
+    uint64_t v;
+
+    v = 0;
+    while (n-- > 0) {
+        v = (v << 8) | *p++;
+    }
+
+    return v;
+}
+
+static IPFOREST_BOOLEAN
+_decode(const ipforest_mmdb_section_t *section, uint32_t offset,
+        ipforest_mmdb_value_t *value, uint32_t *next, IPFOREST_BOOLEAN follow)
+{
+    uint32_t ctrl, type, size, ss, target;
+    uint64_t bits;
+    union { uint64_t u; double d; } d64;
+    union { uint32_t u; float f; } f32;
+
+    if (offset >= section->size) {
+        return IPFOREST_FALSE;
+    }
+
+    ctrl = section->base[offset++];
+    type = ctrl >> 5;
+
+    if (type == 0) {
+        /* extended type */
+        if (offset >= section->size) {
+            return IPFOREST_FALSE;
+        }
+        type = 7 + section->base[offset++];
+    }
+
+    if (type == IPFOREST_MMDB_POINTER) {
+        ss = (ctrl >> 3) & 0x3;
+        if (!follow || section->size - offset < ss + 1) {
+            return IPFOREST_FALSE;
+        }
+
+        bits = _read_be(section->base + offset, ss + 1);
+        switch (ss) {
+        case 0:
+            target = ((ctrl & 0x7) << 8 | bits);
+            break;
+        case 1:
+            target = ((ctrl & 0x7) << 16 | bits) + 2048;
+            break;
+        case 2:
+            target = ((ctrl & 0x7) << 24 | bits) + 526336;
+            break;
+        default:
+            target = bits;
+            break;
+        }
+
+        /* a pointer never leads to another pointer */
+        if (!_decode(section, target, value, &size, IPFOREST_FALSE)) {
+            return IPFOREST_FALSE;
+        }
+
+        value->indirect = IPFOREST_TRUE;
+        *next = offset + ss + 1;
+        return IPFOREST_TRUE;
+    }
+
+    size = ctrl & 0x1f;
+    if (size >= 29) {
+        ss = size - 28;
+        if (section->size - offset < ss) {
+            return IPFOREST_FALSE;
+        }
+        bits = _read_be(section->base + offset, ss);
+        offset += ss;
+        size = ss == 1 ? 29 + bits : (ss == 2 ? 285 + bits : 65821 + bits);
+    }
+
+    value->type = type;
+    value->size = size;
+    value->indirect = IPFOREST_FALSE;
+
+    switch (type) {
+    case IPFOREST_MMDB_MAP:
+    case IPFOREST_MMDB_ARRAY:
+        /* items follow, the caller walks them */
+        value->children = offset;
+        *next = offset;
+        return IPFOREST_TRUE;
+
+    case IPFOREST_MMDB_BOOLEAN:
+        value->uint = size;
+        *next = offset;
+        return size <= 1;
+
+    default:
+        break;
+    }
+
+    if (section->size - offset < size) {
+        return IPFOREST_FALSE;
+    }
+    *next = offset + size;
+
+    switch (type) {
+    case IPFOREST_MMDB_UTF8:
+    case IPFOREST_MMDB_BYTES:
+        value->bytes = section->base + offset;
+        return IPFOREST_TRUE;
+
+    case IPFOREST_MMDB_DOUBLE:
+        if (size != 8) {
+            return IPFOREST_FALSE;
+        }
+        d64.u = _read_be(section->base + offset, 8);
+        value->real = d64.d;
+        return IPFOREST_TRUE;
+
+    case IPFOREST_MMDB_FLOAT:
+        if (size != 4) {
+            return IPFOREST_FALSE;
+        }
+        f32.u = (uint32_t)_read_be(section->base + offset, 4);
+        value->real = f32.f;
+        return IPFOREST_TRUE;
+
+    case IPFOREST_MMDB_UINT16:
+    case IPFOREST_MMDB_UINT32:
+    case IPFOREST_MMDB_UINT64:
+        if (size > (type == IPFOREST_MMDB_UINT16 ? 2 : (type == IPFOREST_MMDB_UINT32 ? 4 : 8))) {
+            return IPFOREST_FALSE;
+        }
+        value->uint = _read_be(section->base + offset, size);
+        return IPFOREST_TRUE;
+
+    case IPFOREST_MMDB_INT32:
+        if (size > 4) {
+            return IPFOREST_FALSE;
+        }
+        bits = _read_be(section->base + offset, size);
+        /* shorter encodings are zero padded, not sign extended */
+        value->sint = (int32_t)(uint32_t)bits;
+        return IPFOREST_TRUE;
+
+    case IPFOREST_MMDB_UINT128:
+        if (size > 16) {
+            return IPFOREST_FALSE;
+        }
+        value->bytes = section->base + offset;
+        return IPFOREST_TRUE;
+
+    default:
+        /* data cache containers and end markers never show up in values */
+        return IPFOREST_FALSE;
+    }
+}
+
+static IPFOREST_BOOLEAN
+_skip(const ipforest_mmdb_section_t *section, uint32_t offset, uint32_t *next, int depth)
+{
+    uint32_t i, count, cur;
+    ipforest_mmdb_value_t value;
+
+    if (depth > IPFOREST_MMDB_MAX_DEPTH) {
+        return IPFOREST_FALSE;
+    }
+
+    if (!_decode(section, offset, &value, next, IPFOREST_TRUE)) {
+        return IPFOREST_FALSE;
+    }
+
+    /* a container behind a pointer is not in the way */
+    if (value.indirect
+        || (value.type != IPFOREST_MMDB_MAP && value.type != IPFOREST_MMDB_ARRAY)) {
+        return IPFOREST_TRUE;
+    }
+
+    count = value.type == IPFOREST_MMDB_MAP ? value.size * 2 : value.size;
+    cur = value.children;
+
+    for (i = 0; i < count; i++) {
+        if (!_skip(section, cur, &cur, depth + 1)) {
+            return IPFOREST_FALSE;
+        }
+    }
+
+    *next = cur;
+    return IPFOREST_TRUE;
+}
+
+/*
+ * offset of the value under key in the map at offset
+ */
+static IPFOREST_BOOLEAN
+_get_key(const ipforest_mmdb_section_t *section, uint32_t offset,
+         const char *key, size_t len, uint32_t *found)
+{
+    uint32_t i, cur, next;
+    ipforest_mmdb_value_t map, name;
+
+    if (!_decode(section, offset, &map, &next, IPFOREST_TRUE)
+        || map.type != IPFOREST_MMDB_MAP) {
+        return IPFOREST_FALSE;
+    }
+
+    cur = map.children;
+
+    for (i = 0; i < map.size; i++) {
+        if (!_decode(section, cur, &name, &cur, IPFOREST_TRUE)
+            || name.type != IPFOREST_MMDB_UTF8) {
+            return IPFOREST_FALSE;
+        }
+
+        if (name.size == len && memcmp(name.bytes, key, len) == 0) {
+            *found = cur;
+            return IPFOREST_TRUE;
+        }
+
+        if (!_skip(section, cur, &cur, 0)) {
+            return IPFOREST_FALSE;
+        }
+    }
+
+    return IPFOREST_FALSE;
+}
+
+/* unsigned integer under key in the metadata map */
+inline static IPFOREST_BOOLEAN
+_metadata_uint(const ipforest_mmdb_section_t *metadata, const char *key, uint32_t *v)
+{
+    uint32_t offset, next;
+    ipforest_mmdb_value_t value;
+
+    if (!_get_key(metadata, 0, key, strlen(key), &offset)
+        || !_decode(metadata, offset, &value, &next, IPFOREST_FALSE)) {
+        return IPFOREST_FALSE;
+    }
+
+    if (value.type != IPFOREST_MMDB_UINT16 && value.type != IPFOREST_MMDB_UINT32) {
+        return IPFOREST_FALSE;
+    }
+
+    *v = (uint32_t)value.uint;
+    return IPFOREST_TRUE;
+}
+
+/* last occurrence of the metadata marker, NULL if none */
+inline static const uint8_t *
+_find_metadata(const uint8_t *map, size_t size)
+{
+    const uint8_t *p, *stop;
+
+    if (size < IPFOREST_MMDB_MARKER_LEN) {
+        return NULL;
+    }
+
+    stop = size > IPFOREST_MMDB_METADATA_MAX ? map + size - IPFOREST_MMDB_METADATA_MAX : map;
+
+    for (p = map + size - IPFOREST_MMDB_MARKER_LEN; p >= stop; p--) {
+        if (*p == 0xab && memcmp(p, IPFOREST_MMDB_MARKER, IPFOREST_MMDB_MARKER_LEN) == 0) {
+            return p + IPFOREST_MMDB_MARKER_LEN;
+        }
+        if (p == map) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* record 0 (left) or 1 (right) of node, node should be in the tree */
+inline static uint32_t
+_record(const ipforest_mmdb_t *mmdb, uint32_t node, int bit)
+{
+    const uint8_t *p;
+
+    p = mmdb->map + (size_t)node * mmdb->node_bytes;
+
+    switch (mmdb->record_size) {
+    case 24:
+        return (uint32_t)_read_be(p + bit * 3, 3);
+    case 28:
+        if (bit) {
+            return ((uint32_t)(p[3] & 0x0f) << 24) | (uint32_t)_read_be(p + 4, 3);
+        }
+        return ((uint32_t)(p[3] & 0xf0) << 20) | (uint32_t)_read_be(p, 3);
+    default:
+        return (uint32_t)_read_be(p + bit * 4, 4);
+    }
+}
+
+ipforest_mmdb_t *
+ipforest_mmdb_open(const char *path)
+{
+    int fd;
+    uint32_t version, i, node;
+    size_t tree_size;
+    struct stat st;
+    void *map;
+    const uint8_t *metadata;
+    ipforest_mmdb_section_t section;
+    ipforest_mmdb_t *mmdb;
+
+    mmdb = NULL;
+    map = MAP_FAILED;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || (uint64_t)st.st_size > 0xffffffff) {
+        goto fail;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        goto fail;
+    }
+
+    mmdb = malloc(sizeof(ipforest_mmdb_t));
+    if (!mmdb) {
+        goto fail;
+    }
+    memset(mmdb, 0, sizeof(ipforest_mmdb_t));
+
+    mmdb->map = map;
+    mmdb->size = st.st_size;
+
+    metadata = _find_metadata(mmdb->map, mmdb->size);
+    if (!metadata) {
+        goto fail;
+    }
+
+    section.base = metadata;
+    section.size = mmdb->map + mmdb->size - metadata;
+
+    if (!_metadata_uint(&section, "node_count", &mmdb->node_count)
+        || !_metadata_uint(&section, "record_size", &mmdb->record_size)
+        || !_metadata_uint(&section, "ip_version", &version)) {
+        goto fail;
+    }
+
+    if (mmdb->record_size != 24 && mmdb->record_size != 28 && mmdb->record_size != 32) {
+        goto fail;
+    }
+    if (version != 4 && version != 6) {
+        goto fail;
+    }
+
+    mmdb->node_bytes = mmdb->record_size / 4;
+    tree_size = (size_t)mmdb->node_count * mmdb->node_bytes;
+
+    /* tree, 16 zero bytes, data section, marker */
+    if (tree_size + 16 > (size_t)(metadata - IPFOREST_MMDB_MARKER_LEN - mmdb->map)) {
+        goto fail;
+    }
+
+    mmdb->data = mmdb->map + tree_size + 16;
+    mmdb->data_size = metadata - IPFOREST_MMDB_MARKER_LEN - mmdb->data;
+
+    /* IPv4 lives at ::a.b.c.d in an IPv6 tree */
+    node = 0;
+    if (version == 6) {
+        for (i = 0; i < 96 && node < mmdb->node_count; i++) {
+            node = _record(mmdb, node, 0);
+        }
+    }
+    mmdb->ipv4_start = node;
+
+    close(fd);
+    return mmdb;
+
+fail:
+    if (map != MAP_FAILED) {
+        munmap(map, st.st_size);
+    }
+    free(mmdb);
+    close(fd);
+    return NULL;
+}
+
+void
+ipforest_mmdb_close(ipforest_mmdb_t *mmdb)
+{
+    munmap((void *)mmdb->map, mmdb->size);
+    free(mmdb);
+}
+
+/*
+ * walk the tree, offset is where the data of addr starts in the data section
+ */
+IPFOREST_BOOLEAN
+ipforest_mmdb_lookup(const ipforest_mmdb_t *mmdb, uint32_t addr, uint32_t *offset)
+{
+    int i;
+    uint32_t node;
+
+    node = mmdb->ipv4_start;
+
+    for (i = 0; i < 32 && node < mmdb->node_count; i++) {
+        node = _record(mmdb, node, (addr >> (31 - i)) & 1);
+    }
+
+    /* node_count itself means no data, lower is a tree deeper than allowed */
+    if (node <= mmdb->node_count || node - mmdb->node_count - 16 >= mmdb->data_size) {
+        return IPFOREST_FALSE;
+    }
+
+    if (offset) {
+        *offset = node - mmdb->node_count - 16;
+    }
+
+    return IPFOREST_TRUE;
+}
+
+IPFOREST_BOOLEAN
+ipforest_mmdb_decode(const ipforest_mmdb_t *mmdb, uint32_t offset,
+                     ipforest_mmdb_value_t *value, uint32_t *next)
+{
+    ipforest_mmdb_section_t section;
+
+    section.base = mmdb->data;
+    section.size = mmdb->data_size;
+
+    return _decode(&section, offset, value, next, IPFOREST_TRUE);
+}
+
+/* offset right after the whole value at offset, items included */
+IPFOREST_BOOLEAN
+ipforest_mmdb_skip(const ipforest_mmdb_t *mmdb, uint32_t offset, uint32_t *next)
+{
+    ipforest_mmdb_section_t section;
+
+    section.base = mmdb->data;
+    section.size = mmdb->data_size;
+
+    return _skip(&section, offset, next, 0);
+}
+
+IPFOREST_BOOLEAN
+ipforest_mmdb_get_key(const ipforest_mmdb_t *mmdb, uint32_t offset,
+                      const char *key, size_t len, uint32_t *found)
+{
+    ipforest_mmdb_section_t section;
+
+    section.base = mmdb->data;
+    section.size = mmdb->data_size;
+
+    return _get_key(&section, offset, key, len, found);
+}
+
+/* offset of item index, from 0, of the array at offset */
+IPFOREST_BOOLEAN
+ipforest_mmdb_get_index(const ipforest_mmdb_t *mmdb, uint32_t offset,
+                        uint32_t index, uint32_t *found)
+{
+    uint32_t i, cur, next;
+    ipforest_mmdb_value_t array;
+    ipforest_mmdb_section_t section;
+
+    section.base = mmdb->data;
+    section.size = mmdb->data_size;
+
+    if (!_decode(&section, offset, &array, &next, IPFOREST_TRUE)
+        || array.type != IPFOREST_MMDB_ARRAY || index >= array.size) {
+        return IPFOREST_FALSE;
+    }
+
+    cur = array.children;
+
+    for (i = 0; i < index; i++) {
+        if (!_skip(&section, cur, &cur, 0)) {
+            return IPFOREST_FALSE;
+        }
+    }
+
+    *found = cur;
+    return IPFOREST_TRUE;
+}
@@ -0,0 +1,64 @@
+#ifndef IPFOREST_MMDB
+#define IPFOREST_MMDB
+
+#include <stddef.h>
+#include "ipforest_types.h"
+
+/*
+ * read only MaxMind DB file served in place from a private mapping.
+ *
+ * nothing is copied or built on open, lookups walk the binary search tree
+ * of the file and values are decoded from its data section on demand. every
+ * offset read from the file is checked against the mapping.
+ */
+
+typedef enum {
+    IPFOREST_MMDB_POINTER = 1,
+    IPFOREST_MMDB_UTF8 = 2,
+    IPFOREST_MMDB_DOUBLE = 3,
+    IPFOREST_MMDB_BYTES = 4,
+    IPFOREST_MMDB_UINT16 = 5,
+    IPFOREST_MMDB_UINT32 = 6,
+    IPFOREST_MMDB_MAP = 7,
+    IPFOREST_MMDB_INT32 = 8,
+    IPFOREST_MMDB_UINT64 = 9,
+    IPFOREST_MMDB_UINT128 = 10,
+    IPFOREST_MMDB_ARRAY = 11,
+    IPFOREST_MMDB_BOOLEAN = 14,
+    IPFOREST_MMDB_FLOAT = 15
+} ipforest_mmdb_type_t;
+
+typedef struct ipforest_mmdb_s {
+    const uint8_t *map;
+    size_t size;
+    uint32_t node_count;
+    uint32_t node_bytes;       /* two records */
+    uint32_t record_size;      /* bits */
+    uint32_t ipv4_start;       /* where ::/96 leads, IPv4 lookups start there */
+    const uint8_t *data;       /* data section */
+    uint32_t data_size;
+} ipforest_mmdb_t;
+
+typedef struct ipforest_mmdb_value_s {
+    ipforest_mmdb_type_t type;
+    uint32_t size;             /* bytes of strings, pairs of maps, items of arrays */
+    uint32_t children;         /* offset of the first key or item of a container */
+    IPFOREST_BOOLEAN indirect; /* reached through a pointer */
+    const uint8_t *bytes;      /* strings, bytes and uint128 */
+    uint64_t uint;             /* unsigned integers and booleans */
+    int32_t sint;
+    double real;               /* double and float */
+} ipforest_mmdb_value_t;
+
+ipforest_mmdb_t * ipforest_mmdb_open(const char *path);
+void ipforest_mmdb_close(ipforest_mmdb_t *mmdb);
+IPFOREST_BOOLEAN ipforest_mmdb_lookup(const ipforest_mmdb_t *mmdb, uint32_t addr, uint32_t *offset);
+IPFOREST_BOOLEAN ipforest_mmdb_decode(const ipforest_mmdb_t *mmdb, uint32_t offset,
+                                      ipforest_mmdb_value_t *value, uint32_t *next);
+IPFOREST_BOOLEAN ipforest_mmdb_skip(const ipforest_mmdb_t *mmdb, uint32_t offset, uint32_t *next);
+IPFOREST_BOOLEAN ipforest_mmdb_get_key(const ipforest_mmdb_t *mmdb, uint32_t offset,
+                                       const char *key, size_t len, uint32_t *found);
+IPFOREST_BOOLEAN ipforest_mmdb_get_index(const ipforest_mmdb_t *mmdb, uint32_t offset,
+                                         uint32_t index, uint32_t *found);
+
+#endif
@@ -320,3 +320,49 @@ ipforest_parse_ip_line(const char *line, ipforest_ipaddr_t *addrs)
     
     return _parse_ip_addr(line, addrs);
 }
+
+IPFOREST_BOOLEAN
+ipforest_parse_ipv4(const char *ip, size_t len, uint32_t *addr)
+{
+    int i, digits;
+    uint32_t octet, ret;
+    const char *p, *end;
+
+    p = ip;
+    end = ip + len;
+    ret = 0;
+
+    for (i = 0; i < 4; i++) {
+        if (i > 0) {
+            if (p >= end || *p != '.') {
+                return IPFOREST_FALSE;
+            }
+            p++;
+        }
+
+        octet = 0;
+        digits = 0;
+        while (p < end && *p >= '0' && *p <= '9') {
+            /* no leading zeros, "010" reads as octal elsewhere */
+            if (digits == 3 || (digits == 1 && octet == 0)) {
+                return IPFOREST_FALSE;
+            }
+            octet = octet * 10 + (*p - '0');
+            digits++;
+            p++;
+        }
+
+        if (digits == 0 || octet > 255) {
+            return IPFOREST_FALSE;
+        }
+
+        ret = (ret << 8) | octet;
+    }
+
+    if (p != end) {
+        return IPFOREST_FALSE;
+    }
+
+    *addr = ret;
+    return IPFOREST_TRUE;
+}
@@ -1,8 +1,12 @@
 #ifndef IPFOREST_PARSER
 #define IPFOREST_PARSER
 
+#include <stddef.h>
 #include "ipforest_types.h"
 
 int ipforest_parse_ip_line(const char *line, ipforest_ipaddr_t *addrs);
 
+/* exactly a dotted quad in [ip, ip + len), no leading zeros or blanks */
+IPFOREST_BOOLEAN ipforest_parse_ipv4(const char *ip, size_t len, uint32_t *addr);
+
 #endif
@@ -0,0 +1,232 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ipforest_types.h"
+#include "ipforest_radix_tree.h"
+#include "ipforest_poptrie.h"
+
+#define IPFOREST_POPTRIE_SLOTS (1 << IPFOREST_POPTRIE_STRIDE)
+
+/* what a slot of a stride ends up with */
+#define SLOT_MISS  0
+#define SLOT_MATCH 1
+#define SLOT_CHILD 2
+
+/*
+ * walk nbits of bits (msb first) down from node, return the slot kind and
+ * the radix node reached if a child
+ */
+inline static int
+_descend(ipforest_radix_tree_node_t *node, uint32_t bits, int nbits,
+         ipforest_radix_tree_node_t **pnext)
+{
+    int i;
+
+    for (i = nbits - 1; i >= 0; i--) {
+        if (IPFOREST_RADIX_TREE_IS_LEAF(node)) {
+            return SLOT_MATCH;
+        }
+
+        node = (bits & (1 << i)) ? node->r : node->l;
+        if (!node) {
+            return SLOT_MISS;
+        }
+    }
+
+    if (IPFOREST_RADIX_TREE_IS_LEAF(node)) {
+        return SLOT_MATCH;
+    }
+
+    *pnext = node;
+    return SLOT_CHILD;
+}
+
+/* reserve count contiguous nodes, return index of the first, -1 if failed */
+inline static int64_t
+_reserve_nodes(ipforest_poptrie_t *trie, uint32_t count)
+{
+    uint32_t cap;
+    ipforest_poptrie_node_t *nodes;
+
+    if (trie->nnodes + count > trie->nodes_cap) {
+        cap = trie->nodes_cap ? trie->nodes_cap : 64;
+        while (cap < trie->nnodes + count) {
+            cap = cap << 1;
+        }
+
+        nodes = realloc(trie->nodes, cap * sizeof(ipforest_poptrie_node_t));
+        if (!nodes) {
+            return -1;
+        }
+
+        trie->nodes = nodes;
+        trie->nodes_cap = cap;
+    }
+
+    memset(&trie->nodes[trie->nnodes], 0, count * sizeof(ipforest_poptrie_node_t));
+    trie->nnodes += count;
+
+    return trie->nnodes - count;
+}
+
+inline static IPFOREST_BOOLEAN
+_push_leaf(ipforest_poptrie_t *trie, uint8_t value)
+{
+    uint32_t cap;
+    uint8_t *leaves;
+
+    if (trie->nleaves == trie->leaves_cap) {
+        cap = trie->leaves_cap ? trie->leaves_cap << 1 : 256;
+
+        leaves = realloc(trie->leaves, cap);
+        if (!leaves) {
+            return IPFOREST_FALSE;
+        }
+
+        trie->leaves = leaves;
+        trie->leaves_cap = cap;
+    }
+
+    trie->leaves[trie->nleaves++] = value;
+    return IPFOREST_TRUE;
+}
+
+/*
+ * fill trie node idx from radix node, which is neither a leaf nor NULL and
+ * sits depth bits down from root
+ */
+static IPFOREST_BOOLEAN
+_build_node(ipforest_poptrie_t *trie, uint32_t idx,
+            ipforest_radix_tree_node_t *rnode, int depth)
+{
+    int s, kind, last;
+    uint32_t nchild, i;
+    int64_t base1;
+    uint64_t vector, leafvec;
+    ipforest_radix_tree_node_t *next;
+    ipforest_radix_tree_node_t *children[IPFOREST_POPTRIE_SLOTS];
+
+    vector = 0;
+    leafvec = 0;
+    nchild = 0;
+    last = -1;
+
+    trie->nodes[idx].base0 = trie->nleaves;
+
+    for (s = 0; s < IPFOREST_POPTRIE_SLOTS; s++) {
+        kind = _descend(rnode, s, IPFOREST_POPTRIE_STRIDE, &next);
+        if (kind == SLOT_CHILD) {
+            vector |= (uint64_t)1 << s;
+            children[nchild++] = next;
+            continue;
+        }
+
+        /* a new run of leaves starts where the value changes */
+        if (kind != last) {
+            leafvec |= (uint64_t)1 << s;
+            if (!_push_leaf(trie, kind == SLOT_MATCH)) {
+                return IPFOREST_FALSE;
+            }
+            last = kind;
+        }
+    }
+
+    base1 = _reserve_nodes(trie, nchild);
+    if (base1 < 0) {
+        return IPFOREST_FALSE;
+    }
+
+    /* nodes may have moved */
+    trie->nodes[idx].vector = vector;
+    trie->nodes[idx].leafvec = leafvec;
+    trie->nodes[idx].base1 = (uint32_t)base1;
+
+    for (i = 0; i < nchild; i++) {
+        if (!_build_node(trie, (uint32_t)base1 + i, children[i],
+                         depth + IPFOREST_POPTRIE_STRIDE)) {
+            return IPFOREST_FALSE;
+        }
+    }
+
+    return IPFOREST_TRUE;
+}
+
+ipforest_poptrie_t *
+ipforest_poptrie_build(ipforest_radix_tree_t *tree)
+{
+    uint32_t i;
+    int64_t idx;
+    ipforest_poptrie_t *trie;
+    ipforest_radix_tree_node_t *next;
+
+    trie = malloc(sizeof(ipforest_poptrie_t));
+    if (!trie) {
+        return NULL;
+    }
+    memset(trie, 0, sizeof(ipforest_poptrie_t));
+
+    for (i = 0; i < (1 << IPFOREST_POPTRIE_DIRECT_BITS); i++) {
+        switch (_descend(&tree->root, i, IPFOREST_POPTRIE_DIRECT_BITS, &next)) {
+        case SLOT_MISS:
+            trie->direct[i] = IPFOREST_POPTRIE_LEAF;
+            break;
+        case SLOT_MATCH:
+            trie->direct[i] = IPFOREST_POPTRIE_LEAF | 1;
+            break;
+        default:
+            idx = _reserve_nodes(trie, 1);
+            if (idx < 0) {
+                goto fail;
+            }
+            trie->direct[i] = (uint32_t)idx;
+            if (!_build_node(trie, (uint32_t)idx, next, IPFOREST_POPTRIE_DIRECT_BITS)) {
+                goto fail;
+            }
+        }
+    }
+
+    return trie;
+
+fail:
+    ipforest_poptrie_free(trie);
+    return NULL;
+}
+
+void
+ipforest_poptrie_free(ipforest_poptrie_t *trie)
+{
+    free(trie->nodes);
+    free(trie->leaves);
+    free(trie);
+}
+
+IPFOREST_BOOLEAN
+ipforest_poptrie_lookup(const ipforest_poptrie_t *trie, uint32_t addr)
+{
+    int shift;
+    uint32_t e, v;
+    uint64_t mask;
+    const ipforest_poptrie_node_t *node;
+
+    e = trie->direct[addr >> (32 - IPFOREST_POPTRIE_DIRECT_BITS)];
+    if (e & IPFOREST_POPTRIE_LEAF) {
+        return e & 1;
+    }
+
+    node = &trie->nodes[e];
+    shift = 32 - IPFOREST_POPTRIE_DIRECT_BITS - IPFOREST_POPTRIE_STRIDE;
+
+    do {
+        v = (addr >> shift) & (IPFOREST_POPTRIE_SLOTS - 1);
+        /* slots [0, v] */
+        mask = ((uint64_t)2 << v) - 1;
+
+        if (!(node->vector & ((uint64_t)1 << v))) {
+            break;
+        }
+
+        node = &trie->nodes[node->base1 + __builtin_popcountll(node->vector & mask) - 1];
+        shift -= IPFOREST_POPTRIE_STRIDE;
+    } while (IPFOREST_TRUE);
+
+    return trie->leaves[node->base0 + __builtin_popcountll(node->leafvec & mask) - 1];
+}
@@ -0,0 +1,44 @@
+#ifndef IPFOREST_POPTRIE
+#define IPFOREST_POPTRIE
+
+#include "ipforest_types.h"
+#include "ipforest_radix_tree.h"
+
+/*
+ * read only multibit trie compiled from a radix tree.
+ *
+ * the top IPFOREST_POPTRIE_DIRECT_BITS are resolved by a direct table, the
+ * rest in 6 bit strides. every node keeps a 64 bit vector telling which
+ * slots descend into a child and another one telling where a run of equal
+ * leaves starts, children and leaves of a node are contiguous and indexed by
+ * popcount.
+ */
+
+#define IPFOREST_POPTRIE_DIRECT_BITS 8
+#define IPFOREST_POPTRIE_STRIDE 6
+
+/* direct entry is a leaf if set, leaf value is in bit 0 */
+#define IPFOREST_POPTRIE_LEAF 0x80000000
+
+typedef struct ipforest_poptrie_node_s {
+    uint64_t vector;    /* set if slot descends into a child */
+    uint64_t leafvec;   /* set if slot starts a new run of leaves */
+    uint32_t base0;     /* first leaf of the node */
+    uint32_t base1;     /* first child of the node */
+} ipforest_poptrie_node_t;
+
+typedef struct ipforest_poptrie_s {
+    uint32_t direct[1 << IPFOREST_POPTRIE_DIRECT_BITS];
+    ipforest_poptrie_node_t *nodes;
+    uint8_t *leaves;
+    uint32_t nnodes;
+    uint32_t nleaves;
+    uint32_t nodes_cap;
+    uint32_t leaves_cap;
+} ipforest_poptrie_t;
+
+ipforest_poptrie_t * ipforest_poptrie_build(ipforest_radix_tree_t *tree);
+void ipforest_poptrie_free(ipforest_poptrie_t *trie);
+IPFOREST_BOOLEAN ipforest_poptrie_lookup(const ipforest_poptrie_t *trie, uint32_t addr);
+
+#endif
@@ -33,6 +33,15 @@ _free_node(ipforest_radix_tree_t *tree, ipforest_radix_tree_node_t *node)
     _list_insert_after(&tree->free, &node->entry);
 }
 
+/* nodes in the relayout block go away with it, not one by one */
+inline static void
+_release_node(ipforest_radix_tree_t *tree, ipforest_radix_tree_node_t *node)
+{
+    if (node < tree->block || node >= tree->block + tree->block_nodes) {
+        free(node);
+    }
+}
+
 inline static IPFOREST_BOOLEAN
 _is_leaf(ipforest_radix_tree_node_t *node)
 {
@@ -128,6 +137,25 @@ _prune_tree_up(ipforest_radix_tree_t *tree, ipforest_radix_tree_node_t *node)
     } while (IPFOREST_TRUE);
 }
 
+static IPFOREST_BOOLEAN
+_walk_node(ipforest_radix_tree_node_t *node, uint32_t addr, int depth,
+           ipforest_radix_tree_walk_pt handler, void *ctx)
+{
+    if (_is_leaf(node)) {
+        return handler(addr, depth ? 0xffffffff << (32 - depth) : 0, ctx);
+    }
+
+    if (node->l && !_walk_node(node->l, addr, depth + 1, handler, ctx)) {
+        return IPFOREST_FALSE;
+    }
+
+    if (node->r && !_walk_node(node->r, addr | (1u << (31 - depth)), depth + 1, handler, ctx)) {
+        return IPFOREST_FALSE;
+    }
+
+    return IPFOREST_TRUE;
+}
+
 ipforest_radix_tree_t *
 ipforest_radix_tree_alloc()
 {
@@ -148,14 +176,15 @@ ipforest_radix_tree_free(ipforest_radix_tree_t *tree)
 
     LIST_FOREACH(&tree->used, p, safe) {
         _list_unlink(p);
-        free(CONTAINER_OF(p, entry, ipforest_radix_tree_node_t));
+        _release_node(tree, CONTAINER_OF(p, entry, ipforest_radix_tree_node_t));
     }
 
     LIST_FOREACH(&tree->free, p, safe) {
         _list_unlink(p);
-        free(CONTAINER_OF(p, entry, ipforest_radix_tree_node_t));
+        _release_node(tree, CONTAINER_OF(p, entry, ipforest_radix_tree_node_t));
     }
 
+    free(tree->block);
     free(tree);
 }
 
@@ -166,8 +195,166 @@ ipforest_radix_tree_compact(ipforest_radix_tree_t *tree)
 
     LIST_FOREACH(&tree->free, p, safe) {
         _list_unlink(p);
-        free(CONTAINER_OF(p, entry, ipforest_radix_tree_node_t));
+        _release_node(tree, CONTAINER_OF(p, entry, ipforest_radix_tree_node_t));
+    }
+}
+
+typedef struct ipforest_radix_tree_layout_s {
+    ipforest_radix_tree_t *tree;
+    ipforest_radix_tree_node_t *block;
+    uint32_t next;                       /* next free slot of block */
+} ipforest_radix_tree_layout_t;
+
+static uint32_t
+_count_nodes(ipforest_radix_tree_node_t *node, int depth, int *height)
+{
+    if (!node) {
+        return 0;
+    }
+
+    if (depth + 1 > *height) {
+        *height = depth + 1;
+    }
+
+    if (_is_leaf(node)) {
+        return 1;
+    }
+
+    return 1 + _count_nodes(node->l, depth + 1, height)
+             + _count_nodes(node->r, depth + 1, height);
+}
+
+/*
+ * copy node to the next slot. its parent went before it, so the parent's
+ * copy is found through the old parent and pointed at the copy. the old
+ * node keeps where it went in entry.prev, entry.next still chains the used
+ * list so the old nodes can be freed afterwards
+ */
+static void
+_place_node(ipforest_radix_tree_layout_t *layout, ipforest_radix_tree_node_t *node)
+{
+    ipforest_radix_tree_node_t *copy, *parent;
+
+    if (node == &layout->tree->root) {
+        return;
+    }
+
+    copy = &layout->block[layout->next++];
+    *copy = *node;
+
+    parent = node->p == &layout->tree->root ?
+        node->p : (ipforest_radix_tree_node_t *)node->p->entry.prev;
+    copy->p = parent;
+
+    if (parent->l == node) {
+        parent->l = copy;
+    } else {
+        parent->r = copy;
+    }
+
+    if (_is_leaf(node)) {
+        _make_leaf(copy);
+    }
+
+    node->entry.prev = (ipforest_list_entry_t *)copy;
+}
+
+static void _layout_veb(ipforest_radix_tree_layout_t *layout,
+                        ipforest_radix_tree_node_t *node, int height);
+
+/* lay out the subtrees hanging depth levels below node */
+static void
+_layout_bottoms(ipforest_radix_tree_layout_t *layout, ipforest_radix_tree_node_t *node,
+                int depth, int height)
+{
+    if (!node || _is_leaf(node)) {
+        return;
+    }
+
+    if (depth == 1) {
+        _layout_veb(layout, node->l, height);
+        _layout_veb(layout, node->r, height);
+        return;
+    }
+
+    _layout_bottoms(layout, node->l, depth - 1, height);
+    _layout_bottoms(layout, node->r, depth - 1, height);
+}
+
+/*
+ * van Emde Boas order: the top half of the levels first, then every
+ * subtree below them the same way, so a walk down stays in few blocks
+ * whatever size cache lines and pages are
+ */
+static void
+_layout_veb(ipforest_radix_tree_layout_t *layout, ipforest_radix_tree_node_t *node, int height)
+{
+    int top;
+
+    if (!node) {
+        return;
     }
+
+    if (height == 1 || _is_leaf(node)) {
+        _place_node(layout, node);
+        return;
+    }
+
+    top = height / 2;
+
+    _layout_veb(layout, node, top);
+    _layout_bottoms(layout, node, top, height - top);
+}
+
+/*
+ * copy the tree into one contiguous block in van Emde Boas order, nodes
+ * kept aside for inserts are released too. the tree is left as it was if
+ * there is no memory for the block
+ */
+IPFOREST_BOOLEAN
+ipforest_radix_tree_relayout(ipforest_radix_tree_t *tree)
+{
+    int height;
+    uint32_t n, i;
+    ipforest_list_entry_t *p, *next;
+    ipforest_radix_tree_node_t *old_block;
+    ipforest_radix_tree_layout_t layout;
+
+    ipforest_radix_tree_compact(tree);
+
+    height = 0;
+    n = _count_nodes(&tree->root, 0, &height) - 1;
+
+    layout.tree = tree;
+    layout.block = NULL;
+    layout.next = 0;
+
+    /* starts on a cache line, nodes take 40 bytes so some of them straddle two */
+    if (n > 0 && posix_memalign((void **)&layout.block, 64,
+                                n * sizeof(ipforest_radix_tree_node_t)) != 0) {
+        return IPFOREST_FALSE;
+    }
+
+    _layout_veb(&layout, &tree->root, height);
+    assert(layout.next == n);
+
+    /* entry.prev of old nodes is taken, walk the used list forward only */
+    for (p = tree->used.next; p != &tree->used; p = next) {
+        next = p->next;
+        _release_node(tree, CONTAINER_OF(p, entry, ipforest_radix_tree_node_t));
+    }
+
+    old_block = tree->block;
+    tree->block = layout.block;
+    tree->block_nodes = n;
+    free(old_block);
+
+    _list_init(&tree->used);
+    for (i = 0; i < n; i++) {
+        _list_insert_before(&tree->used, &tree->block[i].entry);
+    }
+
+    return IPFOREST_TRUE;
 }
 
 IPFOREST_BOOLEAN
@@ -228,6 +415,262 @@ ipforest_radix_tree_insert(ipforest_radix_tree_t *tree, uint32_t addr, uint32_t
     return IPFOREST_TRUE;
 }
 
+/* leading ones, as far as insert follows a mask */
+inline static int
+_mask_plen(uint32_t mask)
+{
+    return mask == 0xffffffff ? 32 : __builtin_clz(~mask);
+}
+
+/* address order, a prefix before the ones it covers */
+static int
+_prefix_cmp(const void *a, const void *b)
+{
+    const ipforest_ipaddr_t *x = a, *y = b;
+
+    if (x->addr != y->addr) {
+        return x->addr < y->addr ? -1 : 1;
+    }
+    return x->mask < y->mask ? -1 : (x->mask > y->mask);
+}
+
+/*
+ * merge sorted disjoint prefixes, all under node which is depth bits down,
+ * into the subtree of node. siblings are aggregated once on the way back up
+ */
+static IPFOREST_BOOLEAN
+_insert_sorted(ipforest_radix_tree_t *tree, ipforest_radix_tree_node_t *node, int depth,
+               ipforest_ipaddr_t *prefixes, size_t count)
+{
+    size_t lo, hi, mid;
+    uint32_t bit;
+    ipforest_radix_tree_node_t **pchild;
+    IPFOREST_BOOLEAN ok;
+
+    if (_is_leaf(node)) {
+        return IPFOREST_TRUE;
+    }
+
+    /* disjoint, so the one covering node is alone */
+    if (_mask_plen(prefixes[0].mask) == depth) {
+        _prune_tree_down(tree, node);
+        _make_leaf(node);
+        return IPFOREST_TRUE;
+    }
+
+    /* first prefix with the next bit set */
+    bit = 1u << (31 - depth);
+    lo = 0;
+    hi = count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (prefixes[mid].addr & bit) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    ok = IPFOREST_TRUE;
+
+    if (lo > 0) {
+        pchild = &node->l;
+        if (!*pchild && (*pchild = _get_node(tree))) {
+            (*pchild)->p = node;
+        }
+        ok = *pchild && _insert_sorted(tree, *pchild, depth + 1, prefixes, lo);
+    }
+
+    if (ok && lo < count) {
+        pchild = &node->r;
+        if (!*pchild && (*pchild = _get_node(tree))) {
+            (*pchild)->p = node;
+        }
+        ok = *pchild && _insert_sorted(tree, *pchild, depth + 1, prefixes + lo, count - lo);
+    }
+
+    if (node->l && node->r && _is_leaf(node->l) && _is_leaf(node->r)) {
+        _free_node(tree, node->l);
+        _free_node(tree, node->r);
+        _make_leaf(node);
+    }
+
+    return ok;
+}
+
+/*
+ * insert many prefixes in one ordered pass, paths they share are walked
+ * once. prefixes are masked and sorted in place
+ */
+IPFOREST_BOOLEAN
+ipforest_radix_tree_insert_many(ipforest_radix_tree_t *tree, ipforest_ipaddr_t *prefixes, size_t count)
+{
+    int plen;
+    size_t i, n;
+    uint32_t end;
+
+    if (count == 0) {
+        return IPFOREST_TRUE;
+    }
+
+    for (i = 0; i < count; i++) {
+        plen = _mask_plen(prefixes[i].mask);
+        prefixes[i].mask = plen ? 0xffffffff << (32 - plen) : 0;
+        prefixes[i].addr &= prefixes[i].mask;
+    }
+
+    qsort(prefixes, count, sizeof(ipforest_ipaddr_t), _prefix_cmp);
+
+    /* drop prefixes covered by an earlier one */
+    n = 0;
+    end = 0;
+    for (i = 0; i < count; i++) {
+        if (n > 0 && prefixes[i].addr <= end) {
+            continue;
+        }
+        prefixes[n++] = prefixes[i];
+        end = prefixes[i].addr | ~prefixes[i].mask;
+        if (end == 0xffffffff) {
+            break;
+        }
+    }
+
+    return _insert_sorted(tree, &tree->root, 0, prefixes, n);
+}
+
+/* nodes waiting to be made leaves, chained by depth */
+typedef struct ipforest_radix_tree_pending_s {
+    ipforest_radix_tree_node_t *node;
+    uint32_t next;                       /* index + 1 of the next one, 0 if last */
+} ipforest_radix_tree_pending_t;
+
+typedef struct ipforest_radix_tree_lossy_s {
+    ipforest_radix_tree_pending_t *pending;
+    uint32_t count;
+    uint32_t heads[32];                  /* by depth, index + 1 of the first one */
+} ipforest_radix_tree_lossy_t;
+
+/* addresses covered under node which is depth bits down */
+static uint64_t
+_covered(ipforest_radix_tree_node_t *node, int depth)
+{
+    if (!node) {
+        return 0;
+    }
+
+    if (_is_leaf(node)) {
+        return (uint64_t)1 << (32 - depth);
+    }
+
+    return _covered(node->l, depth + 1) + _covered(node->r, depth + 1);
+}
+
+/* an inner node with nothing but leaves below */
+inline static IPFOREST_BOOLEAN
+_is_last_inner(ipforest_radix_tree_node_t *node)
+{
+    return !_is_leaf(node) && (node->l || node->r)
+        && (!node->l || _is_leaf(node->l)) && (!node->r || _is_leaf(node->r));
+}
+
+inline static void
+_push_pending(ipforest_radix_tree_lossy_t *lossy, ipforest_radix_tree_node_t *node, int depth)
+{
+    lossy->pending[lossy->count].node = node;
+    lossy->pending[lossy->count].next = lossy->heads[depth];
+    lossy->heads[depth] = ++lossy->count;
+}
+
+static void
+_gather_pending(ipforest_radix_tree_lossy_t *lossy, ipforest_radix_tree_node_t *node, int depth)
+{
+    if (!node || _is_leaf(node)) {
+        return;
+    }
+
+    if (_is_last_inner(node)) {
+        _push_pending(lossy, node, depth);
+        return;
+    }
+
+    _gather_pending(lossy, node->l, depth + 1);
+    _gather_pending(lossy, node->r, depth + 1);
+}
+
+/*
+ * make leaves of inner nodes until no more than max_nodes are left, the
+ * deepest first as a leaf there adds the fewest addresses. only nodes with
+ * nothing but leaves below are made leaves, so each step costs exactly the
+ * addresses it adds, and siblings are aggregated up as on insert. extra
+ * gets the addresses now matched that were not, nodes those left
+ */
+IPFOREST_BOOLEAN
+ipforest_radix_tree_compact_lossy(ipforest_radix_tree_t *tree, uint32_t max_nodes,
+                                  uint64_t *extra, uint32_t *nodes)
+{
+    int depth, height, up;
+    uint32_t n, i;
+    ipforest_radix_tree_node_t *node, *top, *sibling;
+    ipforest_radix_tree_lossy_t lossy;
+
+    height = 0;
+    n = _count_nodes(&tree->root, 0, &height) - 1;
+
+    *extra = 0;
+
+    if (n > max_nodes) {
+        /* each node is pending at most once and a leaf never is */
+        memset(&lossy, 0, sizeof(ipforest_radix_tree_lossy_t));
+        lossy.pending = malloc((n + 1) * sizeof(ipforest_radix_tree_pending_t));
+        if (!lossy.pending) {
+            return IPFOREST_FALSE;
+        }
+
+        _gather_pending(&lossy, &tree->root, 0);
+
+        for (depth = 31; depth >= 0 && n > max_nodes; depth--) {
+            while (lossy.heads[depth] && n > max_nodes) {
+                i = lossy.heads[depth] - 1;
+                lossy.heads[depth] = lossy.pending[i].next;
+                node = lossy.pending[i].node;
+
+                *extra += ((uint64_t)1 << (32 - depth)) - _covered(node, depth);
+                n -= _count_nodes(node, 0, &height) - 1;
+
+                _prune_tree_down(tree, node);
+
+                /* as far as siblings aggregate, two nodes less a level */
+                top = node;
+                up = 0;
+                while ((sibling = _get_sibling(top)) && _is_leaf(sibling)) {
+                    top = top->p;
+                    up++;
+                }
+                n -= 2 * up;
+
+                _prune_tree_up(tree, node);
+
+                if (top->p && _is_last_inner(top->p)) {
+                    _push_pending(&lossy, top->p, depth - up - 1);
+                }
+            }
+        }
+
+        free(lossy.pending);
+    }
+
+    ipforest_radix_tree_compact(tree);
+    *nodes = n;
+
+    return IPFOREST_TRUE;
+}
+
+uint64_t
+ipforest_radix_tree_covered(ipforest_radix_tree_t *tree)
+{
+    return _covered(&tree->root, 0);
+}
+
 IPFOREST_BOOLEAN
 ipforest_radix_tree_lookup(ipforest_radix_tree_t *tree, uint32_t addr, uint32_t mask)
 {
@@ -260,3 +703,190 @@ ipforest_radix_tree_lookup(ipforest_radix_tree_t *tree, uint32_t addr, uint32_t
         return IPFOREST_FALSE;
     }
 }
+
+/*
+ * same as ipforest_radix_tree_lookup, also tell the prefix length of the
+ * leaf which terminated the match
+ */
+IPFOREST_BOOLEAN
+ipforest_radix_tree_match(ipforest_radix_tree_t *tree, uint32_t addr, uint32_t mask, int *plen)
+{
+    uint32_t m;
+    ipforest_radix_tree_node_t *cur;
+
+    m = 1u << 31;
+    cur = &tree->root;
+    *plen = 0;
+
+    while (m & mask) {
+        if (_is_leaf(cur)) {
+            return IPFOREST_TRUE;
+        }
+        if (addr & m) {
+            cur = cur->r;
+        } else {
+            cur = cur->l;
+        }
+
+        if (!cur) {
+            return IPFOREST_FALSE;
+        }
+
+        *plen += 1;
+        m = m >> 1;
+    }
+
+    return _is_leaf(cur);
+}
+
+/*
+ * tell if any leaf shares an address with addr/mask, either a leaf above it
+ * or any node at its depth, a node always has a leaf down from it
+ */
+IPFOREST_BOOLEAN
+ipforest_radix_tree_overlaps(ipforest_radix_tree_t *tree, uint32_t addr, uint32_t mask)
+{
+    uint32_t m;
+    ipforest_radix_tree_node_t *cur;
+
+    m = 1u << 31;
+    cur = &tree->root;
+
+    while (m & mask) {
+        if (_is_leaf(cur)) {
+            return IPFOREST_TRUE;
+        }
+        if (addr & m) {
+            cur = cur->r;
+        } else {
+            cur = cur->l;
+        }
+
+        if (!cur) {
+            return IPFOREST_FALSE;
+        }
+
+        m = m >> 1;
+    }
+
+    return _is_leaf(cur) || cur->l || cur->r;
+}
+
+static IPFOREST_BOOLEAN
+_next_node(ipforest_radix_tree_node_t *node, uint32_t addr, int depth,
+           uint32_t from, uint32_t *paddr, int *plen)
+{
+    /* whole subtree below from */
+    if ((addr | (depth ? ~(0xffffffff << (32 - depth)) : 0xffffffff)) < from) {
+        return IPFOREST_FALSE;
+    }
+
+    if (_is_leaf(node)) {
+        *paddr = addr;
+        *plen = depth;
+        return IPFOREST_TRUE;
+    }
+
+    if (node->l && _next_node(node->l, addr, depth + 1, from, paddr, plen)) {
+        return IPFOREST_TRUE;
+    }
+
+    if (node->r && _next_node(node->r, addr | (1u << (31 - depth)), depth + 1, from, paddr, plen)) {
+        return IPFOREST_TRUE;
+    }
+
+    return IPFOREST_FALSE;
+}
+
+/*
+ * find the first leaf in address order not ending before from, that is the
+ * one holding from or else the next one. only the path to from is walked
+ * plus one descent, subtrees left of it are skipped whole
+ */
+IPFOREST_BOOLEAN
+ipforest_radix_tree_next(ipforest_radix_tree_t *tree, uint32_t from, uint32_t *paddr, int *plen)
+{
+    return _next_node(&tree->root, 0, 0, from, paddr, plen);
+}
+
+/* first empty slot below node not ending before from */
+static IPFOREST_BOOLEAN
+_gap_node(ipforest_radix_tree_node_t *node, uint32_t addr, int depth,
+          uint32_t from, uint32_t *paddr, int *plen)
+{
+    if ((addr | (depth ? ~(0xffffffff << (32 - depth)) : 0xffffffff)) < from) {
+        return IPFOREST_FALSE;
+    }
+
+    if (!node) {
+        *paddr = addr;
+        *plen = depth;
+        return IPFOREST_TRUE;
+    }
+
+    if (_is_leaf(node)) {
+        return IPFOREST_FALSE;
+    }
+
+    return _gap_node(node->l, addr, depth + 1, from, paddr, plen)
+        || _gap_node(node->r, addr | (1u << (31 - depth)), depth + 1, from, paddr, plen);
+}
+
+static IPFOREST_BOOLEAN
+_diff_node(ipforest_radix_tree_node_t *a, ipforest_radix_tree_node_t *b,
+           uint32_t addr, int depth, uint32_t from,
+           uint32_t *paddr, int *plen, IPFOREST_BOOLEAN *added)
+{
+    IPFOREST_BOOLEAN a_leaf, b_leaf;
+
+    /* also true for two empty slots */
+    if (a == b || (addr | (depth ? ~(0xffffffff << (32 - depth)) : 0xffffffff)) < from) {
+        return IPFOREST_FALSE;
+    }
+
+    if (!a || !b) {
+        *added = !a;
+        return _next_node(a ? a : b, addr, depth, from, paddr, plen);
+    }
+
+    a_leaf = _is_leaf(a);
+    b_leaf = _is_leaf(b);
+
+    if (a_leaf && b_leaf) {
+        return IPFOREST_FALSE;
+    }
+
+    /* what the other side leaves empty below a covered prefix */
+    if (a_leaf || b_leaf) {
+        *added = a_leaf ? IPFOREST_FALSE : IPFOREST_TRUE;
+        return _gap_node(a_leaf ? b : a, addr, depth, from, paddr, plen);
+    }
+
+    return _diff_node(a->l, b->l, addr, depth + 1, from, paddr, plen, added)
+        || _diff_node(a->r, b->r, addr | (1u << (31 - depth)), depth + 1, from, paddr, plen, added);
+}
+
+/*
+ * find the first prefix in address order not ending before from which is
+ * in one tree and not in the other, added if it is in ntree. both trees are
+ * walked in lockstep and only where they differ, prefixes come out as large
+ * as possible so the whole delta is the fewest cidrs
+ */
+IPFOREST_BOOLEAN
+ipforest_radix_tree_diff_next(ipforest_radix_tree_t *otree, ipforest_radix_tree_t *ntree,
+                              uint32_t from, uint32_t *paddr, int *plen, IPFOREST_BOOLEAN *added)
+{
+    ipforest_radix_tree_node_t *a, *b;
+
+    /* an empty root is no prefix at all */
+    a = otree->root.l || otree->root.r ? &otree->root : NULL;
+    b = ntree->root.l || ntree->root.r ? &ntree->root : NULL;
+
+    return _diff_node(a, b, 0, 0, from, paddr, plen, added);
+}
+
+IPFOREST_BOOLEAN
+ipforest_radix_tree_walk(ipforest_radix_tree_t *tree, ipforest_radix_tree_walk_pt handler, void *ctx)
+{
+    return _walk_node(&tree->root, 0, 0, handler, ctx);
+}
@@ -1,6 +1,7 @@
 #ifndef IPFOREST_RADIX_TREE
 #define IPFOREST_RADIX_TREE
 
+#include <stddef.h>
 #include "ipforest_types.h"
 
 typedef struct ipforest_radix_tree_node_s {
@@ -10,16 +11,38 @@ typedef struct ipforest_radix_tree_node_s {
     ipforest_list_entry_t entry;   /* next if in free list or used list */
 } ipforest_radix_tree_node_t;
 
+/* a leaf points to itself, the whole prefix down from it is covered */
+#define IPFOREST_RADIX_TREE_IS_LEAF(node) \
+    ((node)->l == (node) && (node)->r == (node))
+
 typedef struct ipforest_radix_tree_s {
     ipforest_radix_tree_node_t root;
     ipforest_list_entry_t used;
     ipforest_list_entry_t free;
+    ipforest_radix_tree_node_t *block;   /* nodes laid out by relayout, NULL if none */
+    uint32_t block_nodes;
 } ipforest_radix_tree_t;
 
+/* called on every leaf in address order, return IPFOREST_FALSE to stop */
+typedef IPFOREST_BOOLEAN (*ipforest_radix_tree_walk_pt)(uint32_t addr, uint32_t mask, void *ctx);
+
 ipforest_radix_tree_t * ipforest_radix_tree_alloc();
 void ipforest_radix_tree_free(ipforest_radix_tree_t *tree);
 void ipforest_radix_tree_compact(ipforest_radix_tree_t *tree);
+/* match more to get down to max_nodes nodes, extra gets how many more addresses */
+IPFOREST_BOOLEAN ipforest_radix_tree_compact_lossy(ipforest_radix_tree_t *tree, uint32_t max_nodes,
+                                                   uint64_t *extra, uint32_t *nodes);
+/* number of addresses matched */
+uint64_t ipforest_radix_tree_covered(ipforest_radix_tree_t *tree);
+IPFOREST_BOOLEAN ipforest_radix_tree_relayout(ipforest_radix_tree_t *tree);
 IPFOREST_BOOLEAN ipforest_radix_tree_insert(ipforest_radix_tree_t *tree, uint32_t addr, uint32_t mask);
+IPFOREST_BOOLEAN ipforest_radix_tree_insert_many(ipforest_radix_tree_t *tree, ipforest_ipaddr_t *prefixes, size_t count);
 IPFOREST_BOOLEAN ipforest_radix_tree_lookup(ipforest_radix_tree_t *tree, uint32_t addr, uint32_t mask);
+IPFOREST_BOOLEAN ipforest_radix_tree_match(ipforest_radix_tree_t *tree, uint32_t addr, uint32_t mask, int *plen);
+IPFOREST_BOOLEAN ipforest_radix_tree_overlaps(ipforest_radix_tree_t *tree, uint32_t addr, uint32_t mask);
+IPFOREST_BOOLEAN ipforest_radix_tree_next(ipforest_radix_tree_t *tree, uint32_t from, uint32_t *paddr, int *plen);
+IPFOREST_BOOLEAN ipforest_radix_tree_diff_next(ipforest_radix_tree_t *otree, ipforest_radix_tree_t *ntree,
+                                              uint32_t from, uint32_t *paddr, int *plen, IPFOREST_BOOLEAN *added);
+IPFOREST_BOOLEAN ipforest_radix_tree_walk(ipforest_radix_tree_t *tree, ipforest_radix_tree_walk_pt handler, void *ctx);
 
 #endif
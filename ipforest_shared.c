@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "ipforest_types.h"
+#include "ipforest_radix_tree.h"
+#include "ipforest_shared.h"
+
+/* guards the store list, version swaps and reference acquisition */
+static pthread_mutex_t ipforest_shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ipforest_list_entry_t ipforest_shared_store = {
+    &ipforest_shared_store, &ipforest_shared_store
+};
+
+/*
+ * find entry by name, store lock should be held
+ */
+inline static ipforest_shared_entry_t *
+_find_entry(const char *name)
+{
+    ipforest_list_entry_t *p, *safe;
+    ipforest_shared_entry_t *entry;
+
+    LIST_FOREACH(&ipforest_shared_store, p, safe) {
+        entry = CONTAINER_OF(p, entry, ipforest_shared_entry_t);
+        if (strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * take a reference on the current version, store lock should be held
+ */
+inline static ipforest_shared_version_t *
+_acquire_version(ipforest_shared_entry_t *entry)
+{
+    ipforest_shared_version_t *version;
+
+    version = entry->current;
+    __sync_add_and_fetch(&version->refs, 1);
+
+    return version;
+}
+
+inline static void
+_release_version(ipforest_shared_version_t *version)
+{
+    if (__sync_sub_and_fetch(&version->refs, 1) == 0) {
+        /* last one detached, retire it */
+        ipforest_radix_tree_free(version->tree);
+        free(version);
+    }
+}
+
+IPFOREST_BOOLEAN
+ipforest_shared_publish(const char *name, ipforest_radix_tree_t *tree)
+{
+    ipforest_shared_entry_t *entry;
+    ipforest_shared_version_t *version, *old;
+
+    version = malloc(sizeof(ipforest_shared_version_t));
+    if (!version) {
+        return IPFOREST_FALSE;
+    }
+
+    /* the store itself holds one reference */
+    version->tree = tree;
+    version->refs = 1;
+    old = NULL;
+
+    pthread_mutex_lock(&ipforest_shared_lock);
+
+    entry = _find_entry(name);
+    if (!entry) {
+        entry = malloc(sizeof(ipforest_shared_entry_t));
+        if (!entry) {
+            goto fail;
+        }
+
+        entry->name = strdup(name);
+        if (!entry->name) {
+            free(entry);
+            goto fail;
+        }
+
+        entry->current = NULL;
+        _list_insert_before(&ipforest_shared_store, &entry->entry);
+    }
+
+    old = entry->current;
+    __atomic_store_n(&entry->current, version, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&ipforest_shared_lock);
+
+    if (old) {
+        _release_version(old);
+    }
+
+    return IPFOREST_TRUE;
+
+fail:
+    pthread_mutex_unlock(&ipforest_shared_lock);
+    free(version);
+    return IPFOREST_FALSE;
+}
+
+ipforest_shared_ref_t *
+ipforest_shared_attach(const char *name)
+{
+    ipforest_shared_entry_t *entry;
+    ipforest_shared_ref_t *ref;
+
+    ref = malloc(sizeof(ipforest_shared_ref_t));
+    if (!ref) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&ipforest_shared_lock);
+
+    entry = _find_entry(name);
+    if (!entry) {
+        pthread_mutex_unlock(&ipforest_shared_lock);
+        free(ref);
+        return NULL;
+    }
+
+    ref->shared = entry;
+    ref->version = _acquire_version(entry);
+
+    pthread_mutex_unlock(&ipforest_shared_lock);
+
+    return ref;
+}
+
+/*
+ * return the tree to do lookups on, moving to the newest version if one
+ * has been published since. entries are never freed, so the fast path is a
+ * single atomic load and compare.
+ */
+ipforest_radix_tree_t *
+ipforest_shared_tree(ipforest_shared_ref_t *ref)
+{
+    ipforest_shared_version_t *old;
+
+    if (__atomic_load_n(&ref->shared->current, __ATOMIC_ACQUIRE) == ref->version) {
+        return ref->version->tree;
+    }
+
+    old = ref->version;
+
+    pthread_mutex_lock(&ipforest_shared_lock);
+    ref->version = _acquire_version(ref->shared);
+    pthread_mutex_unlock(&ipforest_shared_lock);
+
+    _release_version(old);
+
+    return ref->version->tree;
+}
+
+void
+ipforest_shared_detach(ipforest_shared_ref_t *ref)
+{
+    _release_version(ref->version);
+    free(ref);
+}
@@ -0,0 +1,36 @@
+#ifndef IPFOREST_SHARED
+#define IPFOREST_SHARED
+
+#include "ipforest_types.h"
+#include "ipforest_radix_tree.h"
+
+/*
+ * process wide store of frozen trees, shared by every lua_State.
+ *
+ * a published tree is never modified again, so lookups on it need no lock.
+ * publishing under an existing name swaps in a new version, the old one is
+ * retired once the last reference to it is dropped.
+ */
+
+typedef struct ipforest_shared_version_s {
+    ipforest_radix_tree_t *tree;
+    int refs;                      /* store + attached references */
+} ipforest_shared_version_t;
+
+typedef struct ipforest_shared_entry_s {
+    ipforest_list_entry_t entry;   /* next in store */
+    char *name;
+    ipforest_shared_version_t *current;
+} ipforest_shared_entry_t;
+
+typedef struct ipforest_shared_ref_s {
+    ipforest_shared_entry_t *shared;
+    ipforest_shared_version_t *version;
+} ipforest_shared_ref_t;
+
+IPFOREST_BOOLEAN ipforest_shared_publish(const char *name, ipforest_radix_tree_t *tree);
+ipforest_shared_ref_t * ipforest_shared_attach(const char *name);
+ipforest_radix_tree_t * ipforest_shared_tree(ipforest_shared_ref_t *ref);
+void ipforest_shared_detach(ipforest_shared_ref_t *ref);
+
+#endif
@@ -0,0 +1,498 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ipforest_types.h"
+#include "ipforest_shm.h"
+
+#define IPFOREST_SHM_MAGIC 0x49504653       /* "IPFS" */
+#define IPFOREST_SHM_VERSION 1
+#define IPFOREST_SHM_LEAF 0xffffffff
+#define IPFOREST_SHM_ROOT 1
+/* size of a segment created without one */
+#define IPFOREST_SHM_NODES (1 << 20)
+
+/* lookups retried this many times while the writer is busy, then yield */
+#define IPFOREST_SHM_SPINS 64
+/* a writer that died mid update leaves seq odd, give up waiting after this */
+#define IPFOREST_SHM_RETRIES 4096
+
+#define _load(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define _store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+inline static size_t
+_segment_size(uint32_t capacity)
+{
+    return sizeof(ipforest_shm_header_t) + (size_t)capacity * sizeof(ipforest_shm_node_t);
+}
+
+inline static IPFOREST_BOOLEAN
+_is_leaf(const ipforest_shm_t *shm, uint32_t idx)
+{
+    return idx != 0 && shm->nodes[idx].l == IPFOREST_SHM_LEAF;
+}
+
+/*
+ * writer side of the sequence counter, readers retry while it is odd or
+ * changed under them
+ */
+inline static void
+_write_begin(ipforest_shm_t *shm)
+{
+    _store(&shm->header->seq, shm->header->seq + 1);
+    /* the odd count is seen before any node changes */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+inline static void
+_write_end(ipforest_shm_t *shm)
+{
+    __atomic_store_n(&shm->header->seq, shm->header->seq + 1, __ATOMIC_RELEASE);
+}
+
+inline static uint32_t
+_get_node(ipforest_shm_t *shm)
+{
+    ipforest_shm_header_t *header;
+    uint32_t idx;
+
+    header = shm->header;
+
+    if (header->free) {
+        idx = header->free;
+        header->free = shm->nodes[idx].l;
+    } else if (header->top < shm->capacity) {
+        idx = header->top++;
+    } else {
+        return 0;
+    }
+
+    _store(&shm->nodes[idx].l, 0);
+    _store(&shm->nodes[idx].r, 0);
+    _store(&header->used, header->used + 1);
+
+    return idx;
+}
+
+inline static void
+_release_node(ipforest_shm_t *shm, uint32_t idx)
+{
+    /* a reader may still be on it, it only ever finds indices in range */
+    _store(&shm->nodes[idx].l, shm->header->free);
+    shm->header->free = idx;
+    _store(&shm->header->used, shm->header->used - 1);
+}
+
+static void
+_release_tree(ipforest_shm_t *shm, uint32_t idx)
+{
+    ipforest_shm_node_t *node;
+
+    if (idx == 0) {
+        return;
+    }
+
+    node = &shm->nodes[idx];
+    if (node->l != IPFOREST_SHM_LEAF) {
+        _release_tree(shm, node->l);
+        _release_tree(shm, node->r);
+    }
+
+    _release_node(shm, idx);
+}
+
+/*
+ * turn idx into a leaf, what hung below goes back to the arena
+ */
+inline static void
+_make_leaf(ipforest_shm_t *shm, uint32_t idx)
+{
+    uint32_t l, r;
+
+    l = shm->nodes[idx].l;
+    r = shm->nodes[idx].r;
+
+    _store(&shm->nodes[idx].r, IPFOREST_SHM_LEAF);
+    _store(&shm->nodes[idx].l, IPFOREST_SHM_LEAF);
+
+    _release_tree(shm, l);
+    _release_tree(shm, r);
+}
+
+/*
+ * drop fresh, the first node an insert made along path, and the ones below
+ * it. everything below fresh is on path too, made by the same insert
+ */
+static void
+_unlink_fresh(ipforest_shm_t *shm, const uint32_t *path, int depth, uint32_t fresh)
+{
+    int i;
+    ipforest_shm_node_t *parent;
+
+    for (i = 0; i < depth; i++) {
+        parent = &shm->nodes[path[i]];
+        if (parent->l == fresh) {
+            _store(&parent->l, 0);
+            break;
+        }
+        if (parent->r == fresh) {
+            _store(&parent->r, 0);
+            break;
+        }
+    }
+
+    _release_tree(shm, fresh);
+}
+
+static IPFOREST_BOOLEAN
+_insert(ipforest_shm_t *shm, uint32_t addr, uint32_t mask)
+{
+    int depth;
+    uint32_t bit, idx, child, fresh, path[32];
+    ipforest_shm_node_t *node;
+
+    idx = IPFOREST_SHM_ROOT;
+    depth = 0;
+    fresh = 0;
+
+    for (bit = 0x80000000; bit & mask; bit >>= 1) {
+        node = &shm->nodes[idx];
+
+        /* covered already */
+        if (node->l == IPFOREST_SHM_LEAF) {
+            return IPFOREST_TRUE;
+        }
+
+        path[depth++] = idx;
+
+        child = (addr & bit) ? node->r : node->l;
+        if (!child) {
+            child = _get_node(shm);
+            if (!child) {
+                /* arena full, take back the path made so far */
+                if (fresh) {
+                    _unlink_fresh(shm, path, depth, fresh);
+                }
+                return IPFOREST_FALSE;
+            }
+            if (addr & bit) {
+                _store(&node->r, child);
+            } else {
+                _store(&node->l, child);
+            }
+            if (!fresh) {
+                fresh = child;
+            }
+        }
+
+        idx = child;
+    }
+
+    if (shm->nodes[idx].l == IPFOREST_SHM_LEAF) {
+        return IPFOREST_TRUE;
+    }
+
+    _make_leaf(shm, idx);
+
+    /* aggregate siblings up the path */
+    while (depth > 0) {
+        idx = path[--depth];
+        if (!_is_leaf(shm, shm->nodes[idx].l) || !_is_leaf(shm, shm->nodes[idx].r)) {
+            break;
+        }
+        _make_leaf(shm, idx);
+    }
+
+    return IPFOREST_TRUE;
+}
+
+/*
+ * walk once without regard to the writer, an index read in the middle of
+ * an update is at worst out of range or a node of another prefix
+ */
+inline static IPFOREST_BOOLEAN
+_walk(const ipforest_shm_t *shm, uint32_t addr)
+{
+    uint32_t bit, idx, l, r;
+
+    idx = IPFOREST_SHM_ROOT;
+
+    for (bit = 0x80000000; ; bit >>= 1) {
+        l = _load(&shm->nodes[idx].l);
+        if (l == IPFOREST_SHM_LEAF) {
+            return IPFOREST_TRUE;
+        }
+        if (!bit) {
+            return IPFOREST_FALSE;
+        }
+
+        r = _load(&shm->nodes[idx].r);
+        idx = (addr & bit) ? r : l;
+        if (idx == 0 || idx >= shm->capacity) {
+            return IPFOREST_FALSE;
+        }
+    }
+}
+
+/*
+ * map fd and check what it holds, a segment still being set up by its
+ * creator has no magic yet
+ */
+static ipforest_shm_t *
+_map(int fd, IPFOREST_BOOLEAN writable)
+{
+    struct stat st;
+    void *map;
+    ipforest_shm_t *shm;
+    ipforest_shm_header_t *header;
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < _segment_size(IPFOREST_SHM_ROOT + 1)) {
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+               MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    header = map;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != IPFOREST_SHM_MAGIC
+        || header->version != IPFOREST_SHM_VERSION
+        || _segment_size(header->capacity) > (size_t)st.st_size
+        || header->capacity <= IPFOREST_SHM_ROOT) {
+        goto fail;
+    }
+
+    shm = malloc(sizeof(ipforest_shm_t));
+    if (!shm) {
+        goto fail;
+    }
+
+    shm->header = header;
+    shm->nodes = (ipforest_shm_node_t *)(header + 1);
+    shm->capacity = header->capacity;
+    shm->size = st.st_size;
+    shm->fd = -1;
+    shm->writable = writable;
+
+    return shm;
+
+fail:
+    munmap(map, st.st_size);
+    return NULL;
+}
+
+/*
+ * tell if the segment behind fd was set up, its creator may have died
+ * between sizing it and storing the magic
+ */
+inline static IPFOREST_BOOLEAN
+_has_magic(int fd)
+{
+    uint32_t magic;
+
+    return pread(fd, &magic, sizeof(magic), 0) == sizeof(magic)
+           && magic == IPFOREST_SHM_MAGIC;
+}
+
+ipforest_shm_t *
+ipforest_shm_create(const char *name, uint32_t nodes)
+{
+    int fd;
+    struct stat st;
+    size_t size;
+    ipforest_shm_header_t *header;
+    ipforest_shm_t *shm;
+
+    if (nodes != 0 && (nodes <= IPFOREST_SHM_ROOT || nodes == IPFOREST_SHM_LEAF)) {
+        return NULL;
+    }
+
+    fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    /* the one writer, held until closed */
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0) {
+        goto fail;
+    }
+
+    /* under the lock nobody is setting it up, start it over */
+    if (st.st_size > 0 && !_has_magic(fd)) {
+        if (ftruncate(fd, 0) != 0) {
+            goto fail;
+        }
+        st.st_size = 0;
+    }
+
+    if (st.st_size == 0) {
+        if (nodes == 0) {
+            nodes = IPFOREST_SHM_NODES;
+        }
+        size = _segment_size(nodes);
+        if (ftruncate(fd, size) != 0) {
+            goto fail;
+        }
+
+        header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (header == MAP_FAILED) {
+            goto fail;
+        }
+
+        /* fresh pages are zero, the root is an empty node */
+        header->version = IPFOREST_SHM_VERSION;
+        header->capacity = nodes;
+        header->seq = 0;
+        header->top = IPFOREST_SHM_ROOT + 1;
+        header->free = 0;
+        header->used = 1;
+        __atomic_store_n(&header->magic, IPFOREST_SHM_MAGIC, __ATOMIC_RELEASE);
+
+        munmap(header, size);
+    }
+
+    shm = _map(fd, IPFOREST_TRUE);
+    if (!shm) {
+        goto fail;
+    }
+
+    /* the size is fixed once created */
+    if (nodes != 0 && shm->capacity != nodes) {
+        ipforest_shm_close(shm);
+        goto fail;
+    }
+    shm->fd = fd;
+
+    /* a writer died in the middle of an update, nodes are whole anyway */
+    if (shm->header->seq & 1) {
+        _write_end(shm);
+    }
+
+    return shm;
+
+fail:
+    close(fd);
+    return NULL;
+}
+
+ipforest_shm_t *
+ipforest_shm_attach(const char *name)
+{
+    int fd;
+    ipforest_shm_t *shm;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    /* the mapping stays valid without the descriptor */
+    shm = _map(fd, IPFOREST_FALSE);
+    close(fd);
+
+    return shm;
+}
+
+void
+ipforest_shm_close(ipforest_shm_t *shm)
+{
+    munmap(shm->header, shm->size);
+    if (shm->fd >= 0) {
+        /* drops the writer lock */
+        close(shm->fd);
+    }
+    free(shm);
+}
+
+IPFOREST_BOOLEAN
+ipforest_shm_unlink(const char *name)
+{
+    return shm_unlink(name) == 0;
+}
+
+IPFOREST_BOOLEAN
+ipforest_shm_insert(ipforest_shm_t *shm, const ipforest_ipaddr_t *prefixes, size_t count)
+{
+    size_t i;
+    IPFOREST_BOOLEAN ret;
+
+    if (!shm->writable) {
+        return IPFOREST_FALSE;
+    }
+
+    ret = IPFOREST_TRUE;
+
+    _write_begin(shm);
+    for (i = 0; i < count && ret; i++) {
+        ret = _insert(shm, prefixes[i].addr & prefixes[i].mask, prefixes[i].mask);
+    }
+    _write_end(shm);
+
+    return ret;
+}
+
+IPFOREST_BOOLEAN
+ipforest_shm_clear(ipforest_shm_t *shm)
+{
+    ipforest_shm_header_t *header;
+
+    if (!shm->writable) {
+        return IPFOREST_FALSE;
+    }
+
+    header = shm->header;
+
+    _write_begin(shm);
+    _store(&shm->nodes[IPFOREST_SHM_ROOT].l, 0);
+    _store(&shm->nodes[IPFOREST_SHM_ROOT].r, 0);
+    header->top = IPFOREST_SHM_ROOT + 1;
+    header->free = 0;
+    _store(&header->used, 1);
+    _write_end(shm);
+
+    return IPFOREST_TRUE;
+}
+
+IPFOREST_BOOLEAN
+ipforest_shm_lookup(const ipforest_shm_t *shm, uint32_t addr)
+{
+    int tries;
+    uint32_t seq;
+    IPFOREST_BOOLEAN found;
+
+    found = IPFOREST_FALSE;
+
+    for (tries = 0; tries < IPFOREST_SHM_RETRIES; tries++) {
+        if (tries >= IPFOREST_SHM_SPINS) {
+            sched_yield();
+        }
+
+        seq = __atomic_load_n(&shm->header->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+
+        found = _walk(shm, addr);
+
+        /* the walk is done before seq is read again */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (_load(&shm->header->seq) == seq) {
+            return found;
+        }
+    }
+
+    /* the writer is stuck, a walk is still safe */
+    return _walk(shm, addr);
+}
+
+uint32_t
+ipforest_shm_used(const ipforest_shm_t *shm)
+{
+    return _load(&shm->header->used);
+}
@@ -0,0 +1,65 @@
+#ifndef IPFOREST_SHM
+#define IPFOREST_SHM
+
+#include <stddef.h>
+#include "ipforest_types.h"
+
+/*
+ * radix tree living in a named POSIX shared memory segment, one copy for
+ * every process on the host.
+ *
+ * nodes are indices into an arena inside the segment, so the mapping may
+ * sit at any address. one writer process at a time holds an flock on the
+ * segment for as long as it has it open. readers take no lock: a sequence
+ * counter is odd while the writer changes nodes and a lookup that saw it
+ * move is done again. freed nodes are reused at once, a reader walking one
+ * reads garbage within the arena and retries.
+ */
+
+typedef struct ipforest_shm_header_s {
+    uint32_t magic;
+    uint32_t version;          /* layout */
+    uint32_t capacity;         /* nodes in the arena, index 0 unused */
+    uint32_t seq;              /* odd while the writer changes nodes */
+    uint32_t top;              /* first node never handed out */
+    uint32_t free;             /* released nodes chained through l */
+    uint32_t used;
+    uint32_t pad;
+} ipforest_shm_header_t;
+
+/* both 0 for an empty node, l is IPFOREST_SHM_LEAF for a leaf */
+typedef struct ipforest_shm_node_s {
+    uint32_t l;
+    uint32_t r;
+} ipforest_shm_node_t;
+
+typedef struct ipforest_shm_s {
+    ipforest_shm_header_t *header;
+    ipforest_shm_node_t *nodes;
+    uint32_t capacity;         /* as mapped, never read again from the segment */
+    size_t size;
+    int fd;                    /* writer only, holds the lock */
+    IPFOREST_BOOLEAN writable;
+} ipforest_shm_t;
+
+/*
+ * create name with room for nodes if missing, 1M nodes if 0. NULL if another
+ * writer has it or if it exists with room for other than nodes, 0 takes it
+ * as it is. one left without magic by a creator that died is set up again
+ */
+ipforest_shm_t * ipforest_shm_create(const char *name, uint32_t nodes);
+ipforest_shm_t * ipforest_shm_attach(const char *name);
+void ipforest_shm_close(ipforest_shm_t *shm);
+IPFOREST_BOOLEAN ipforest_shm_unlink(const char *name);
+
+/*
+ * all prefixes become visible to readers at once, writer only. if the arena
+ * fills up the prefixes before the one that did not fit stay in, the nodes
+ * made for that one are released
+ */
+IPFOREST_BOOLEAN ipforest_shm_insert(ipforest_shm_t *shm, const ipforest_ipaddr_t *prefixes, size_t count);
+IPFOREST_BOOLEAN ipforest_shm_clear(ipforest_shm_t *shm);
+IPFOREST_BOOLEAN ipforest_shm_lookup(const ipforest_shm_t *shm, uint32_t addr);
+uint32_t ipforest_shm_used(const ipforest_shm_t *shm);
+
+#endif
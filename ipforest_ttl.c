@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ipforest_types.h"
+#include "ipforest_parser.h"
+#include "ipforest_hash.h"
+#include "ipforest_ttl.h"
+
+ipforest_ttl_t *
+ipforest_ttl_alloc()
+{
+    ipforest_ttl_t *ttl;
+
+    ttl = malloc(sizeof(ipforest_ttl_t));
+    if (!ttl) {
+        return NULL;
+    }
+
+    ttl->hash = ipforest_hash_alloc(0);
+    if (!ttl->hash) {
+        free(ttl);
+        return NULL;
+    }
+    ttl->cursor = 0;
+
+    return ttl;
+}
+
+void
+ipforest_ttl_free(ipforest_ttl_t *ttl)
+{
+    ipforest_hash_free(ttl->hash);
+    free(ttl);
+}
+
+/*
+ * add prefix or push its expiry further, a shorter ttl never shortens an
+ * entry already there
+ */
+IPFOREST_BOOLEAN
+ipforest_ttl_insert(ipforest_ttl_t *ttl, uint32_t addr, uint32_t mask, uint64_t expire)
+{
+    int plen;
+    uint64_t *value;
+    IPFOREST_BOOLEAN created;
+
+    plen = IPFOREST_MASK_PLEN(mask);
+
+    value = ipforest_hash_insert(ttl->hash, addr & IPFOREST_PLEN_MASK(plen), plen, &created);
+    if (!value) {
+        return IPFOREST_FALSE;
+    }
+
+    if (created || *value < expire) {
+        *value = expire;
+    }
+
+    return IPFOREST_TRUE;
+}
+
+IPFOREST_BOOLEAN
+ipforest_ttl_insert_line(ipforest_ttl_t *ttl, const char *line, uint64_t expire)
+{
+    int i, count;
+    ipforest_ipaddr_t *paddr;
+
+    count = ipforest_parse_ip_line(line, NULL);
+    if (count <= 0) {
+        return IPFOREST_FALSE;
+    }
+
+    paddr = malloc(count * sizeof(ipforest_ipaddr_t));
+    if (!paddr) {
+        return IPFOREST_FALSE;
+    }
+
+    ipforest_parse_ip_line(line, paddr);
+
+    for (i = 0; i < count; i++) {
+        if (!ipforest_ttl_insert(ttl, paddr[i].addr, paddr[i].mask, expire)) {
+            free(paddr);
+            return IPFOREST_FALSE;
+        }
+    }
+
+    free(paddr);
+    return IPFOREST_TRUE;
+}
+
+/*
+ * one probe per prefix length in use, mostly just /32 for banned hosts
+ */
+IPFOREST_BOOLEAN
+ipforest_ttl_lookup(ipforest_ttl_t *ttl, uint32_t addr, uint64_t now)
+{
+    int plen;
+    uint64_t *value;
+    ipforest_hash_t *hash;
+
+    hash = ttl->hash;
+
+    if (hash->count == 0) {
+        return IPFOREST_FALSE;
+    }
+
+    for (plen = 32; plen >= 0; plen--) {
+        if (hash->lengths[plen] == 0) {
+            continue;
+        }
+
+        value = ipforest_hash_find(hash, addr & IPFOREST_PLEN_MASK(plen), plen);
+        if (!value) {
+            continue;
+        }
+
+        if (*value > now) {
+            return IPFOREST_TRUE;
+        }
+
+        /* expired, drop it on the way */
+        ipforest_hash_remove_slot(hash, CONTAINER_OF(value, value, ipforest_hash_entry_t) - hash->slots);
+    }
+
+    return IPFOREST_FALSE;
+}
+
+/*
+ * visit at most budget slots from where the last call stopped, remove what
+ * has expired, return the number removed
+ */
+uint32_t
+ipforest_ttl_expire(ipforest_ttl_t *ttl, uint64_t now, uint32_t budget)
+{
+    uint32_t removed;
+    ipforest_hash_t *hash;
+    ipforest_hash_entry_t *slot;
+
+    hash = ttl->hash;
+    removed = 0;
+
+    while (budget > 0 && hash->count > 0) {
+        ttl->cursor &= hash->mask;
+        slot = &hash->slots[ttl->cursor];
+
+        if (slot->key != IPFOREST_HASH_EMPTY && slot->value <= now) {
+            /* the slot is refilled by a shifted entry, visit it again */
+            ipforest_hash_remove_slot(hash, ttl->cursor);
+            removed++;
+        } else {
+            ttl->cursor++;
+        }
+
+        budget--;
+    }
+
+    return removed;
+}
@@ -0,0 +1,27 @@
+#ifndef IPFOREST_TTL
+#define IPFOREST_TTL
+
+#include "ipforest_types.h"
+#include "ipforest_hash.h"
+
+/*
+ * prefixes which expire, kept aside from the radix tree which aggregates
+ * and so can not tell one entry from another. expired entries are misses,
+ * they are dropped when met by a lookup or by the incremental sweeper.
+ *
+ * times are opaque monotonic ticks chosen by the caller.
+ */
+
+typedef struct ipforest_ttl_s {
+    ipforest_hash_t *hash;   /* prefix -> expiry */
+    uint32_t cursor;         /* next slot the sweeper visits */
+} ipforest_ttl_t;
+
+ipforest_ttl_t * ipforest_ttl_alloc();
+void ipforest_ttl_free(ipforest_ttl_t *ttl);
+IPFOREST_BOOLEAN ipforest_ttl_insert(ipforest_ttl_t *ttl, uint32_t addr, uint32_t mask, uint64_t expire);
+IPFOREST_BOOLEAN ipforest_ttl_insert_line(ipforest_ttl_t *ttl, const char *line, uint64_t expire);
+IPFOREST_BOOLEAN ipforest_ttl_lookup(ipforest_ttl_t *ttl, uint32_t addr, uint64_t now);
+uint32_t ipforest_ttl_expire(ipforest_ttl_t *ttl, uint64_t now, uint32_t budget);
+
+#endif
@@ -0,0 +1,296 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include "ipforest_types.h"
+#include "ipforest.h"
+#include "ipforest_watch.h"
+
+/* a list is complete once closed by its writer or renamed into place */
+#define IPFOREST_WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO)
+
+/* getpid() kept up to date across fork, a syscall is too much for a lookup */
+static pid_t _pid;
+static pthread_once_t _pid_once = PTHREAD_ONCE_INIT;
+
+static void
+_forked(void)
+{
+    _pid = getpid();
+}
+
+static void
+_pid_init(void)
+{
+    _pid = getpid();
+    pthread_atfork(NULL, NULL, _forked);
+}
+
+/*
+ * build a forest from the file as it is now, a file that does not load
+ * leaves what was there before
+ */
+static void
+_rebuild(ipforest_watch_t *watch)
+{
+    ipforest_t *forest, *old;
+
+    forest = ipforest_create();
+    if (!forest) {
+        return;
+    }
+
+    if (!ipforest_compile(forest, watch->engine) || !ipforest_load(forest, watch->fname)) {
+        ipforest_free(forest);
+        return;
+    }
+
+    /* one not taken yet is outdated now */
+    old = __atomic_exchange_n(&watch->pending, forest, __ATOMIC_ACQ_REL);
+    if (old) {
+        ipforest_free(old);
+    }
+}
+
+/*
+ * tell if a batch of events read from inotify concerns the file
+ */
+inline static IPFOREST_BOOLEAN
+_changed(ipforest_watch_t *watch, const char *buf, ssize_t len)
+{
+    const char *p;
+    const struct inotify_event *event;
+    IPFOREST_BOOLEAN changed;
+
+    changed = IPFOREST_FALSE;
+
+    for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len) {
+        event = (const struct inotify_event *)p;
+
+        /* events were lost, the file may have been among them */
+        if (event->mask & IN_Q_OVERFLOW) {
+            changed = IPFOREST_TRUE;
+        } else if (event->len && strcmp(event->name, watch->base) == 0) {
+            changed = IPFOREST_TRUE;
+        }
+    }
+
+    return changed;
+}
+
+static void *
+_watch_run(void *arg)
+{
+    ipforest_watch_t *watch;
+    struct pollfd fds[2];
+    ssize_t len;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    watch = arg;
+
+    fds[0].fd = watch->inotify;
+    fds[0].events = POLLIN;
+    fds[1].fd = watch->stop[0];
+    fds[1].events = POLLIN;
+
+    for ( ;; ) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (fds[1].revents) {
+            break;
+        }
+
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        len = read(watch->inotify, buf, sizeof(buf));
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (_changed(watch, buf, len)) {
+            _rebuild(watch);
+        }
+    }
+
+    return NULL;
+}
+
+inline static void
+_close_fds(ipforest_watch_t *watch)
+{
+    if (watch->stop[0] >= 0) {
+        close(watch->stop[0]);
+        close(watch->stop[1]);
+        watch->stop[0] = -1;
+        watch->stop[1] = -1;
+    }
+    if (watch->inotify >= 0) {
+        close(watch->inotify);
+        watch->inotify = -1;
+    }
+}
+
+/*
+ * open the descriptors and run the thread in the current process
+ */
+static IPFOREST_BOOLEAN
+_start(ipforest_watch_t *watch)
+{
+    watch->inotify = inotify_init1(IN_CLOEXEC);
+    if (watch->inotify < 0) {
+        goto fail;
+    }
+
+    if (inotify_add_watch(watch->inotify, watch->dir, IPFOREST_WATCH_EVENTS | IN_ONLYDIR) < 0) {
+        goto fail;
+    }
+
+    if (pipe(watch->stop) != 0) {
+        watch->stop[0] = -1;
+        watch->stop[1] = -1;
+        goto fail;
+    }
+    fcntl(watch->stop[0], F_SETFD, FD_CLOEXEC);
+    fcntl(watch->stop[1], F_SETFD, FD_CLOEXEC);
+
+    if (pthread_create(&watch->thread, NULL, _watch_run, watch) != 0) {
+        goto fail;
+    }
+
+    watch->pid = _pid;
+    watch->running = IPFOREST_TRUE;
+    return IPFOREST_TRUE;
+
+fail:
+    _close_fds(watch);
+    return IPFOREST_FALSE;
+}
+
+/*
+ * after fork the thread stayed in the parent, which shares the inotify
+ * instance and the pipe with us. start over on descriptors of our own, a
+ * change made meanwhile is seen on the next one. tried once per fork
+ */
+static void
+_restart(ipforest_watch_t *watch)
+{
+    _close_fds(watch);
+    watch->running = IPFOREST_FALSE;
+    watch->pid = _pid;
+
+    _start(watch);
+}
+
+ipforest_watch_t *
+ipforest_watch_alloc(const char *fname, const char *engine)
+{
+    char *slash;
+    ipforest_watch_t *watch;
+
+    pthread_once(&_pid_once, _pid_init);
+
+    watch = malloc(sizeof(ipforest_watch_t));
+    if (!watch) {
+        return NULL;
+    }
+    memset(watch, 0, sizeof(ipforest_watch_t));
+    watch->inotify = -1;
+    watch->stop[0] = -1;
+    watch->stop[1] = -1;
+
+    watch->fname = strdup(fname);
+    watch->engine = engine ? strdup(engine) : NULL;
+    if (!watch->fname || (engine && !watch->engine)) {
+        goto fail;
+    }
+
+    /* the directory is watched, a rename puts another inode in place */
+    slash = strrchr(watch->fname, '/');
+    if (!slash) {
+        watch->dir = strdup(".");
+        watch->base = watch->fname;
+    } else if (slash == watch->fname) {
+        watch->dir = strdup("/");
+        watch->base = slash + 1;
+    } else {
+        watch->dir = strndup(watch->fname, slash - watch->fname);
+        watch->base = slash + 1;
+    }
+    if (!watch->dir || watch->base[0] == '\0') {
+        goto fail;
+    }
+
+    if (!_start(watch)) {
+        goto fail;
+    }
+
+    return watch;
+
+fail:
+    free(watch->dir);
+    free(watch->engine);
+    free(watch->fname);
+    free(watch);
+    return NULL;
+}
+
+void
+ipforest_watch_free(ipforest_watch_t *watch)
+{
+    ssize_t ret;
+
+    /* a rebuild under way is finished first. in a forked child there is no
+     * thread to stop, the descriptors are copies the parent keeps using */
+    if (watch->running && watch->pid == _pid) {
+        do {
+            ret = write(watch->stop[1], "", 1);
+        } while (ret < 0 && errno == EINTR);
+        pthread_join(watch->thread, NULL);
+    }
+
+    _close_fds(watch);
+
+    if (watch->pending) {
+        ipforest_free(watch->pending);
+    }
+
+    free(watch->dir);
+    free(watch->engine);
+    free(watch->fname);
+    free(watch);
+}
+
+ipforest_t *
+ipforest_watch_take(ipforest_watch_t *watch)
+{
+    if (watch->pid != _pid) {
+        _restart(watch);
+    }
+
+    /* the common case, nothing new */
+    if (!__atomic_load_n(&watch->pending, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    return __atomic_exchange_n(&watch->pending, NULL, __ATOMIC_ACQUIRE);
+}
+
+IPFOREST_BOOLEAN
+ipforest_watch_running(ipforest_watch_t *watch)
+{
+    return watch->running && watch->pid == _pid;
+}
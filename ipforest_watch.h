@@ -0,0 +1,39 @@
+#ifndef IPFOREST_WATCH
+#define IPFOREST_WATCH
+
+#include <pthread.h>
+#include <sys/types.h>
+#include "ipforest_types.h"
+#include "ipforest.h"
+
+/*
+ * rebuilds a forest from a list file in a thread of its own whenever the
+ * file is closed after writing or renamed into place, watched through
+ * inotify on its directory. the new forest waits in pending until the
+ * owner takes it, checking for it costs a single load. the thread does not
+ * survive fork(), the child starts one of its own on the first take.
+ */
+
+typedef struct ipforest_watch_s {
+    char *fname;
+    char *engine;                  /* NULL for the radix tree */
+    char *dir;
+    const char *base;              /* name of fname in dir */
+    int inotify;
+    int stop[2];                   /* pipe, written to end the thread */
+    pthread_t thread;
+    pid_t pid;                     /* process the thread was started in */
+    IPFOREST_BOOLEAN running;      /* false once it could not be restarted */
+    ipforest_t *pending;           /* built and not taken yet */
+} ipforest_watch_t;
+
+ipforest_watch_t * ipforest_watch_alloc(const char *fname, const char *engine);
+void ipforest_watch_free(ipforest_watch_t *watch);
+
+/* the latest forest built if any since last called, NULL otherwise */
+ipforest_t * ipforest_watch_take(ipforest_watch_t *watch);
+
+/* tell if a thread still watches, false after a fork it failed to survive */
+IPFOREST_BOOLEAN ipforest_watch_running(ipforest_watch_t *watch);
+
+#endif
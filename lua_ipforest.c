@@ -26,6 +26,36 @@
  * - ip radix tree is presented by lightuserdata in lua.
  * - trees are put into a forest table.
  * - only support load_tree from file and match_tree
+ * - trees can be published to a process wide store and attached from any
+ *   lua_State, attached trees are frozen and shared without copying
+ * - a private tree may be compiled into a read only lookup engine, the
+ *   radix tree is kept for appends which drop the compiled engine until
+ *   compile_tree is called again
+ * - a matcher generated by ipforest-compile can be loaded from a shared
+ *   object, such a tree has no radix tree behind and is read only
+ * - a frozen tree keeps only a DAG whose identical subtrees are stored once
+ *   for the whole process, it is read only as well
+ * - a MaxMind DB file can be mapped and served in place, addresses with
+ *   data match and value_tree decodes their data, such a tree is read only
+ * - a tree may live in a POSIX shared memory segment, one process appends
+ *   to it and every process attached sees the entries at once, attached
+ *   ones are read only
+ * - trees, engines and compiled matchers live in libipforest (ipforest.h),
+ *   this module binds them to names and adds what only lua needs: sharing
+ *   between lua_States, entries with ttl, hit counters and telemetry
+ * - a watched tree is rebuilt in a thread when its file is rewritten or
+ *   renamed into place, the new one is swapped in by the next match or
+ *   poll_trees, so nothing is checked on the filesystem per lookup
+ * - entries appended with a ttl live aside of the tree in a hash of
+ *   prefixes, expired ones are misses and are swept by expire_tree
+ * - in counting mode lookups go through the radix tree and count hits per
+ *   terminating leaf prefix, counters are per lua_State so need no atomics
+ * - instrumented trees count calls, hits, misses, radix depths and time a
+ *   sample of lookups, metrics_tree reports them for every tree
+ * - (src, dst) rules sit beside a tree too, match2_tree answers from a
+ *   trie of src prefixes whose nodes hold radix trees of dst prefixes
+ * - heavy hitter counters sit beside a tree and are fed by count_addr, not
+ *   by lookups, they keep a bounded number of prefixes per length
  * - ip file can be of the following format
  *   - 192.168.0.10-30
  *   - 192.168.0.10-192.168.1.300
@@ -43,11 +73,24 @@
 #include <arpa/inet.h>
 #include <math.h>
 #include <limits.h>
+#include <time.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include "ipforest_types.h"
 #include "ipforest_parser.h"
 #include "ipforest_radix_tree.h"
+#include "ipforest_loader.h"
+#include "ipforest_shared.h"
+#include "ipforest_hash.h"
+#include "ipforest_ttl.h"
+#include "ipforest_metrics.h"
+#include "ipforest_hhh.h"
+#include "ipforest_watch.h"
+#include "ipforest_2d.h"
+#include "ipforest_dag.h"
+#include "ipforest_mmdb.h"
+#include "ipforest.h"
+#include "ipforest_engine.h"
 
 
 #ifndef IPFOREST_MODNAME
@@ -65,6 +108,32 @@ static const char IPFOREST = 'K';
 #define IPFOREST_IDX ((void *)&IPFOREST)
 #endif
 
+/*
+ * what the light user data in forest table points to, a tree is either
+ * private to the lua_State or attached to the process wide shared store
+ */
+typedef struct ipforest_handle_s {
+    ipforest_t *forest;            /* private tree, NULL if attached */
+    ipforest_shared_ref_t *ref;    /* shared tree, NULL if private */
+    ipforest_ttl_t *ttl;           /* entries with ttl, NULL if none yet */
+    ipforest_hash_t *hits;         /* prefix -> hits, NULL if not counting */
+    ipforest_metrics_t *metrics;   /* NULL if not instrumented */
+    ipforest_hhh_t *hhh;           /* heavy hitters, NULL if none */
+    ipforest_watch_t *watch;       /* rebuilds forest on change, NULL if none */
+    ipforest_2d_t *rules;          /* (src, dst) rules, NULL if none */
+    ipforest_radix_tree_t *exact;  /* as listed, once compact_lossy widened it */
+} ipforest_handle_t;
+
+/* monotonic milliseconds, ttl ticks */
+inline static uint64_t
+_now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 inline static int
 _get_forest_table(lua_State *l)
 {
@@ -98,10 +167,37 @@ _find_tree(lua_State *l, const char *tname)
 inline static int
 _free_tree(lua_State *l, const char *tname)
 {
-    ipforest_radix_tree_t *tree;
+    ipforest_handle_t *handle;
     /* deal with light user data */
-    tree = lua_touserdata(l, -1);
-    ipforest_radix_tree_free(tree);
+    handle = lua_touserdata(l, -1);
+    if (handle->forest) {
+        ipforest_free(handle->forest);
+    }
+    if (handle->ref) {
+        ipforest_shared_detach(handle->ref);
+    }
+    if (handle->ttl) {
+        ipforest_ttl_free(handle->ttl);
+    }
+    if (handle->hits) {
+        ipforest_hash_free(handle->hits);
+    }
+    if (handle->metrics) {
+        ipforest_metrics_free(handle->metrics);
+    }
+    if (handle->hhh) {
+        ipforest_hhh_free(handle->hhh);
+    }
+    if (handle->watch) {
+        ipforest_watch_free(handle->watch);
+    }
+    if (handle->rules) {
+        ipforest_2d_free(handle->rules);
+    }
+    if (handle->exact) {
+        ipforest_radix_tree_free(handle->exact);
+    }
+    free(handle);
 
     /* pop light user data */
     lua_pop(l, 1);
@@ -123,10 +219,13 @@ _free_tree(lua_State *l, const char *tname)
 inline static int
 _compact_tree(lua_State *l, const char *tname)
 {
-    ipforest_radix_tree_t *tree;
+    ipforest_handle_t *handle;
     /* deal with light user data */
-    tree = lua_touserdata(l, -1);
-    ipforest_radix_tree_compact(tree);
+    handle = lua_touserdata(l, -1);
+    /* shared trees are frozen and already compact */
+    if (handle->forest) {
+        ipforest_compact(handle->forest);
+    }
 
     /* pop light user data */
     lua_pop(l, 1);
@@ -150,163 +249,310 @@ log_2(size_t num)
     return i - 1;
 }
 
+/*
+ * wrap a private forest or a shared reference into a handle and push its
+ * light user data onto stack, ownership of forest or ref is taken if created
+ */
 inline static IPFOREST_BOOLEAN
-_append_tree(ipforest_radix_tree_t *tree, const char *buf)
+_push_handle(lua_State *l, ipforest_t *forest, ipforest_shared_ref_t *ref)
 {
-    int i, count;
-    ipforest_ipaddr_t *paddr;
+    ipforest_handle_t *handle;
 
-    /* initial ipforest_ipaddr_t array size */
-    count = 0;
-    paddr = NULL;
+    handle = malloc(sizeof(ipforest_handle_t));
+    if (!handle) {
+        return IPFOREST_FALSE;
+    }
 
-    count = ipforest_parse_ip_line(buf, NULL);
-    if (count <= 0 ) {
-        goto fail;
+    handle->forest = forest;
+    handle->ref = ref;
+    handle->ttl = NULL;
+    handle->hits = NULL;
+    handle->metrics = NULL;
+    handle->hhh = NULL;
+    handle->watch = NULL;
+    handle->rules = NULL;
+    handle->exact = NULL;
+
+    lua_pushlightuserdata(l, handle);
+    return IPFOREST_TRUE;
+}
+
+/*
+ * radix tree behind a handle, NULL for trees loaded by load_compiled_tree
+ * or frozen
+ */
+inline static ipforest_radix_tree_t *
+_handle_tree(ipforest_handle_t *handle)
+{
+    if (handle->ref) {
+        return ipforest_shared_tree(handle->ref);
     }
+    return handle->forest->tree;
+}
 
-    paddr = malloc(count * sizeof(ipforest_ipaddr_t));
-    if (!paddr) {
-        goto fail;
+/*
+ * do a 32 bit mask lookup through compiled engine if any, then through
+ * entries with ttl. depth, if asked for, is left alone unless the lookup
+ * went through the radix tree
+ */
+inline static IPFOREST_BOOLEAN
+_lookup_core(ipforest_handle_t *handle, uint32_t addr, int *depth)
+{
+    int plen;
+    uint64_t *count;
+    IPFOREST_BOOLEAN hit, created;
+    ipforest_radix_tree_t *tree;
+
+    if (handle->hits && (tree = _handle_tree(handle)) != NULL) {
+        /* counting mode, need the leaf so go through the radix tree */
+        hit = ipforest_radix_tree_match(tree, addr, 0xffffffff, &plen);
+        if (hit) {
+            count = ipforest_hash_insert(handle->hits, addr & IPFOREST_PLEN_MASK(plen), plen, &created);
+            if (count) {
+                *count += 1;
+            }
+        }
+        if (depth) {
+            *depth = plen;
+        }
+    } else if (handle->forest && (!depth || handle->forest->compiled)) {
+        hit = ipforest_lookup(handle->forest, addr);
+    } else if (depth) {
+        hit = ipforest_radix_tree_match(_handle_tree(handle), addr, 0xffffffff, depth);
+    } else {
+        hit = ipforest_radix_tree_lookup(_handle_tree(handle), addr, 0xffffffff);
     }
 
-    ipforest_parse_ip_line(buf, paddr);
+    if (!hit && handle->ttl) {
+        hit = ipforest_ttl_lookup(handle->ttl, addr, _now_ms());
+    }
 
-    /* printf("count: %d\n", tmp); */
+    return hit;
+}
 
-    for (i = 0; i < count; i++) {
-        /* printf("0x%08x, 0x%08x\n", paddr[i].addr, paddr[i].mask); */
-        if (ipforest_radix_tree_insert(tree, paddr[i].addr, paddr[i].mask) < 0) {
-            goto fail;
-        }
+static IPFOREST_BOOLEAN
+_lookup_measured(ipforest_handle_t *handle, uint32_t addr)
+{
+    int depth;
+    uint64_t start;
+    IPFOREST_BOOLEAN hit, timed;
+    ipforest_metrics_t *metrics;
+
+    metrics = handle->metrics;
+    depth = -1;
+    start = 0;
+
+    timed = ipforest_metrics_sample(metrics);
+    if (timed) {
+        start = ipforest_metrics_now();
+    }
+
+    hit = _lookup_core(handle, addr, &depth);
+
+    if (timed) {
+        ipforest_metrics_latency(metrics, ipforest_metrics_now() - start);
+    }
+
+    ipforest_metrics_record(metrics, hit, depth);
+    return hit;
+}
+
+inline static void
+_drop_exact(ipforest_handle_t *handle)
+{
+    if (handle->exact) {
+        ipforest_radix_tree_free(handle->exact);
+        handle->exact = NULL;
+    }
+}
+
+/*
+ * swap in what the watcher built if anything, entries with ttl go as on
+ * any load and hits are counted from zero again
+ */
+inline static IPFOREST_BOOLEAN
+_publish(ipforest_handle_t *handle)
+{
+    ipforest_t *forest;
+
+    forest = ipforest_watch_take(handle->watch);
+    if (!forest) {
+        return IPFOREST_FALSE;
+    }
+
+    ipforest_free(handle->forest);
+    handle->forest = forest;
+    _drop_exact(handle);
+
+    if (handle->ttl) {
+        ipforest_ttl_free(handle->ttl);
+        handle->ttl = NULL;
+    }
+    if (handle->hits) {
+        ipforest_hash_clear(handle->hits);
     }
 
-    free(paddr);
     return IPFOREST_TRUE;
-    
-fail:
-    /* safe to free NULL */
-    free(paddr);
-    return IPFOREST_FALSE;
+}
+
+/*
+ * every lookup on a tree goes through here
+ */
+inline static IPFOREST_BOOLEAN
+_lookup_handle(ipforest_handle_t *handle, uint32_t addr)
+{
+    if (handle->watch) {
+        _publish(handle);
+    }
+
+    if (handle->metrics) {
+        return _lookup_measured(handle, addr);
+    }
+    return _lookup_core(handle, addr, NULL);
 }
 
 /* push light user data associated with the tree onto stack if created */
 inline static IPFOREST_BOOLEAN
 _create_tree(lua_State *l)
 {
-   ipforest_radix_tree_t *tree;
+    ipforest_t *forest;
     /* create a tree */
-    tree = ipforest_radix_tree_alloc();
-    if (!tree) {
+    forest = ipforest_create();
+    if (!forest) {
+        goto fail;
+    }
+
+    if (!_push_handle(l, forest, NULL)) {
+        ipforest_free(forest);
         goto fail;
     }
 
-    lua_pushlightuserdata(l, tree);
     return IPFOREST_TRUE;
 
 fail:
     return IPFOREST_FALSE;
 }
 
-/* push light user data associated with the tree onto stack if load */
+/*
+ * put a freshly built forest into forest table under tname, replacing the
+ * old one. ownership of forest is taken in any case
+ */
 inline static IPFOREST_BOOLEAN
-_load_tree(lua_State *l, const char *fname)
+_install_tree(lua_State *l, const char *tname, ipforest_t *forest)
 {
-    size_t len;
-    char buf[LINE_MAX];
-    FILE *stream;
-    ipforest_radix_tree_t *tree;
-
-    stream = fopen(fname, "r");
-    if (!stream) {
-        goto open_error;
+    if (_find_tree(l, tname)) {
+        _free_tree(l, tname);
     }
 
-    if (!_create_tree(l)) {
-        goto before_parse_error;
+    /* push forest table onto stack */
+    _get_forest_table(l);
+
+    /* push new created tree onto stack */
+    if (!_push_handle(l, forest, NULL)) {
+        ipforest_free(forest);
+        goto fail;
     }
 
-    tree = lua_touserdata(l, -1);
+    lua_setfield(l, -2, tname);
+    /* pop forest table from stack */
     lua_pop(l, 1);
+    return IPFOREST_TRUE;
 
-    while (fgets(buf, LINE_MAX, stream)) {
-        len = strlen(buf);
-        if (!feof(stream)) {
-            if (buf[len - 1] != '\n') {
-                goto parse_error;
-            }
-        }
-     
-        /* maybe eof and a last '\n' */
-        if (buf[len - 1] == '\n') {
-            if (len > 1 && buf[len - 2] == '\r') {
-                buf[len - 2] = '\0';
-            } else {
-                buf[len - 1] = '\0';
-            }
-        }
+fail:
+    /* pop forest table from stack */
+    lua_pop(l, 1);
+    return IPFOREST_FALSE;
+}
 
-        /* ignore empty line and comments */
-        if (buf[0] == '#' || buf[0] == '\0') {
-            continue;
-        }
+/*
+ * tell if the private tree behind handle is what loading fname with engine
+ * ename would build again
+ */
+inline static IPFOREST_BOOLEAN
+_load_unchanged(ipforest_handle_t *handle, const char *fname, const char *ename)
+{
+    const ipforest_engine_t *engine;
 
-        if (!_append_tree(tree, buf)) {
-            goto parse_error;
-        }
+    if (!handle->forest) {
+        return IPFOREST_FALSE;
     }
 
-    /* compact tree to delete free node */
-    ipforest_radix_tree_compact(tree);
-
-    /* close file */
-    fclose(stream);
-
-    lua_pushlightuserdata(l, tree);
-    return IPFOREST_TRUE;
-
- parse_error:
-    ipforest_radix_tree_free(tree);
-
- before_parse_error:
-    fclose(stream);
+    if (ename && strcmp(ename, "auto") == 0) {
+        if (!handle->forest->automatic) {
+            return IPFOREST_FALSE;
+        }
+    } else if (!ipforest_find_engine(ename, &engine) || engine != handle->forest->engine
+               || handle->forest->automatic) {
+        return IPFOREST_FALSE;
+    }
 
- open_error:
-    return IPFOREST_FALSE;
+    return ipforest_unchanged(handle->forest, fname);
 }
 
+/*
+ * load(tname, fname [, engine [, cached]]), yield true and whether the tree
+ * was rebuilt. cached keeps tname as it is if it was loaded from fname
+ * with the same engine and neither changed since
+ */
 static int
 load_tree(lua_State *l)
 {
-    const char *tname, *fname;
+    const char *tname, *fname, *ename;
     size_t tname_len, fname_len;
+    ipforest_t *forest;
+    ipforest_handle_t *handle;
 
     tname = luaL_checklstring(l, 1, &tname_len);
     fname = luaL_checklstring(l, 2, &fname_len);
+    ename = luaL_optstring(l, 3, NULL);
 
     if (tname_len <= 0 || fname_len <= 0) {
         goto fail;
     }
 
+    if (lua_toboolean(l, 4) && _find_tree(l, tname)) {
+        handle = lua_touserdata(l, -1);
+        lua_pop(l, 1);
+
+        if (_load_unchanged(handle, fname, ename)) {
+            /* entries with ttl go as on any load */
+            if (handle->ttl) {
+                ipforest_ttl_free(handle->ttl);
+                handle->ttl = NULL;
+            }
+            lua_pushboolean(l, IPFOREST_TRUE);
+            lua_pushboolean(l, IPFOREST_FALSE);
+            return 2;
+        }
+    }
+
+    forest = ipforest_create();
+    if (!forest) {
+        goto fail;
+    }
+
+    /* select engine on the empty tree, it is built once loaded */
+    if (!ipforest_compile(forest, ename)) {
+        ipforest_free(forest);
+        goto fail;
+    }
+
     if (_find_tree(l, tname)) {
         _free_tree(l, tname);
     }
 
-    /* push forest table onto stack */
-    _get_forest_table(l);
-    /* push new created tree onto stack */
-    if (_load_tree(l, fname)) {
-        lua_setfield(l, -2, tname);
-        /* pop forest table from stack */
-        lua_pop(l, 1);
-    } else {
-        /* pop forest table from stack */
-        lua_pop(l, 1);
+    if (!ipforest_load(forest, fname)) {
+        ipforest_free(forest);
         goto fail;
     }
-    
+
+    if (!_install_tree(l, tname, forest)) {
+        goto fail;
+    }
+
     lua_pushboolean(l, IPFOREST_TRUE);
-    return 1;
+    lua_pushboolean(l, IPFOREST_TRUE);
+    return 2;
 
 fail:
     /* we don't use error for it is difficult to be tested using lunit */
@@ -317,168 +563,2490 @@ fail:
     return 1;
 }
 
+/*
+ * watch(tname, fname [, engine]), load tname as load_tree does and rebuild
+ * it in the background whenever fname is rewritten or renamed into place.
+ * the new tree replaces the old one on the next match or poll
+ */
 static int
-reset_tree(lua_State *l)
+watch_tree(lua_State *l)
 {
-    const char *tname;
-    size_t tname_len;
+    const char *tname, *fname, *ename;
+    size_t tname_len, fname_len;
+    ipforest_t *forest;
+    ipforest_watch_t *watch;
+    ipforest_handle_t *handle;
 
     tname = luaL_checklstring(l, 1, &tname_len);
+    fname = luaL_checklstring(l, 2, &fname_len);
+    ename = luaL_optstring(l, 3, NULL);
 
-    if (tname_len <= 0) {
+    if (tname_len <= 0 || fname_len <= 0) {
         goto fail;
     }
 
-    if (_find_tree(l, tname)) {
-        _free_tree(l, tname);
+    forest = ipforest_create();
+    if (!forest) {
+        goto fail;
     }
 
-    /* push forest table onto stack */
-    _get_forest_table(l);
-    /* push new created tree onto stack */
-    if (_create_tree(l)) {
-        lua_setfield(l, -2, tname);
-        /* pop forest table from stack */
-        lua_pop(l, 1);
-    } else {
-        /* pop forest table from stack */
-        lua_pop(l, 1);
+    if (!ipforest_compile(forest, ename)) {
+        ipforest_free(forest);
         goto fail;
     }
-    
+
+    /* watch first, a change while loading is not missed */
+    watch = ipforest_watch_alloc(fname, ename);
+    if (!watch) {
+        ipforest_free(forest);
+        goto fail;
+    }
+
+    if (!ipforest_load(forest, fname)) {
+        ipforest_watch_free(watch);
+        ipforest_free(forest);
+        goto fail;
+    }
+
+    if (!_install_tree(l, tname, forest)) {
+        ipforest_watch_free(watch);
+        goto fail;
+    }
+
+    _find_tree(l, tname);
+    handle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+    handle->watch = watch;
+
     lua_pushboolean(l, IPFOREST_TRUE);
     return 1;
 
 fail:
-    /* we don't use error for it is difficult to be tested using lunit */
-    /* lua_pushstring(l, "create tree error"); */
-    /* lua_error(l); */
-
     lua_pushboolean(l, IPFOREST_FALSE);
     return 1;
 }
 
+/*
+ * publish every tree rebuilt by a watch, yield how many were, or false and
+ * a message for a watch whose thread could not be restarted after fork
+ */
 static int
-append_tree(lua_State *l)
+poll_trees(lua_State *l)
 {
-    const char *tname, *buf;
-    size_t tname_len, buf_len;
-    ipforest_radix_tree_t *tree;
-
-    tname = luaL_checklstring(l, 1, &tname_len);
-    buf = luaL_checklstring(l, 2, &buf_len);
+    lua_Integer published;
+    ipforest_handle_t *handle;
 
-    if (tname_len <= 0 || buf_len <= 0) {
-        goto fail;
-    }
+    published = 0;
 
-    if (!_find_tree(l, tname)) {
-        goto fail;
-    }
+    _get_forest_table(l);
 
-    tree = lua_touserdata(l, -1);
-    if (_append_tree(tree, buf)) {
+    lua_pushnil(l);
+    while (lua_next(l, -2)) {
+        handle = lua_touserdata(l, -1);
         lua_pop(l, 1);
-        lua_pushboolean(l, IPFOREST_TRUE);
-        return 1;
+
+        if (!handle->watch) {
+            continue;
+        }
+
+        if (_publish(handle)) {
+            published++;
+        }
+
+        if (!ipforest_watch_running(handle->watch)) {
+            lua_pushboolean(l, IPFOREST_FALSE);
+            lua_pushfstring(l, "watch of %s stopped, no thread after fork", lua_tostring(l, -2));
+            return 2;
+        }
     }
 
+    /* pop forest table from stack */
     lua_pop(l, 1);
 
-fail: 
-    lua_pushboolean(l, IPFOREST_FALSE);
+    lua_pushinteger(l, published);
     return 1;
 }
 
+/*
+ * same as load_tree, from data in memory instead of a file
+ */
 static int
-has_tree(lua_State *l)
+load_string_tree(lua_State *l)
 {
-    const char *tname;
-    size_t tname_len;
+    const char *tname, *data, *ename;
+    size_t tname_len, data_len;
+    ipforest_t *forest;
+
     tname = luaL_checklstring(l, 1, &tname_len);
+    data = luaL_checklstring(l, 2, &data_len);
+    ename = luaL_optstring(l, 3, NULL);
 
-    if (_find_tree(l, tname)) {
-        /* pop light user data */
-        lua_pop(l, 1);
+    if (tname_len <= 0) {
+        goto fail;
+    }
 
-        lua_pushboolean(l, IPFOREST_TRUE);
-        return 1;
+    forest = ipforest_create();
+    if (!forest) {
+        goto fail;
+    }
+
+    if (!ipforest_compile(forest, ename) || !ipforest_load_string(forest, data, data_len)) {
+        ipforest_free(forest);
+        goto fail;
+    }
+
+    if (!_install_tree(l, tname, forest)) {
+        goto fail;
     }
 
+    lua_pushboolean(l, IPFOREST_TRUE);
+    return 1;
+
+fail:
     lua_pushboolean(l, IPFOREST_FALSE);
     return 1;
 }
 
-static int
-free_tree(lua_State *l)
+/*
+ * streaming builder, a full user data holding an ipforest_builder_t
+ */
+#define IPFOREST_BUILDER_MT "ipforest.builder"
+
+inline static ipforest_builder_t *
+_check_builder(lua_State *l)
 {
-    const char *tname;
-    size_t tname_len;
-    tname = luaL_checklstring(l, 1, &tname_len);
+    ipforest_builder_t **pbuilder;
 
-    if (_find_tree(l, tname)) {
-        _free_tree(l, tname);
+    pbuilder = luaL_checkudata(l, 1, IPFOREST_BUILDER_MT);
+    if (!*pbuilder) {
+        luaL_argerror(l, 1, "builder already collected");
+    }
+
+    return *pbuilder;
+}
+
+static int
+new_builder(lua_State *l)
+{
+    ipforest_builder_t **pbuilder;
+
+    pbuilder = lua_newuserdata(l, sizeof(ipforest_builder_t *));
+    *pbuilder = ipforest_builder_alloc();
+    if (!*pbuilder) {
+        lua_pop(l, 1);
+        lua_pushboolean(l, IPFOREST_FALSE);
+        return 1;
+    }
+
+    luaL_getmetatable(l, IPFOREST_BUILDER_MT);
+    lua_setmetatable(l, -2);
+
+    return 1;
+}
+
+/*
+ * b:feed(chunk), lines may be split anywhere across chunks. once a line
+ * fails to parse every feed yields false until commit
+ */
+static int
+builder_feed(lua_State *l)
+{
+    const char *data;
+    size_t data_len;
+    ipforest_builder_t *builder;
+
+    builder = _check_builder(l);
+    data = luaL_checklstring(l, 2, &data_len);
+
+    lua_pushboolean(l, ipforest_builder_feed(builder, data, data_len));
+    return 1;
+}
+
+/*
+ * b:commit(tname [, engine]), install what has been fed under tname, the
+ * builder starts over afterwards, even if failed
+ */
+static int
+builder_commit(lua_State *l)
+{
+    const char *tname, *ename;
+    size_t tname_len;
+    ipforest_t *forest;
+    ipforest_builder_t *builder;
+    ipforest_radix_tree_t *tree;
+
+    builder = _check_builder(l);
+    tname = luaL_checklstring(l, 2, &tname_len);
+    ename = luaL_optstring(l, 3, NULL);
+
+    tree = ipforest_builder_finish(builder);
+    if (!tree) {
+        goto fail;
+    }
+
+    forest = ipforest_wrap_tree(tree);
+    if (!forest) {
+        ipforest_radix_tree_free(tree);
+        goto fail;
+    }
+
+    if (tname_len <= 0 || !ipforest_compile(forest, ename)) {
+        ipforest_free(forest);
+        goto fail;
+    }
+
+    if (!_install_tree(l, tname, forest)) {
+        goto fail;
+    }
+
+    lua_pushboolean(l, IPFOREST_TRUE);
+    return 1;
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+static int
+builder_gc(lua_State *l)
+{
+    ipforest_builder_t **pbuilder;
+
+    pbuilder = luaL_checkudata(l, 1, IPFOREST_BUILDER_MT);
+    if (*pbuilder) {
+        ipforest_builder_free(*pbuilder);
+        *pbuilder = NULL;
+    }
+
+    return 0;
+}
+
+static int
+reset_tree(lua_State *l)
+{
+    const char *tname;
+    size_t tname_len;
+    ipforest_handle_t *handle;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+
+    if (tname_len <= 0) {
+        goto fail;
+    }
+
+    if (_find_tree(l, tname)) {
+        /* a shm writer empties the segment for every process instead */
+        handle = lua_touserdata(l, -1);
+        if (handle->forest && ipforest_clear_shm(handle->forest)) {
+            lua_pop(l, 1);
+            lua_pushboolean(l, IPFOREST_TRUE);
+            return 1;
+        }
+        _free_tree(l, tname);
+    }
+
+    /* push forest table onto stack */
+    _get_forest_table(l);
+    /* push new created tree onto stack */
+    if (_create_tree(l)) {
+        lua_setfield(l, -2, tname);
+        /* pop forest table from stack */
+        lua_pop(l, 1);
+    } else {
+        /* pop forest table from stack */
+        lua_pop(l, 1);
+        goto fail;
+    }
+    
+    lua_pushboolean(l, IPFOREST_TRUE);
+    return 1;
+
+fail:
+    /* we don't use error for it is difficult to be tested using lunit */
+    /* lua_pushstring(l, "create tree error"); */
+    /* lua_error(l); */
+
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+static int
+append_tree(lua_State *l)
+{
+    const char *tname, *buf;
+    size_t tname_len, buf_len;
+    lua_Number ttl;
+    ipforest_handle_t *handle;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+    buf = luaL_checklstring(l, 2, &buf_len);
+    ttl = luaL_optnumber(l, 3, 0);
+
+    if (tname_len <= 0 || buf_len <= 0) {
+        goto fail;
+    }
+
+    if (!_find_tree(l, tname)) {
+        goto fail;
+    }
+
+    handle = lua_touserdata(l, -1);
+
+    /* any kind of tree can take entries with ttl */
+    if (ttl > 0) {
+        if (!handle->ttl) {
+            handle->ttl = ipforest_ttl_alloc();
+        }
+        if (handle->ttl
+            && ipforest_ttl_insert_line(handle->ttl, buf, _now_ms() + (uint64_t)(ttl * 1000))) {
+            lua_pop(l, 1);
+            lua_pushboolean(l, IPFOREST_TRUE);
+            return 1;
+        }
+        lua_pop(l, 1);
+        goto fail;
+    }
+
+    /* shared trees are frozen, the compiled engine is dropped as stale */
+    if (handle->forest && ipforest_append(handle->forest, buf)) {
+        /* the line parsed, failing here is out of memory and loses the count */
+        if (handle->exact && !ipforest_load_line(handle->exact, buf)) {
+            _drop_exact(handle);
+        }
+        lua_pop(l, 1);
         lua_pushboolean(l, IPFOREST_TRUE);
         return 1;
     }
 
+    lua_pop(l, 1);
+
+fail: 
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+/*
+ * append an array of entries or a string of them one per line, parsed all
+ * before the tree is touched and merged into it in one sorted pass. in the
+ * string empty lines and comments are skipped as in a file
+ */
+static int
+append_many_tree(lua_State *l)
+{
+    const char *tname, *buf;
+    const char **lines;
+    char *data, *p, *eol, *next, *end;
+    size_t tname_len, buf_len, len, count, i;
+    ipforest_handle_t *handle;
+    int ret;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+
+    if (tname_len <= 0) {
+        goto fail;
+    }
+
+    if (!_find_tree(l, tname)) {
+        goto fail;
+    }
+
+    /* the forest table keeps the handle */
+    handle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    if (!handle->forest) {
+        goto fail;
+    }
+
+    data = NULL;
+    lines = NULL;
+    count = 0;
+    ret = IPFOREST_FALSE;
+
+    if (lua_type(l, 2) == LUA_TTABLE) {
+        buf_len = lua_objlen(l, 2);
+        lines = malloc((buf_len ? buf_len : 1) * sizeof(char *));
+        if (!lines) {
+            goto done;
+        }
+
+        for (i = 0; i < buf_len; i++) {
+            lua_rawgeti(l, 2, (int)i + 1);
+            if (lua_type(l, -1) != LUA_TSTRING) {
+                lua_pop(l, 1);
+                goto done;
+            }
+            /* the table keeps the string alive once popped */
+            buf = lua_tolstring(l, -1, &len);
+            lua_pop(l, 1);
+            if (strlen(buf) != len) {
+                goto done;
+            }
+            lines[count++] = buf;
+        }
+
+    } else if (lua_type(l, 2) == LUA_TSTRING) {
+        buf = lua_tolstring(l, 2, &buf_len);
+
+        /* lines are cut in place, one more line than '\n' at most */
+        data = malloc(buf_len + 1);
+        lines = malloc((buf_len / 2 + 1) * sizeof(char *));
+        if (!data || !lines) {
+            goto done;
+        }
+        memcpy(data, buf, buf_len);
+        data[buf_len] = '\0';
+
+        end = data + buf_len;
+        for (p = data; p < end; p = next) {
+            eol = memchr(p, '\n', end - p);
+            next = eol ? eol + 1 : end;
+            eol = eol ? eol : end;
+
+            if (eol > p && eol[-1] == '\r') {
+                eol--;
+            }
+            *eol = '\0';
+
+            /* ignore empty line and comments */
+            if (p[0] == '#' || p[0] == '\0') {
+                continue;
+            }
+
+            /* a nul inside the line would hide the rest of it */
+            if (strlen(p) != (size_t)(eol - p)) {
+                goto done;
+            }
+
+            lines[count++] = p;
+        }
+
+    } else {
+        goto done;
+    }
+
+    /* shared trees are frozen, the compiled engine is dropped as stale */
+    ret = ipforest_append_many(handle->forest, lines, count);
+    if (ret && handle->exact && !ipforest_load_lines(handle->exact, lines, count)) {
+        _drop_exact(handle);
+    }
+
+done:
+    free(lines);
+    free(data);
+    lua_pushboolean(l, ret);
+    return 1;
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+/*
+ * sweep expired entries, at most budget hash slots are visited per call.
+ * yield number of entries removed
+ */
+static int
+expire_tree(lua_State *l)
+{
+    const char *tname;
+    size_t tname_len;
+    lua_Integer budget;
+    ipforest_handle_t *handle;
+    uint32_t removed;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+    budget = luaL_optinteger(l, 2, 1024);
+
+    if (tname_len <= 0 || budget <= 0) {
+        goto fail;
+    }
+
+    if (!_find_tree(l, tname)) {
+        goto fail;
+    }
+
+    handle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    removed = 0;
+    if (handle->ttl) {
+        removed = ipforest_ttl_expire(handle->ttl, _now_ms(), (uint32_t)budget);
+    }
+
+    lua_pushnumber(l, removed);
+    return 1;
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+/* push "a.b.c.d/len" onto stack */
+inline static void
+_push_prefix(lua_State *l, uint32_t addr, int plen)
+{
+    lua_pushfstring(l, "%d.%d.%d.%d/%d",
+                    (int)(addr >> 24), (int)((addr >> 16) & 0xff),
+                    (int)((addr >> 8) & 0xff), (int)(addr & 0xff), plen);
+}
+
+inline static void
+_drop_hits(ipforest_handle_t *handle)
+{
+    if (handle->hits) {
+        ipforest_hash_free(handle->hits);
+        handle->hits = NULL;
+    }
+}
+
+/*
+ * switch counting mode on or off, switching off drops the counters. false
+ * if switched on for a tree without a radix tree, nothing would be counted
+ */
+static int
+count_hits(lua_State *l)
+{
+    const char *tname;
+    size_t tname_len;
+    ipforest_handle_t *handle;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+
+    if (tname_len <= 0) {
+        goto fail;
+    }
+
+    if (!_find_tree(l, tname)) {
+        goto fail;
+    }
+
+    handle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    if (lua_isnoneornil(l, 2) || lua_toboolean(l, 2)) {
+        /* hits are counted on the radix tree path only */
+        if (!_handle_tree(handle)) {
+            goto fail;
+        }
+        if (!handle->hits) {
+            handle->hits = ipforest_hash_alloc(0);
+            if (!handle->hits) {
+                goto fail;
+            }
+        }
+    } else {
+        _drop_hits(handle);
+    }
+
+    lua_pushboolean(l, IPFOREST_TRUE);
+    return 1;
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+static int
+reset_hits(lua_State *l)
+{
+    const char *tname;
+    size_t tname_len;
+    ipforest_handle_t *handle;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+
+    if (_find_tree(l, tname)) {
+        handle = lua_touserdata(l, -1);
+        lua_pop(l, 1);
+        if (handle->hits) {
+            ipforest_hash_clear(handle->hits);
+            lua_pushboolean(l, IPFOREST_TRUE);
+            return 1;
+        }
+    }
+
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+static int
+_hits_cmp(const void *a, const void *b)
+{
+    const ipforest_hash_entry_t *ea = a, *eb = b;
+
+    if (ea->value != eb->value) {
+        return ea->value > eb->value ? -1 : 1;
+    }
+    return ea->key < eb->key ? -1 : (ea->key > eb->key);
+}
+
+/*
+ * yield { { prefix = "a.b.c.d/len", hits = n }, ... } of the n most hit
+ * prefixes, most hit first
+ */
+static int
+top_hits(lua_State *l)
+{
+    const char *tname;
+    size_t tname_len;
+    lua_Integer n;
+    uint32_t i, count;
+    ipforest_handle_t *handle;
+    ipforest_hash_entry_t *entries;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+    n = luaL_optinteger(l, 2, 10);
+
+    if (tname_len <= 0 || n < 0) {
+        goto fail;
+    }
+
+    if (!_find_tree(l, tname)) {
+        goto fail;
+    }
+
+    handle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    if (!handle->hits) {
+        goto fail;
+    }
+
+    entries = malloc((handle->hits->count + 1) * sizeof(ipforest_hash_entry_t));
+    if (!entries) {
+        goto fail;
+    }
+
+    count = 0;
+    for (i = 0; i <= handle->hits->mask; i++) {
+        if (handle->hits->slots[i].key != IPFOREST_HASH_EMPTY) {
+            entries[count++] = handle->hits->slots[i];
+        }
+    }
+
+    qsort(entries, count, sizeof(ipforest_hash_entry_t), _hits_cmp);
+
+    if ((lua_Integer)count > n) {
+        count = (uint32_t)n;
+    }
+
+    lua_createtable(l, count, 0);
+    for (i = 0; i < count; i++) {
+        lua_createtable(l, 0, 2);
+        _push_prefix(l, IPFOREST_HASH_KEY_ADDR(entries[i].key),
+                     IPFOREST_HASH_KEY_PLEN(entries[i].key));
+        lua_setfield(l, -2, "prefix");
+        lua_pushnumber(l, (lua_Number)entries[i].value);
+        lua_setfield(l, -2, "hits");
+        lua_rawseti(l, -2, i + 1);
+    }
+
+    free(entries);
+    return 1;
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+typedef struct ipforest_dump_ctx_s {
+    lua_State *l;
+    ipforest_hash_t *hits;
+} ipforest_dump_ctx_t;
+
+static IPFOREST_BOOLEAN
+_dump_leaf(uint32_t addr, uint32_t mask, void *data)
+{
+    int plen;
+    uint64_t *count;
+    ipforest_dump_ctx_t *ctx;
+
+    ctx = data;
+    plen = IPFOREST_MASK_PLEN(mask);
+    count = ipforest_hash_find(ctx->hits, addr, plen);
+
+    _push_prefix(ctx->l, addr, plen);
+    lua_pushnumber(ctx->l, count ? (lua_Number)*count : 0);
+    lua_settable(ctx->l, -3);
+
+    return IPFOREST_TRUE;
+}
+
+/*
+ * yield { ["a.b.c.d/len"] = hits, ... } for every leaf of the tree, never
+ * hit ones included with 0
+ */
+static int
+dump_hits(lua_State *l)
+{
+    const char *tname;
+    size_t tname_len;
+    ipforest_handle_t *handle;
+    ipforest_radix_tree_t *tree;
+    ipforest_dump_ctx_t ctx;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+
+    if (tname_len <= 0) {
+        goto fail;
+    }
+
+    if (!_find_tree(l, tname)) {
+        goto fail;
+    }
+
+    handle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    tree = _handle_tree(handle);
+    if (!handle->hits || !tree) {
+        goto fail;
+    }
+
+    ctx.l = l;
+    ctx.hits = handle->hits;
+
+    lua_newtable(l);
+    ipforest_radix_tree_walk(tree, _dump_leaf, &ctx);
+    return 1;
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+/*
+ * instrument(tname [, sample]), time one lookup out of sample (64 by
+ * default), 0 or false switches off and drops the metrics
+ */
+static int
+instrument_tree(lua_State *l)
+{
+    const char *tname;
+    size_t tname_len;
+    lua_Integer sample;
+    ipforest_handle_t *handle;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+
+    if (lua_type(l, 2) == LUA_TBOOLEAN) {
+        sample = lua_toboolean(l, 2) ? 64 : 0;
+    } else {
+        sample = luaL_optinteger(l, 2, 64);
+    }
+
+    if (tname_len <= 0 || sample < 0) {
+        goto fail;
+    }
+
+    if (!_find_tree(l, tname)) {
+        goto fail;
+    }
+
+    handle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    if (handle->metrics) {
+        ipforest_metrics_free(handle->metrics);
+        handle->metrics = NULL;
+    }
+
+    if (sample > 0) {
+        handle->metrics = ipforest_metrics_alloc((uint32_t)sample);
+        if (!handle->metrics) {
+            goto fail;
+        }
+    }
+
+    lua_pushboolean(l, IPFOREST_TRUE);
+    return 1;
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+/* push metrics of a tree as a table onto stack */
+inline static void
+_push_metrics(lua_State *l, ipforest_metrics_t *metrics)
+{
+    int i;
+    uint64_t cumulative;
+
+    lua_createtable(l, 0, 5);
+
+    lua_pushnumber(l, (lua_Number)metrics->calls);
+    lua_setfield(l, -2, "calls");
+    lua_pushnumber(l, (lua_Number)metrics->hits);
+    lua_setfield(l, -2, "hits");
+    lua_pushnumber(l, (lua_Number)metrics->misses);
+    lua_setfield(l, -2, "misses");
+
+    /* { [depth] = lookups }, depths never reached left out */
+    lua_newtable(l);
+    for (i = 0; i < IPFOREST_METRICS_DEPTHS; i++) {
+        if (metrics->depth[i]) {
+            lua_pushnumber(l, (lua_Number)metrics->depth[i]);
+            lua_rawseti(l, -2, i);
+        }
+    }
+    lua_setfield(l, -2, "depth");
+
+    /* prometheus like histogram, cumulative buckets, bucket i is ns of bit
+     * length i so its inclusive upper bound is 2^i - 1 */
+    lua_createtable(l, 0, 3);
+    lua_pushnumber(l, (lua_Number)metrics->latency_count);
+    lua_setfield(l, -2, "count");
+    lua_pushnumber(l, (lua_Number)metrics->latency_sum);
+    lua_setfield(l, -2, "sum");
+
+    lua_createtable(l, IPFOREST_METRICS_BUCKETS, 0);
+    cumulative = 0;
+    for (i = 0; i < IPFOREST_METRICS_BUCKETS; i++) {
+        cumulative += metrics->latency[i];
+        lua_createtable(l, 0, 2);
+        if (i < IPFOREST_METRICS_BUCKETS - 1) {
+            lua_pushnumber(l, (lua_Number)(((uint64_t)1 << i) - 1));
+        } else {
+            lua_pushnumber(l, HUGE_VAL);
+        }
+        lua_setfield(l, -2, "le");
+        lua_pushnumber(l, (lua_Number)cumulative);
+        lua_setfield(l, -2, "count");
+        lua_rawseti(l, -2, i + 1);
+    }
+    lua_setfield(l, -2, "buckets");
+
+    lua_setfield(l, -2, "latency_ns");
+}
+
+/*
+ * metrics([tname]), yield { [tname] = { calls, hits, misses, depth,
+ * latency_ns = { count, sum, buckets = { { le, count }, ... } } } } for
+ * every instrumented tree, or just the metrics of tname
+ */
+static int
+metrics_tree(lua_State *l)
+{
+    const char *tname;
+    ipforest_handle_t *handle;
+
+    tname = luaL_optstring(l, 1, NULL);
+
+    if (tname) {
+        if (!_find_tree(l, tname)) {
+            goto fail;
+        }
+
+        handle = lua_touserdata(l, -1);
+        lua_pop(l, 1);
+
+        if (!handle->metrics) {
+            goto fail;
+        }
+
+        _push_metrics(l, handle->metrics);
+        return 1;
+    }
+
+    lua_newtable(l);
+    _get_forest_table(l);
+
+    lua_pushnil(l);
+    while (lua_next(l, -2)) {
+        handle = lua_touserdata(l, -1);
+        lua_pop(l, 1);
+
+        if (handle->metrics) {
+            /* key stays for lua_next, push a copy */
+            lua_pushvalue(l, -1);
+            _push_metrics(l, handle->metrics);
+            lua_settable(l, -5);
+        }
+    }
+
+    /* pop forest table from stack */
+    lua_pop(l, 1);
+    return 1;
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+/*
+ * counter(tname [, half_life [, capacity [, { plen, ... }]]]), count heavy
+ * hitters for tname, an empty tree is made if there is none. half_life in
+ * seconds (60 by default), capacity prefixes kept per length (1024) and
+ * the lengths counted at ({ 32, 24, 16 }). false drops the counters
+ */
+static int
+counter_tree(lua_State *l)
+{
+    int i, nlevels;
+    int plens[IPFOREST_HHH_LEVELS] = { 32, 24, 16 };
+    const char *tname;
+    size_t tname_len;
+    lua_Number half_life;
+    lua_Integer capacity;
+    ipforest_handle_t *handle;
+    ipforest_t *forest;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+
+    if (tname_len <= 0) {
+        goto fail;
+    }
+
+    if (!_find_tree(l, tname)) {
+        if (lua_type(l, 2) == LUA_TBOOLEAN && !lua_toboolean(l, 2)) {
+            goto fail;
+        }
+        forest = ipforest_create();
+        if (!forest || !_install_tree(l, tname, forest)) {
+            goto fail;
+        }
+        _find_tree(l, tname);
+    }
+
+    handle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    if (handle->hhh) {
+        ipforest_hhh_free(handle->hhh);
+        handle->hhh = NULL;
+    }
+
+    if (lua_type(l, 2) == LUA_TBOOLEAN && !lua_toboolean(l, 2)) {
+        lua_pushboolean(l, IPFOREST_TRUE);
+        return 1;
+    }
+
+    half_life = lua_type(l, 2) == LUA_TNUMBER ? lua_tonumber(l, 2) : 60;
+    capacity = luaL_optinteger(l, 3, 1024);
+    nlevels = 3;
+
+    if (lua_istable(l, 4)) {
+        nlevels = (int)lua_objlen(l, 4);
+        if (nlevels <= 0 || nlevels > IPFOREST_HHH_LEVELS) {
+            goto fail;
+        }
+        for (i = 0; i < nlevels; i++) {
+            lua_rawgeti(l, 4, i + 1);
+            plens[i] = lua_isnumber(l, -1) ? (int)lua_tointeger(l, -1) : -1;
+            lua_pop(l, 1);
+        }
+    }
+
+    if (capacity <= 0 || capacity > (1 << 24)) {
+        goto fail;
+    }
+
+    /* milliseconds are the ticks */
+    handle->hhh = ipforest_hhh_alloc(plens, nlevels, (uint32_t)capacity,
+                                     half_life * 1000, _now_ms());
+    if (!handle->hhh) {
+        goto fail;
+    }
+
+    lua_pushboolean(l, IPFOREST_TRUE);
+    return 1;
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+/*
+ * count_addr(tname, ip [, weight]), feed a request from ip to the heavy
+ * hitter counters of tname
+ */
+static int
+count_addr(lua_State *l)
+{
+    struct in_addr addr;
+    const char *tname, *ipstr;
+    size_t tname_len, ipstr_len;
+    lua_Number weight;
+    ipforest_handle_t *handle;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+    ipstr = luaL_checklstring(l, 2, &ipstr_len);
+    weight = luaL_optnumber(l, 3, 1);
+
+    if (tname_len <= 0 || ipstr_len <= 0 || !(weight > 0)) {
+        goto fail;
+    }
+
+    if (!_find_tree(l, tname)) {
+        goto fail;
+    }
+
+    handle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    if (!handle->hhh || inet_aton(ipstr, &addr) <= 0) {
+        goto fail;
+    }
+
+    if (ipforest_hhh_count(handle->hhh, ntohl(addr.s_addr), weight, _now_ms())) {
+        lua_pushboolean(l, IPFOREST_TRUE);
+        return 1;
+    }
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+/*
+ * heavy_hitters(tname [, threshold]), prefixes with a share of threshold
+ * (0.01 by default) or more of the decayed requests, as { prefix, count,
+ * error } level after level, most counted first. the true count is between
+ * count - error and count. the decayed total comes second
+ */
+static int
+heavy_hitters(lua_State *l)
+{
+    const char *tname;
+    size_t tname_len;
+    uint32_t i, n;
+    uint64_t now;
+    double total;
+    lua_Number threshold;
+    ipforest_handle_t *handle;
+    ipforest_hhh_hitter_t *hitters;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+    threshold = luaL_optnumber(l, 2, 0.01);
+
+    if (tname_len <= 0 || threshold < 0 || threshold > 1) {
+        goto fail;
+    }
+
+    if (!_find_tree(l, tname)) {
+        goto fail;
+    }
+
+    handle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    if (!handle->hhh) {
+        goto fail;
+    }
+
+    hitters = malloc(handle->hhh->capacity * handle->hhh->nlevels * sizeof(ipforest_hhh_hitter_t));
+    if (!hitters) {
+        goto fail;
+    }
+
+    now = _now_ms();
+    total = ipforest_hhh_total(handle->hhh, now);
+    n = ipforest_hhh_heavy(handle->hhh, threshold * total, now, hitters);
+
+    lua_createtable(l, n, 0);
+    for (i = 0; i < n; i++) {
+        lua_createtable(l, 0, 3);
+        _push_prefix(l, hitters[i].addr, hitters[i].plen);
+        lua_setfield(l, -2, "prefix");
+        lua_pushnumber(l, hitters[i].count);
+        lua_setfield(l, -2, "count");
+        lua_pushnumber(l, hitters[i].error);
+        lua_setfield(l, -2, "error");
+        lua_rawseti(l, -2, i + 1);
+    }
+
+    free(hitters);
+
+    lua_pushnumber(l, total);
+    return 2;
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+static int
+has_tree(lua_State *l)
+{
+    const char *tname;
+    size_t tname_len;
+    tname = luaL_checklstring(l, 1, &tname_len);
+
+    if (_find_tree(l, tname)) {
+        /* pop light user data */
+        lua_pop(l, 1);
+
+        lua_pushboolean(l, IPFOREST_TRUE);
+        return 1;
+    }
+
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+static int
+free_tree(lua_State *l)
+{
+    const char *tname;
+    size_t tname_len;
+    tname = luaL_checklstring(l, 1, &tname_len);
+
+    if (_find_tree(l, tname)) {
+        _free_tree(l, tname);
+        lua_pushboolean(l, IPFOREST_TRUE);
+        return 1;
+    }
+
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+/*
+ * copy a private radix tree into one block in cache friendly order, shared
+ * trees are laid out once when published and stay as they are
+ */
+static int
+optimize_tree(lua_State *l)
+{
+    const char *tname;
+    size_t tname_len;
+    ipforest_handle_t *handle;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+
+    if (tname_len <= 0 || !_find_tree(l, tname)) {
+        goto fail;
+    }
+
+    handle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    if (handle->forest && ipforest_optimize(handle->forest)) {
+        lua_pushboolean(l, IPFOREST_TRUE);
+        return 1;
+    }
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+static int
+compact_tree(lua_State *l)
+{
+    const char *tname;
+    size_t tname_len;
+    tname = luaL_checklstring(l, 1, &tname_len);
+
+    if (_find_tree(l, tname)) {
+        _compact_tree(l, tname);
+        lua_pushboolean(l, IPFOREST_TRUE);
+        return 1;
+    }
+
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+static IPFOREST_BOOLEAN
+_copy_leaf(uint32_t addr, uint32_t mask, void *ctx)
+{
+    return ipforest_radix_tree_insert(ctx, addr, mask);
+}
+
+/*
+ * compact_lossy(tname, limit [, unit]), shrink the radix tree of tname to
+ * limit nodes, or bytes if unit is "bytes", by matching more addresses.
+ * yield how many more in all than loaded and appended, and the nodes left
+ */
+static int
+compact_lossy_tree(lua_State *l)
+{
+    const char *tname, *unit;
+    size_t tname_len;
+    lua_Number limit;
+    uint32_t max_nodes, nodes;
+    uint64_t extra;
+    ipforest_radix_tree_t *exact;
+    ipforest_handle_t *handle;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+    limit = luaL_checknumber(l, 2);
+    unit = luaL_optstring(l, 3, "nodes");
+
+    if (tname_len <= 0 || limit < 0) {
+        goto fail;
+    }
+
+    if (strcmp(unit, "bytes") == 0) {
+        limit /= sizeof(ipforest_radix_tree_node_t);
+    } else if (strcmp(unit, "nodes") != 0) {
+        goto fail;
+    }
+    max_nodes = limit < UINT32_MAX ? (uint32_t)limit : UINT32_MAX;
+
+    if (!_find_tree(l, tname)) {
+        goto fail;
+    }
+
+    handle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    /* shared trees are frozen */
+    if (!handle->forest || !handle->forest->tree || handle->forest->frozen) {
+        goto fail;
+    }
+
+    /* the tree as listed is kept aside the first time, appends go to both */
+    exact = handle->exact;
+    if (!exact) {
+        exact = ipforest_radix_tree_alloc();
+        if (!exact) {
+            goto fail;
+        }
+        if (!ipforest_radix_tree_walk(handle->forest->tree, _copy_leaf, exact)) {
+            ipforest_radix_tree_free(exact);
+            goto fail;
+        }
+    }
+
+    if (!ipforest_compact_lossy(handle->forest, max_nodes, &extra, &nodes)) {
+        if (exact != handle->exact) {
+            ipforest_radix_tree_free(exact);
+        }
+        goto fail;
+    }
+
+    if (exact != handle->exact) {
+        if (!extra) {
+            ipforest_radix_tree_free(exact);
+            lua_pushnumber(l, 0);
+            lua_pushnumber(l, (lua_Number)nodes);
+            return 2;
+        }
+        ipforest_radix_tree_compact(exact);
+        handle->exact = exact;
+    }
+
+    extra = ipforest_radix_tree_covered(handle->forest->tree) - ipforest_radix_tree_covered(exact);
+    lua_pushnumber(l, (lua_Number)extra);
+    lua_pushnumber(l, (lua_Number)nodes);
+    return 2;
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+static int
+match_tree(lua_State *l)
+{
+
+    struct in_addr addr;
+    const char *tname, *ipstr;
+    size_t tname_len, ipstr_len;
+    ipforest_handle_t *handle;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+    ipstr = luaL_checklstring(l, 2, &ipstr_len);
+
+    if (tname_len <= 0 || ipstr_len <= 0) {
+        goto fail;
+    }
+
+    if (_find_tree(l, tname)) {
+        handle = lua_touserdata(l, -1);
+        assert(handle);
+        if (inet_aton(ipstr, &addr) > 0) {
+            /* do a 32 bit mask lookup */
+            if (_lookup_handle(handle, ntohl(addr.s_addr))) {
+                /* pop light user data */
+                lua_pop(l, 1);
+                lua_pushboolean(l, IPFOREST_TRUE);
+                return 1;
+            }
+        }
+        lua_pop(l, 1);
+    }
+
+ fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+/*
+ * first_untrusted(tname, header [, from_right]), first hop of the comma
+ * separated header tname does not match, scanned in place. yield it and its
+ * position counted from the left, false if every hop matches. a hop that is
+ * not an address is never trusted.
+ */
+static int
+first_untrusted(lua_State *l)
+{
+    const char *tname, *header, *start, *end, *p, *q;
+    size_t tname_len, header_len;
+    int pos, count, from_right;
+    uint32_t addr;
+    ipforest_handle_t *handle;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+    header = luaL_checklstring(l, 2, &header_len);
+    from_right = lua_toboolean(l, 3);
+
+    if (tname_len <= 0 || header_len <= 0 || !_find_tree(l, tname)) {
+        goto fail;
+    }
+
+    handle = lua_touserdata(l, -1);
+    assert(handle);
+    lua_pop(l, 1);
+
+    end = header + header_len;
+
+    /* the hop count only matters for positions from the right */
+    count = 1;
+    if (from_right) {
+        for (p = header; p < end; p++) {
+            count += *p == ',';
+        }
+    }
+
+    pos = from_right ? count : 1;
+    p = from_right ? end : header;
+
+    for ( ;; ) {
+        /* hop is [start, q), p left at the next one */
+        if (from_right) {
+            for (start = p; start > header && start[-1] != ','; start--);
+            q = p;
+            p = start > header ? start - 1 : start;
+        } else {
+            for (q = p; q < end && *q != ','; q++);
+            start = p;
+            p = q + 1;
+        }
+
+        while (start < q && (*start == ' ' || *start == '\t')) {
+            start++;
+        }
+        while (q > start && (q[-1] == ' ' || q[-1] == '\t')) {
+            q--;
+        }
+
+        if (!ipforest_parse_ipv4(start, q - start, &addr)
+            || !_lookup_handle(handle, addr)) {
+            lua_pushlstring(l, start, q - start);
+            lua_pushinteger(l, pos);
+            return 2;
+        }
+
+        if (from_right ? pos == 1 : p > end) {
+            break;
+        }
+        pos += from_right ? -1 : 1;
+    }
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+/*
+ * handle of tname, an empty tree is made if there is none
+ */
+inline static ipforest_handle_t *
+_ensure_tree(lua_State *l, const char *tname)
+{
+    ipforest_t *forest;
+    ipforest_handle_t *handle;
+
+    if (!_find_tree(l, tname)) {
+        forest = ipforest_create();
+        if (!forest || !_install_tree(l, tname, forest)) {
+            return NULL;
+        }
+        _find_tree(l, tname);
+    }
+
+    handle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    return handle;
+}
+
+/*
+ * load2(tname, fname), replace the (src, dst) rules of tname with those of
+ * fname, a src and a dst spec per line
+ */
+static int
+load2_tree(lua_State *l)
+{
+    const char *tname, *fname;
+    size_t tname_len, fname_len;
+    ipforest_2d_t *rules;
+    ipforest_handle_t *handle;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+    fname = luaL_checklstring(l, 2, &fname_len);
+
+    if (tname_len <= 0 || fname_len <= 0) {
+        goto fail;
+    }
+
+    rules = ipforest_2d_load_file(fname);
+    if (!rules) {
+        goto fail;
+    }
+
+    handle = _ensure_tree(l, tname);
+    if (!handle) {
+        ipforest_2d_free(rules);
+        goto fail;
+    }
+
+    if (handle->rules) {
+        ipforest_2d_free(handle->rules);
+    }
+    handle->rules = rules;
+
+    lua_pushboolean(l, IPFOREST_TRUE);
+    return 1;
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+/*
+ * append2(tname, src, dst), add a rule matching src x dst
+ */
+static int
+append2_tree(lua_State *l)
+{
+    const char *tname, *src, *dst;
+    size_t tname_len, src_len, dst_len;
+    ipforest_handle_t *handle;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+    src = luaL_checklstring(l, 2, &src_len);
+    dst = luaL_checklstring(l, 3, &dst_len);
+
+    if (tname_len <= 0 || src_len <= 0 || dst_len <= 0) {
+        goto fail;
+    }
+
+    handle = _ensure_tree(l, tname);
+    if (!handle) {
+        goto fail;
+    }
+
+    if (!handle->rules) {
+        handle->rules = ipforest_2d_alloc();
+    }
+
+    if (handle->rules && ipforest_2d_insert_spec(handle->rules, src, dst)) {
+        lua_pushboolean(l, IPFOREST_TRUE);
+        return 1;
+    }
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+/*
+ * match2(tname, src, dst), yield true if a rule of tname covers both
+ */
+static int
+match2_tree(lua_State *l)
+{
+    struct in_addr src, dst;
+    const char *tname, *srcstr, *dststr;
+    size_t tname_len;
+    ipforest_handle_t *handle;
+    IPFOREST_BOOLEAN hit;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+    srcstr = luaL_checkstring(l, 2);
+    dststr = luaL_checkstring(l, 3);
+
+    hit = IPFOREST_FALSE;
+
+    if (tname_len > 0 && _find_tree(l, tname)) {
+        handle = lua_touserdata(l, -1);
+        lua_pop(l, 1);
+
+        if (handle->rules && inet_aton(srcstr, &src) > 0 && inet_aton(dststr, &dst) > 0) {
+            hit = ipforest_2d_lookup(handle->rules, ntohl(src.s_addr), ntohl(dst.s_addr));
+        }
+    }
+
+    lua_pushboolean(l, hit);
+    return 1;
+}
+
+/*
+ * parse a single host or cidr, addr comes back masked
+ */
+inline static IPFOREST_BOOLEAN
+_parse_prefix(const char *spec, uint32_t *paddr, uint32_t *pmask)
+{
+    ipforest_ipaddr_t ipaddr;
+
+    if (ipforest_parse_ip_line(spec, NULL) != 1) {
+        return IPFOREST_FALSE;
+    }
+
+    ipforest_parse_ip_line(spec, &ipaddr);
+    *paddr = ipaddr.addr & ipaddr.mask;
+    *pmask = ipaddr.mask;
+
+    return IPFOREST_TRUE;
+}
+
+/*
+ * find tree tname and parse prefix at index 2 into *ptree, 0 if either
+ * fails and -1 with nil and a message pushed onto stack if the tree has no
+ * radix tree to query
+ */
+inline static int
+_check_prefix(lua_State *l, uint32_t *paddr, uint32_t *pmask, ipforest_radix_tree_t **ptree)
+{
+    const char *tname, *spec;
+    size_t tname_len, spec_len;
+    ipforest_handle_t *handle;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+    spec = luaL_checklstring(l, 2, &spec_len);
+
+    if (tname_len <= 0 || spec_len <= 0) {
+        return 0;
+    }
+
+    if (!_parse_prefix(spec, paddr, pmask)) {
+        return 0;
+    }
+
+    if (!_find_tree(l, tname)) {
+        return 0;
+    }
+
+    handle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    *ptree = _handle_tree(handle);
+    if (!*ptree) {
+        lua_pushnil(l);
+        lua_pushfstring(l, "tree %s has no radix tree to query", tname);
+        return -1;
+    }
+
+    return 1;
+}
+
+/*
+ * covers(tname, cidr), tell if every address of cidr is listed, nil and a
+ * message if tname has no radix tree
+ */
+static int
+covers_tree(lua_State *l)
+{
+    int ret;
+    uint32_t addr, mask;
+    ipforest_radix_tree_t *tree;
+
+    ret = _check_prefix(l, &addr, &mask, &tree);
+    if (ret < 0) {
+        return 2;
+    }
+
+    lua_pushboolean(l, ret > 0 && ipforest_radix_tree_lookup(tree, addr, mask));
+    return 1;
+}
+
+/*
+ * overlaps(tname, cidr), tell if any address of cidr is listed, nil and a
+ * message if tname has no radix tree
+ */
+static int
+overlaps_tree(lua_State *l)
+{
+    int ret;
+    uint32_t addr, mask;
+    ipforest_radix_tree_t *tree;
+
+    ret = _check_prefix(l, &addr, &mask, &tree);
+    if (ret < 0) {
+        return 2;
+    }
+
+    lua_pushboolean(l, ret > 0 && ipforest_radix_tree_overlaps(tree, addr, mask));
+    return 1;
+}
+
+/*
+ * iterator of prefixes_in, upvalues are tname, the next address to search
+ * from and the last address of the cidr. the tree is looked up again on
+ * every step so it may change or go away in between
+ */
+static int
+_prefixes_next(lua_State *l)
+{
+    int plen;
+    uint32_t from, last, addr, end;
+    const char *tname;
+    ipforest_handle_t *handle;
+    ipforest_radix_tree_t *tree;
+
+    tname = lua_tostring(l, lua_upvalueindex(1));
+    if (lua_isnil(l, lua_upvalueindex(2))) {
+        return 0;
+    }
+    from = (uint32_t)lua_tonumber(l, lua_upvalueindex(2));
+    last = (uint32_t)lua_tonumber(l, lua_upvalueindex(3));
+
+    if (!_find_tree(l, tname)) {
+        goto done;
+    }
+
+    handle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    tree = _handle_tree(handle);
+    if (!tree) {
+        return luaL_error(l, "tree %s has no radix tree to query any more", tname);
+    }
+
+    if (!ipforest_radix_tree_next(tree, from, &addr, &plen) || addr > last) {
+        goto done;
+    }
+
+    end = addr | (plen ? ~(0xffffffff << (32 - plen)) : 0xffffffff);
+    if (end >= last) {
+        /* nothing left, also keeps from + 1 from wrapping */
+        lua_pushnil(l);
+    } else {
+        lua_pushnumber(l, (lua_Number)end + 1);
+    }
+    lua_replace(l, lua_upvalueindex(2));
+
+    _push_prefix(l, addr, plen);
+    return 1;
+
+done:
+    lua_pushnil(l);
+    lua_replace(l, lua_upvalueindex(2));
+    return 0;
+}
+
+/*
+ * prefixes_in(tname, cidr), iterate over listed prefixes sharing addresses
+ * with cidr in address order, a listed prefix covering cidr comes out as is.
+ * yield nothing if tname or cidr is not valid, nil and a message instead of
+ * the iterator if tname has no radix tree
+ */
+static int
+prefixes_in(lua_State *l)
+{
+    int ret;
+    uint32_t addr, mask;
+    ipforest_radix_tree_t *tree;
+
+    addr = 0;
+    mask = 0;
+
+    ret = _check_prefix(l, &addr, &mask, &tree);
+    if (ret < 0) {
+        return 2;
+    }
+
+    lua_pushvalue(l, 1);
+    if (ret > 0) {
+        lua_pushnumber(l, (lua_Number)addr);
+    } else {
+        lua_pushnil(l);
+    }
+    lua_pushnumber(l, (lua_Number)(addr | ~mask));
+
+    lua_pushcclosure(l, _prefixes_next, 3);
+    return 1;
+}
+
+#define IPFOREST_DIFF_MT "ipforest.diff"
+
+/*
+ * a DAG made for one side of a diff when only the other side is frozen,
+ * nodes are hash consed so both share what did not change
+ */
+typedef struct ipforest_diff_s {
+    ipforest_dag_t *dag;               /* NULL if both sides have their own */
+    IPFOREST_BOOLEAN old;              /* dag stands for the old tree */
+} ipforest_diff_t;
+
+inline static const ipforest_dag_t *
+_handle_dag(ipforest_handle_t *handle)
+{
+    return handle->forest ? ipforest_compiled(handle->forest, "dag") : NULL;
+}
+
+/*
+ * check trees oname and nname can be compared, each needs a DAG or a radix
+ * tree, and freeze the one side into diff->dag if only the other is frozen.
+ * a message is pushed onto stack if not
+ */
+static IPFOREST_BOOLEAN
+_diff_prepare(lua_State *l, const char *oname, const char *nname, ipforest_diff_t *diff)
+{
+    int i;
+    const char *names[2];
+    ipforest_handle_t *handles[2];
+
+    names[0] = oname;
+    names[1] = nname;
+    diff->dag = NULL;
+
+    for (i = 0; i < 2; i++) {
+        if (!_find_tree(l, names[i])) {
+            lua_pushfstring(l, "no tree %s", names[i]);
+            return IPFOREST_FALSE;
+        }
+        handles[i] = lua_touserdata(l, -1);
+        lua_pop(l, 1);
+
+        if (!_handle_dag(handles[i]) && !_handle_tree(handles[i])) {
+            lua_pushfstring(l, "tree %s has neither a radix tree nor a DAG", names[i]);
+            return IPFOREST_FALSE;
+        }
+    }
+
+    if (!_handle_dag(handles[0]) != !_handle_dag(handles[1])) {
+        i = _handle_dag(handles[0]) ? 1 : 0;
+        diff->dag = ipforest_dag_freeze(_handle_tree(handles[i]));
+        if (!diff->dag) {
+            lua_pushfstring(l, "no memory to freeze tree %s", names[i]);
+            return IPFOREST_FALSE;
+        }
+        diff->old = i == 0;
+    }
+
+    return IPFOREST_TRUE;
+}
+
+/*
+ * next prefix in address order from from on which trees oname and nname
+ * differ, 1 if found, 0 if none and -1 if they can not be compared any
+ * more. DAGs are compared skipping what they share, radix trees otherwise
+ */
+static int
+_diff_next(lua_State *l, const char *oname, const char *nname, const ipforest_diff_t *diff,
+           uint32_t from, uint32_t *paddr, int *plen, IPFOREST_BOOLEAN *added)
+{
+    ipforest_handle_t *ohandle, *nhandle;
+    ipforest_radix_tree_t *otree, *ntree;
+    const ipforest_dag_t *odag, *ndag;
+
+    if (!_find_tree(l, oname)) {
+        return -1;
+    }
+    ohandle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    if (!_find_tree(l, nname)) {
+        return -1;
+    }
+    nhandle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    odag = diff->dag && diff->old ? diff->dag : _handle_dag(ohandle);
+    ndag = diff->dag && !diff->old ? diff->dag : _handle_dag(nhandle);
+
+    if (odag && ndag) {
+        return ipforest_dag_diff_next(odag, ndag, from, paddr, plen, added) ? 1 : 0;
+    }
+
+    otree = _handle_tree(ohandle);
+    ntree = _handle_tree(nhandle);
+
+    if (!otree || !ntree) {
+        return -1;
+    }
+
+    return ipforest_radix_tree_diff_next(otree, ntree, from, paddr, plen, added) ? 1 : 0;
+}
+
+static int
+diff_gc(lua_State *l)
+{
+    ipforest_diff_t *diff;
+
+    diff = luaL_checkudata(l, 1, IPFOREST_DIFF_MT);
+    if (diff->dag) {
+        ipforest_dag_free(diff->dag);
+        diff->dag = NULL;
+    }
+
+    return 0;
+}
+
+static int
+_diff_iter(lua_State *l)
+{
+    int plen, ret;
+    uint32_t from, addr, end;
+    const char *oname, *nname;
+    const ipforest_diff_t *diff;
+    IPFOREST_BOOLEAN added;
+
+    oname = lua_tostring(l, lua_upvalueindex(1));
+    nname = lua_tostring(l, lua_upvalueindex(2));
+    if (lua_isnil(l, lua_upvalueindex(3))) {
+        return 0;
+    }
+    from = (uint32_t)lua_tonumber(l, lua_upvalueindex(3));
+    diff = lua_touserdata(l, lua_upvalueindex(4));
+
+    ret = _diff_next(l, oname, nname, diff, from, &addr, &plen, &added);
+    if (ret < 0) {
+        return luaL_error(l, "trees %s and %s can not be compared any more", oname, nname);
+    }
+    if (ret == 0) {
+        lua_pushnil(l);
+        lua_replace(l, lua_upvalueindex(3));
+        return 0;
+    }
+
+    end = addr | (plen ? ~(0xffffffff << (32 - plen)) : 0xffffffff);
+    if (end == 0xffffffff) {
+        lua_pushnil(l);
+    } else {
+        lua_pushnumber(l, (lua_Number)end + 1);
+    }
+    lua_replace(l, lua_upvalueindex(3));
+
+    _push_prefix(l, addr, plen);
+    lua_pushboolean(l, added);
+    return 2;
+}
+
+/*
+ * diff(old, new), iterate over the fewest cidrs turning tree old into tree
+ * new in address order, each with true if added or false if removed.
+ * diff(old, new, path) writes them as +cidr and -cidr lines instead and
+ * returns how many. false and a message if a tree is unknown or has neither
+ * a radix tree nor a DAG, false if the file can not be written
+ */
+static int
+diff_tree(lua_State *l)
+{
+    int plen, ret;
+    FILE *fp;
+    lua_Number count;
+    uint32_t from, addr, end;
+    const char *oname, *nname, *path;
+    ipforest_diff_t local, *diff;
+    IPFOREST_BOOLEAN added;
+
+    oname = luaL_checkstring(l, 1);
+    nname = luaL_checkstring(l, 2);
+    path = luaL_optstring(l, 3, NULL);
+
+    if (!path) {
+        lua_settop(l, 2);
+        lua_pushnumber(l, 0);
+
+        /* the DAG made if any lives as long as the iterator */
+        diff = lua_newuserdata(l, sizeof(ipforest_diff_t));
+        diff->dag = NULL;
+        luaL_getmetatable(l, IPFOREST_DIFF_MT);
+        lua_setmetatable(l, -2);
+
+        if (!_diff_prepare(l, oname, nname, diff)) {
+            goto fail_message;
+        }
+
+        lua_pushcclosure(l, _diff_iter, 4);
+        return 1;
+    }
+
+    /* unknown names fail rather than leaving an empty delta behind */
+    diff = &local;
+    if (!_diff_prepare(l, oname, nname, diff)) {
+        goto fail_message;
+    }
+
+    fp = fopen(path, "w");
+    if (!fp) {
+        goto fail;
+    }
+
+    count = 0;
+    from = 0;
+
+    while ((ret = _diff_next(l, oname, nname, diff, from, &addr, &plen, &added)) > 0) {
+        fprintf(fp, "%c%u.%u.%u.%u/%d\n", added ? '+' : '-',
+                addr >> 24, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff, plen);
+        count++;
+
+        end = addr | (plen ? ~(0xffffffff << (32 - plen)) : 0xffffffff);
+        if (end == 0xffffffff) {
+            break;
+        }
+        from = end + 1;
+    }
+
+    if (fclose(fp) != 0 || ret < 0) {
+        goto fail;
+    }
+
+    if (diff->dag) {
+        ipforest_dag_free(diff->dag);
+    }
+
+    lua_pushnumber(l, count);
+    return 1;
+
+fail_message:
+    if (!path) {
+        /* drop the userdata under the message, collected later */
+        lua_remove(l, -2);
+    }
+    lua_pushboolean(l, IPFOREST_FALSE);
+    lua_insert(l, -2);
+    return 2;
+
+fail:
+    if (diff->dag) {
+        ipforest_dag_free(diff->dag);
+    }
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+/*
+ * load a matcher generated by ipforest-compile
+ */
+static int
+load_compiled_tree(lua_State *l)
+{
+    const char *tname, *path;
+    size_t tname_len, path_len;
+    ipforest_t *forest;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+    path = luaL_checklstring(l, 2, &path_len);
+
+    if (tname_len <= 0 || path_len <= 0) {
+        goto fail;
+    }
+
+    forest = ipforest_create();
+    if (!forest) {
+        goto fail;
+    }
+
+    if (!ipforest_load_compiled(forest, path)) {
+        ipforest_free(forest);
+        goto fail;
+    }
+
+    if (!_install_tree(l, tname, forest)) {
+        goto fail;
+    }
+
+    lua_pushboolean(l, IPFOREST_TRUE);
+    return 1;
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+/*
+ * become the one writer of a shared memory tree, created with room for
+ * nodes if missing, 1M without. an existing one must have that room if
+ * nodes is given. appends show up in every process attached to it
+ */
+static int
+shm_create_tree(lua_State *l)
+{
+    const char *tname, *name;
+    size_t tname_len, name_len;
+    lua_Integer nodes;
+    ipforest_t *forest;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+    name = luaL_checklstring(l, 2, &name_len);
+    nodes = luaL_optinteger(l, 3, 0);
+
+    if (tname_len <= 0 || name_len <= 0 || nodes < 0 || nodes == 1 || nodes >= 0xffffffff) {
+        goto fail;
+    }
+
+    /* the old tree may hold the writer lock of the same segment */
+    if (_find_tree(l, tname)) {
+        _free_tree(l, tname);
+    }
+
+    forest = ipforest_create();
+    if (!forest) {
+        goto fail;
+    }
+
+    if (!ipforest_create_shm(forest, name, (uint32_t)nodes)) {
+        ipforest_free(forest);
+        goto fail;
+    }
+
+    if (!_install_tree(l, tname, forest)) {
+        goto fail;
+    }
+
+    lua_pushboolean(l, IPFOREST_TRUE);
+    return 1;
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+/*
+ * look up a shared memory tree without locking, read only
+ */
+static int
+shm_attach_tree(lua_State *l)
+{
+    const char *tname, *name;
+    size_t tname_len, name_len;
+    ipforest_t *forest;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+    name = luaL_checklstring(l, 2, &name_len);
+
+    if (tname_len <= 0 || name_len <= 0) {
+        goto fail;
+    }
+
+    forest = ipforest_create();
+    if (!forest) {
+        goto fail;
+    }
+
+    if (!ipforest_attach_shm(forest, name)) {
+        ipforest_free(forest);
+        goto fail;
+    }
+
+    if (!_install_tree(l, tname, forest)) {
+        goto fail;
+    }
+
+    lua_pushboolean(l, IPFOREST_TRUE);
+    return 1;
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+static int
+shm_unlink_tree(lua_State *l)
+{
+    const char *name;
+
+    name = luaL_checkstring(l, 1);
+
+    lua_pushboolean(l, ipforest_unlink_shm(name));
+    return 1;
+}
+
+/*
+ * map a MaxMind DB file, lookups walk its search tree in place
+ */
+static int
+load_mmdb_tree(lua_State *l)
+{
+    const char *tname, *path;
+    size_t tname_len, path_len;
+    ipforest_t *forest;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+    path = luaL_checklstring(l, 2, &path_len);
+
+    if (tname_len <= 0 || path_len <= 0) {
+        goto fail;
+    }
+
+    forest = ipforest_create();
+    if (!forest) {
+        goto fail;
+    }
+
+    if (!ipforest_load_mmdb(forest, path)) {
+        ipforest_free(forest);
+        goto fail;
+    }
+
+    if (!_install_tree(l, tname, forest)) {
+        goto fail;
+    }
+
+    lua_pushboolean(l, IPFOREST_TRUE);
+    return 1;
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+/*
+ * push the value at offset as a lua value, maps become tables keyed by
+ * name and arrays sequences, uint128 is pushed as a hex string
+ */
+static IPFOREST_BOOLEAN
+_push_mmdb_value(lua_State *l, const ipforest_mmdb_t *mmdb, uint32_t offset, int depth)
+{
+    uint32_t i, cur, next;
+    char hex[33];
+    ipforest_mmdb_value_t value, key;
+
+    if (depth > 32 || !ipforest_mmdb_decode(mmdb, offset, &value, &next)) {
+        return IPFOREST_FALSE;
+    }
+
+    switch (value.type) {
+    case IPFOREST_MMDB_UTF8:
+    case IPFOREST_MMDB_BYTES:
+        lua_pushlstring(l, (const char *)value.bytes, value.size);
+        return IPFOREST_TRUE;
+
+    case IPFOREST_MMDB_DOUBLE:
+    case IPFOREST_MMDB_FLOAT:
+        lua_pushnumber(l, value.real);
+        return IPFOREST_TRUE;
+
+    case IPFOREST_MMDB_UINT16:
+    case IPFOREST_MMDB_UINT32:
+    case IPFOREST_MMDB_UINT64:
+        lua_pushnumber(l, (lua_Number)value.uint);
+        return IPFOREST_TRUE;
+
+    case IPFOREST_MMDB_INT32:
+        lua_pushnumber(l, value.sint);
+        return IPFOREST_TRUE;
+
+    case IPFOREST_MMDB_UINT128:
+        for (i = 0; i < value.size; i++) {
+            sprintf(hex + i * 2, "%02x", value.bytes[i]);
+        }
+        hex[value.size * 2] = '\0';
+        lua_pushstring(l, value.size ? hex : "00");
+        return IPFOREST_TRUE;
+
+    case IPFOREST_MMDB_BOOLEAN:
+        lua_pushboolean(l, value.uint ? IPFOREST_TRUE : IPFOREST_FALSE);
+        return IPFOREST_TRUE;
+
+    case IPFOREST_MMDB_MAP:
+        lua_createtable(l, 0, value.size);
+        cur = value.children;
+        for (i = 0; i < value.size; i++) {
+            if (!ipforest_mmdb_decode(mmdb, cur, &key, &cur)
+                || key.type != IPFOREST_MMDB_UTF8) {
+                goto container_error;
+            }
+            lua_pushlstring(l, (const char *)key.bytes, key.size);
+            if (!_push_mmdb_value(l, mmdb, cur, depth + 1)) {
+                lua_pop(l, 1);
+                goto container_error;
+            }
+            lua_rawset(l, -3);
+            if (!ipforest_mmdb_skip(mmdb, cur, &cur)) {
+                goto container_error;
+            }
+        }
+        return IPFOREST_TRUE;
+
+    case IPFOREST_MMDB_ARRAY:
+        lua_createtable(l, value.size, 0);
+        cur = value.children;
+        for (i = 0; i < value.size; i++) {
+            if (!_push_mmdb_value(l, mmdb, cur, depth + 1)) {
+                goto container_error;
+            }
+            lua_rawseti(l, -2, i + 1);
+            if (!ipforest_mmdb_skip(mmdb, cur, &cur)) {
+                goto container_error;
+            }
+        }
+        return IPFOREST_TRUE;
+
+    default:
+        return IPFOREST_FALSE;
+    }
+
+container_error:
+    lua_pop(l, 1);
+    return IPFOREST_FALSE;
+}
+
+/*
+ * value_tree(tname, ip [, key or index ...]), the data a MaxMind DB tree
+ * holds for ip, or the part of it the path leads to. strings select map
+ * keys, numbers array items from 1. false if there is none
+ */
+static int
+value_tree(lua_State *l)
+{
+    int i, top;
+    uint32_t offset;
+    lua_Number index;
+    struct in_addr addr;
+    const char *tname, *ipstr, *key;
+    size_t tname_len, ipstr_len, key_len;
+    ipforest_handle_t *handle;
+    const ipforest_mmdb_t *mmdb;
+
+    top = lua_gettop(l);
+    tname = luaL_checklstring(l, 1, &tname_len);
+    ipstr = luaL_checklstring(l, 2, &ipstr_len);
+
+    if (tname_len <= 0 || ipstr_len <= 0 || inet_aton(ipstr, &addr) <= 0) {
+        goto fail;
+    }
+
+    if (!_find_tree(l, tname)) {
+        goto fail;
+    }
+
+    handle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    mmdb = handle->forest ? ipforest_compiled(handle->forest, "mmdb") : NULL;
+    if (!mmdb || !ipforest_mmdb_lookup(mmdb, ntohl(addr.s_addr), &offset)) {
+        goto fail;
+    }
+
+    for (i = 3; i <= top; i++) {
+        if (lua_type(l, i) == LUA_TNUMBER) {
+            index = lua_tonumber(l, i);
+            if (index < 1 || index > UINT32_MAX || index != floor(index)
+                || !ipforest_mmdb_get_index(mmdb, offset, (uint32_t)index - 1, &offset)) {
+                goto fail;
+            }
+        } else if (lua_type(l, i) == LUA_TSTRING) {
+            key = lua_tolstring(l, i, &key_len);
+            if (!ipforest_mmdb_get_key(mmdb, offset, key, key_len, &offset)) {
+                goto fail;
+            }
+        } else {
+            goto fail;
+        }
+    }
+
+    if (_push_mmdb_value(l, mmdb, offset, 0)) {
+        return 1;
+    }
+
+fail:
     lua_pushboolean(l, IPFOREST_FALSE);
     return 1;
 }
 
+/*
+ * (re)compile a private tree into its engine, or into the given one
+ */
 static int
-compact_tree(lua_State *l)
+compile_tree(lua_State *l)
 {
-    const char *tname;
+    const char *tname, *ename;
     size_t tname_len;
+    ipforest_handle_t *handle;
+
     tname = luaL_checklstring(l, 1, &tname_len);
+    ename = luaL_optstring(l, 2, NULL);
 
-    if (_find_tree(l, tname)) {
-        _compact_tree(l, tname);
+    if (tname_len <= 0) {
+        goto fail;
+    }
+
+    if (!_find_tree(l, tname)) {
+        goto fail;
+    }
+
+    handle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    /* shared trees can not be compiled, frozen ones are refused */
+    if (handle->forest && ipforest_compile(handle->forest, ename)) {
         lua_pushboolean(l, IPFOREST_TRUE);
         return 1;
     }
 
+fail:
     lua_pushboolean(l, IPFOREST_FALSE);
     return 1;
 }
 
+/*
+ * load a file and publish it to the process wide store, lua_States which
+ * attached the name move to the new version on their next lookup
+ */
 static int
-match_tree(lua_State *l)
+publish_tree(lua_State *l)
 {
-
-    struct in_addr addr;
-    const char *tname, *ipstr;
-    size_t tname_len, ipstr_len;
+    const char *tname, *fname;
+    size_t tname_len, fname_len;
     ipforest_radix_tree_t *tree;
 
     tname = luaL_checklstring(l, 1, &tname_len);
-    ipstr = luaL_checklstring(l, 2, &ipstr_len);
+    fname = luaL_checklstring(l, 2, &fname_len);
 
-    if (tname_len <= 0 || ipstr_len <= 0) {
+    if (tname_len <= 0 || fname_len <= 0) {
+        goto fail;
+    }
+
+    tree = ipforest_load_file(fname);
+    if (!tree) {
+        goto fail;
+    }
+
+    if (!ipforest_shared_publish(tname, tree)) {
+        ipforest_radix_tree_free(tree);
+        goto fail;
+    }
+
+    lua_pushboolean(l, IPFOREST_TRUE);
+    return 1;
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+/*
+ * bind tname of this lua_State to the shared tree of the same name
+ */
+static int
+attach_tree(lua_State *l)
+{
+    const char *tname;
+    size_t tname_len;
+    ipforest_shared_ref_t *ref;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+
+    if (tname_len <= 0) {
+        goto fail;
+    }
+
+    ref = ipforest_shared_attach(tname);
+    if (!ref) {
         goto fail;
     }
 
     if (_find_tree(l, tname)) {
-        tree = lua_touserdata(l, -1);
-        assert(tree);
-        if (inet_aton(ipstr, &addr) > 0) {
-            /* do a 32 bit mask lookup */
-            if (ipforest_radix_tree_lookup(tree, ntohl(addr.s_addr), 0xffffffff)) {
-                /* pop light user data */
-                lua_pop(l, 1);
-                lua_pushboolean(l, IPFOREST_TRUE);
-                return 1;
-            }
-        }
+        _free_tree(l, tname);
+    }
+
+    /* push forest table onto stack */
+    _get_forest_table(l);
+    /* push attached tree onto stack */
+    if (_push_handle(l, NULL, ref)) {
+        lua_setfield(l, -2, tname);
+        /* pop forest table from stack */
+        lua_pop(l, 1);
+    } else {
+        /* pop forest table from stack */
         lua_pop(l, 1);
+        ipforest_shared_detach(ref);
+        goto fail;
     }
 
- fail:
+    lua_pushboolean(l, IPFOREST_TRUE);
+    return 1;
+
+fail:
+    lua_pushboolean(l, IPFOREST_FALSE);
+    return 1;
+}
+
+/*
+ * drop the radix tree of tname and keep only its deduplicated form, like a
+ * tree from load_compiled it is read only from now on. hit counters go
+ * too, there is no radix tree left to count on
+ */
+static int
+freeze_tree(lua_State *l)
+{
+    const char *tname;
+    size_t tname_len;
+    void *dag;
+    const ipforest_engine_t *engine;
+    ipforest_t *forest;
+    ipforest_handle_t *handle;
+
+    tname = luaL_checklstring(l, 1, &tname_len);
+
+    if (tname_len <= 0) {
+        goto fail;
+    }
+
+    if (!_find_tree(l, tname)) {
+        goto fail;
+    }
+
+    handle = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    if (handle->forest) {
+        if (!ipforest_freeze(handle->forest, "dag")) {
+            goto fail;
+        }
+        _drop_hits(handle);
+        _drop_exact(handle);
+        lua_pushboolean(l, IPFOREST_TRUE);
+        return 1;
+    }
+
+    /* attached, the shared tree stays in the store for others */
+    if (!ipforest_find_engine("dag", &engine)) {
+        goto fail;
+    }
+
+    dag = engine->build(_handle_tree(handle));
+    if (!dag) {
+        goto fail;
+    }
+
+    forest = ipforest_wrap_compiled(engine, dag);
+    if (!forest) {
+        engine->free(dag);
+        goto fail;
+    }
+
+    ipforest_shared_detach(handle->ref);
+    handle->ref = NULL;
+    handle->forest = forest;
+    _drop_hits(handle);
+
+    lua_pushboolean(l, IPFOREST_TRUE);
+    return 1;
+
+fail:
     lua_pushboolean(l, IPFOREST_FALSE);
     return 1;
 }
 
+/* number of distinct nodes held for every frozen tree in the process */
+static int
+frozen_nodes(lua_State *l)
+{
+    lua_pushnumber(l, (lua_Number)ipforest_dag_nodes());
+    return 1;
+}
+
 /* Return ipforest module table */
 static int
 lua_ipforest_new(lua_State *l)
@@ -487,14 +3055,74 @@ lua_ipforest_new(lua_State *l)
     luaL_Reg reg[] = {
         { "reset", reset_tree },
         { "load", load_tree },
+        { "load_string", load_string_tree },
+        { "watch", watch_tree },
+        { "poll", poll_trees },
+        { "builder", new_builder },
         { "append", append_tree },
+        { "append_many", append_many_tree },
+        { "expire", expire_tree },
+        { "count_hits", count_hits },
+        { "top_hits", top_hits },
+        { "dump_hits", dump_hits },
+        { "reset_hits", reset_hits },
+        { "counter", counter_tree },
+        { "count", count_addr },
+        { "heavy_hitters", heavy_hitters },
+        { "instrument", instrument_tree },
+        { "metrics", metrics_tree },
         { "has", has_tree },
         { "free", free_tree },
         { "match", match_tree },
+        { "first_untrusted", first_untrusted },
+        { "load2", load2_tree },
+        { "append2", append2_tree },
+        { "match2", match2_tree },
+        { "covers", covers_tree },
+        { "overlaps", overlaps_tree },
+        { "prefixes_in", prefixes_in },
+        { "diff", diff_tree },
         { "compact", compact_tree },
+        { "compact_lossy", compact_lossy_tree },
+        { "optimize", optimize_tree },
+        { "compile", compile_tree },
+        { "load_compiled", load_compiled_tree },
+        { "load_mmdb", load_mmdb_tree },
+        { "shm_create", shm_create_tree },
+        { "shm_attach", shm_attach_tree },
+        { "shm_unlink", shm_unlink_tree },
+        { "value", value_tree },
+        { "publish", publish_tree },
+        { "attach", attach_tree },
+        { "freeze", freeze_tree },
+        { "frozen_nodes", frozen_nodes },
+        { NULL, NULL }
+    };
+
+    luaL_Reg builder_reg[] = {
+        { "feed", builder_feed },
+        { "commit", builder_commit },
         { NULL, NULL }
     };
 
+    /* builder metatable */
+    luaL_newmetatable(l, IPFOREST_BUILDER_MT);
+    lua_newtable(l);
+    for (preg = builder_reg; preg->name != NULL; preg++) {
+        lua_pushcfunction(l, preg->func);
+        lua_setfield(l, -2, preg->name);
+    }
+    lua_setfield(l, -2, "__index");
+    lua_pushcfunction(l, builder_gc);
+    lua_setfield(l, -2, "__gc");
+    lua_pop(l, 1);
+
+    /* diff iterator state */
+    luaL_newmetatable(l, IPFOREST_DIFF_MT);
+    lua_pushcfunction(l, diff_gc);
+    lua_setfield(l, -2, "__gc");
+    lua_pop(l, 1);
+
     /* ipforest module table */
     lua_newtable(l);
 
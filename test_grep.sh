@@ -0,0 +1,60 @@
+#!/bin/sh
+# check ipforest-grep against blacklist.txt and test_grep.log, whose last
+# line has no trailing newline
+
+GREP=${GREP:-./ipforest-grep}
+LIST=$(mktemp)
+trap 'rm -f "$LIST"' EXIT
+printf '9.9.9.0/24\n' > "$LIST"
+
+failed=0
+
+# check name expected command...
+check() {
+    name=$1
+    expected=$2
+    shift 2
+    got=$("$@" 2>&1)
+    if [ "$got" != "$expected" ]; then
+        printf 'FAIL %s\n--- expected\n%s\n--- got\n%s\n' "$name" "$expected" "$got"
+        failed=1
+    else
+        printf 'ok   %s\n' "$name"
+    fi
+}
+
+check "field" "12:00:01,127.0.0.1,GET /a
+12:00:03,10.1.2.3,GET /c
+12:00:05,13.13.13.13,GET /e" \
+    $GREP -j 1 -l blacklist.txt -f 2 -d , test_grep.log
+
+check "offset" "12:00:01,127.0.0.1,GET /a
+12:00:03,10.1.2.3,GET /c
+12:00:05,13.13.13.13,GET /e" \
+    $GREP -j 2 -l blacklist.txt -o 9 test_grep.log
+
+check "invert" "12:00:02,9.9.9.9,GET /b
+12:00:04,10.128.1.2,GET /d" \
+    $GREP -v -l blacklist.txt -f 2 -d , test_grep.log
+
+check "count" "3" \
+    $GREP -c -l blacklist.txt -f 2 -d , test_grep.log
+
+check "count invert" "2" \
+    $GREP -c -v -l blacklist.txt -o 9 test_grep.log
+
+check "lists" "12:00:01,127.0.0.1,GET /a
+12:00:02,9.9.9.9,GET /b
+12:00:03,10.1.2.3,GET /c
+12:00:05,13.13.13.13,GET /e" \
+    $GREP -l blacklist.txt -l "$LIST" -f 2 -d , test_grep.log
+
+check "files" "test_grep.log:1
+test_grep.log:1" \
+    $GREP -c -l "$LIST" -f 2 -d , test_grep.log test_grep.log
+
+# field 1 holds the time, nothing selected
+check "none" "" \
+    $GREP -l blacklist.txt test_grep.log
+
+exit $failed
@@ -19,6 +19,29 @@ function test_load()
   assert_false(ipforest.load("whitelist", "./nonexist.txt"))
 end
 
+function test_load_cached()
+  local ok, rebuilt = ipforest.load("cached", "./blacklist.txt", nil, true)
+  assert_true(ok)
+  assert_true(rebuilt)
+  ok, rebuilt = ipforest.load("cached", "./blacklist.txt", nil, true)
+  assert_true(ok)
+  assert_false(rebuilt)
+  ok, rebuilt = ipforest.load("cached", "./blacklist.txt", "poptrie", true)
+  assert_true(rebuilt)
+  ok, rebuilt = ipforest.load("cached", "./blacklist.txt", "poptrie", true)
+  assert_false(rebuilt)
+  assert_true(ipforest.append("cached", "10.128.1.0/24"))
+  ok, rebuilt = ipforest.load("cached", "./blacklist.txt", "poptrie", true)
+  assert_true(rebuilt)
+  assert_false(ipforest.match("cached", "10.128.1.2"))
+  ok, rebuilt = ipforest.load("cached", "./blacklist.txt", "poptrie")
+  assert_true(rebuilt)
+  assert_true(ipforest.load("cached", "./blacklist.txt", nil, true))
+  assert_true(ipforest.free("cached"))
+  assert_false(ipforest.load("cached", "./nonexist.txt", nil, true))
+  assert_false(ipforest.free("cached"))
+end
+
 function test_match()
   assert_true(ipforest.load("blacklist", "./blacklist.txt"))
   assert_true(ipforest.match("blacklist", "127.0.0.1"))
@@ -72,6 +95,97 @@ function test_append()
   assert_true(ipforest.match("blacklist", "8.8.8.23"));
 end
 
+function test_watch()
+  local fname = os.tmpname()
+  local f = io.open(fname, "w")
+  f:write("10.128.1.0/24\n")
+  f:close()
+  assert_false(ipforest.watch("watched", "/nonexist/list.txt"))
+  assert_true(ipforest.watch("watched", fname, "poptrie"))
+  assert_true(ipforest.match("watched", "10.128.1.2"))
+  assert_equal(0, ipforest.poll())
+  f = io.open(fname .. ".tmp", "w")
+  f:write("10.129.1.0/24\n")
+  f:close()
+  assert_true(os.rename(fname .. ".tmp", fname))
+  local published, t = 0, os.time()
+  while published == 0 and os.time() - t < 3 do
+    os.execute("sleep 0.05")
+    published = ipforest.poll()
+  end
+  assert_equal(1, published)
+  assert_false(ipforest.match("watched", "10.128.1.2"))
+  assert_true(ipforest.match("watched", "10.129.1.2"))
+  assert_true(ipforest.free("watched"))
+  os.remove(fname)
+end
+
+function test_first_untrusted()
+  assert_true(ipforest.load("proxies", "./blacklist.txt"))
+  local addr, pos = ipforest.first_untrusted("proxies", "100.64.0.1, 127.0.0.1, 13.13.13.13")
+  assert_equal("100.64.0.1", addr)
+  assert_equal(1, pos)
+  addr, pos = ipforest.first_untrusted("proxies", "100.64.0.1, 9.9.9.9 ,127.0.0.1,13.13.13.13", true)
+  assert_equal("9.9.9.9", addr)
+  assert_equal(2, pos)
+  addr, pos = ipforest.first_untrusted("proxies", "127.0.0.1, 127.000.0.1", true)
+  assert_equal("127.000.0.1", addr)
+  assert_equal(2, pos)
+  addr, pos = ipforest.first_untrusted("proxies", "127.0.0.1,,13.13.13.13")
+  assert_equal("", addr)
+  assert_equal(2, pos)
+  assert_false(ipforest.first_untrusted("proxies", "127.0.0.1, 13.13.13.13"))
+  assert_false(ipforest.first_untrusted("proxies", "13.13.13.13", true))
+  assert_false(ipforest.first_untrusted("proxies", ""))
+  assert_false(ipforest.first_untrusted("whitelist", "8.8.8.8"))
+  assert_true(ipforest.free("proxies"))
+end
+
+function test_match2()
+  local fname = os.tmpname()
+  local f = io.open(fname, "w")
+  f:write("# client networks that may not reach internal ranges\n")
+  f:write("10.0.0.0/8 192.168.0.0/16\n")
+  f:write("10.1.0.0/16\t172.16.0.1-5\n")
+  f:close()
+  assert_false(ipforest.load2("policy", "/nonexist/rules.txt"))
+  assert_true(ipforest.load2("policy", fname))
+  assert_true(ipforest.match2("policy", "10.2.3.4", "192.168.1.1"))
+  assert_true(ipforest.match2("policy", "10.1.3.4", "192.168.1.1"))
+  assert_true(ipforest.match2("policy", "10.1.3.4", "172.16.0.3"))
+  assert_false(ipforest.match2("policy", "10.2.3.4", "172.16.0.3"))
+  assert_false(ipforest.match2("policy", "11.2.3.4", "192.168.1.1"))
+  assert_false(ipforest.match("policy", "10.2.3.4"))
+  assert_true(ipforest.append2("policy", "0.0.0.0/0", "8.8.8.8"))
+  assert_true(ipforest.match2("policy", "11.2.3.4", "8.8.8.8"))
+  assert_false(ipforest.append2("policy", "10.0.0", "8.8.8.8"))
+  assert_false(ipforest.match2("policy", "11.2.3.4", "nonsense"))
+  assert_false(ipforest.match2("whitelist", "10.2.3.4", "192.168.1.1"))
+  f = io.open(fname, "w")
+  f:write("10.0.0.0/8\n")
+  f:close()
+  assert_false(ipforest.load2("policy", fname))
+  assert_true(ipforest.match2("policy", "10.2.3.4", "192.168.1.1"))
+  assert_true(ipforest.free("policy"))
+  os.remove(fname)
+end
+
+function test_append_many()
+  assert_true(ipforest.load("blacklist", "./blacklist.txt"))
+  assert_true(ipforest.append_many("blacklist", { "10.128.1.0/24", "10.129.0.5-9", "10.128.0.0/24" }))
+  assert_true(ipforest.match("blacklist", "10.128.1.2"))
+  assert_true(ipforest.match("blacklist", "10.128.0.255"))
+  assert_true(ipforest.match("blacklist", "10.129.0.7"))
+  assert_false(ipforest.match("blacklist", "10.129.0.10"))
+  assert_true(ipforest.append_many("blacklist", "# bans\r\n10.130.0.1\r\n\n10.131.0.0/16"))
+  assert_true(ipforest.match("blacklist", "10.131.2.3"))
+  assert_false(ipforest.append_many("blacklist", { "10.132.0.1", "10.132.0" }))
+  assert_false(ipforest.match("blacklist", "10.132.0.1"))
+  assert_false(ipforest.append_many("blacklist", { "10.132.0.1", 42 }))
+  assert_true(ipforest.append_many("blacklist", {}))
+  assert_false(ipforest.append_many("whitelist", { "10.132.0.1" }))
+end
+
 function test_reset()
   assert_true(ipforest.load("blacklist", "./blacklist.txt"))
   assert_true(ipforest.append("blacklist", "8.8.8.8/24"));
@@ -92,8 +206,453 @@ function test_compact()
   assert_false(ipforest.compact("whitelist"))
 end
 
+function test_compact_lossy()
+  assert_true(ipforest.load_string("feed", "10.0.0.1\n10.0.0.3\n"))
+  assert_false(ipforest.match("feed", "10.0.0.2"))
+  local extra, nodes = ipforest.compact_lossy("feed", 40)
+  assert_equal(0, extra)
+  assert_equal(34, nodes)
+  extra, nodes = ipforest.compact_lossy("feed", 32)
+  assert_equal(2, extra)
+  assert_equal(30, nodes)
+  assert_true(ipforest.match("feed", "10.0.0.0"))
+  assert_true(ipforest.match("feed", "10.0.0.2"))
+  assert_false(ipforest.match("feed", "10.0.0.4"))
+  extra, nodes = ipforest.compact_lossy("feed", 32)
+  assert_equal(2, extra)
+  assert_equal(30, nodes)
+  extra, nodes = ipforest.compact_lossy("feed", 0, "bytes")
+  assert_equal(4294967294, extra)
+  assert_equal(0, nodes)
+  assert_true(ipforest.match("feed", "192.168.1.1"))
+  assert_false(ipforest.compact_lossy("feed", 10, "pages"))
+  assert_true(ipforest.load_string("feed", "10.0.0.1\n10.0.0.3\n"))
+  assert_equal(0, ipforest.compact_lossy("feed", 40))
+  assert_equal(2, ipforest.compact_lossy("feed", 32))
+  assert_true(ipforest.append("feed", "10.0.0.8"))
+  assert_equal(2, ipforest.compact_lossy("feed", 40))
+  assert_true(ipforest.append_many("feed", { "10.0.0.2", "10.0.0.9" }))
+  assert_equal(1, ipforest.compact_lossy("feed", 40))
+  assert_true(ipforest.load_string("feed", "10.0.0.1\n10.0.0.3\n"))
+  assert_equal(0, ipforest.compact_lossy("feed", 40))
+  assert_false(ipforest.compact_lossy("whitelist", 10))
+  assert_true(ipforest.freeze("feed"))
+  assert_false(ipforest.compact_lossy("feed", 10))
+  assert_true(ipforest.free("feed"))
+end
+
+function test_optimize()
+  assert_true(ipforest.load("blacklist", "./blacklist.txt"))
+  assert_true(ipforest.append("blacklist", "10.128.1.0/24"))
+  assert_true(ipforest.optimize("blacklist"))
+  assert_true(ipforest.match("blacklist", "10.128.1.2"))
+  assert_true(ipforest.match("blacklist", "9.0.3.188"))
+  assert_false(ipforest.match("blacklist", "9.0.3.189"))
+  assert_true(ipforest.append("blacklist", "10.128.2.0/24"))
+  assert_true(ipforest.match("blacklist", "10.128.2.2"))
+  assert_false(ipforest.optimize("whitelist"))
+  assert_true(ipforest.freeze("blacklist"))
+  assert_false(ipforest.optimize("blacklist"))
+end
+
 function test_free()
   assert_true(ipforest.load("blacklist", "./blacklist.txt"))
   assert_true(ipforest.free("blacklist"))
   assert_false(ipforest.free("whitelist"))
 end
+
+function test_publish_attach()
+  assert_false(ipforest.attach("sharedlist"))
+  assert_false(ipforest.publish("sharedlist", "./nonexist.txt"))
+  assert_true(ipforest.publish("sharedlist", "./blacklist.txt"))
+  assert_true(ipforest.attach("sharedlist"))
+  assert_true(ipforest.match("sharedlist", "127.0.0.1"))
+  assert_false(ipforest.match("sharedlist", "10.128.1.2"))
+  assert_false(ipforest.append("sharedlist", "10.128.1.2"))
+  assert_true(ipforest.free("sharedlist"))
+  assert_false(ipforest.has("sharedlist"))
+  assert_true(ipforest.attach("sharedlist"))
+  assert_true(ipforest.match("sharedlist", "127.0.0.1"))
+end
+
+function test_compile()
+  assert_false(ipforest.load("blacklist", "./blacklist.txt", "nonexist"))
+  assert_true(ipforest.load("blacklist", "./blacklist.txt", "poptrie"))
+  assert_true(ipforest.match("blacklist", "127.0.0.255"))
+  assert_true(ipforest.match("blacklist", "11.11.11.128"))
+  assert_false(ipforest.match("blacklist", "11.11.11.129"))
+  assert_true(ipforest.append("blacklist", "11.11.11.129"))
+  assert_true(ipforest.match("blacklist", "11.11.11.129"))
+  assert_true(ipforest.compile("blacklist"))
+  assert_true(ipforest.match("blacklist", "11.11.11.129"))
+  assert_false(ipforest.match("blacklist", "10.128.1.2"))
+  assert_true(ipforest.compile("blacklist", "radix"))
+  assert_false(ipforest.compile("whitelist", "poptrie"))
+end
+
+function test_bsearch()
+  assert_true(ipforest.load("blacklist", "./blacklist.txt", "bsearch"))
+  assert_true(ipforest.match("blacklist", "1.2.3.4"))
+  assert_false(ipforest.match("blacklist", "1.2.3.3"))
+  assert_true(ipforest.match("blacklist", "127.0.0.255"))
+  assert_true(ipforest.match("blacklist", "255.255.255.255"))
+  assert_false(ipforest.match("blacklist", "10.128.1.2"))
+  assert_true(ipforest.append("blacklist", "10.128.1.0/24"))
+  assert_true(ipforest.compile("blacklist"))
+  assert_true(ipforest.match("blacklist", "10.128.1.2"))
+  assert_true(ipforest.load_string("blacklist", "1.1.1.1\n2.2.2.0/24\n", "auto"))
+  assert_true(ipforest.match("blacklist", "2.2.2.9"))
+  assert_false(ipforest.match("blacklist", "1.1.1.2"))
+  assert_true(ipforest.load("blacklist", "./blacklist.txt", "auto"))
+  assert_true(ipforest.match("blacklist", "14.14.14.20"))
+  assert_false(ipforest.match("blacklist", "14.14.14.21"))
+end
+
+function test_interval()
+  assert_true(ipforest.load("blacklist", "./blacklist.txt", "interval"))
+  assert_false(ipforest.match("blacklist", "1.2.3.3"))
+  assert_true(ipforest.match("blacklist", "1.2.3.4"))
+  assert_true(ipforest.match("blacklist", "9.0.3.188"))
+  assert_false(ipforest.match("blacklist", "9.0.3.189"))
+  assert_true(ipforest.match("blacklist", "14.14.14.20"))
+  assert_false(ipforest.match("blacklist", "14.14.14.21"))
+  assert_true(ipforest.match("blacklist", "255.255.255.255"))
+  assert_false(ipforest.match("blacklist", "10.128.1.2"))
+  assert_true(ipforest.append("blacklist", "10.128.1.0/24"))
+  assert_true(ipforest.compile("blacklist"))
+  assert_true(ipforest.match("blacklist", "10.128.1.2"))
+end
+
+function test_load_compiled()
+  assert_false(ipforest.load_compiled("blacklist", "./nonexist.so"))
+  assert_true(ipforest.load_compiled("blacklist", "./blacklist.so"))
+  assert_true(ipforest.match("blacklist", "127.0.0.255"))
+  assert_true(ipforest.match("blacklist", "9.0.3.188"))
+  assert_false(ipforest.match("blacklist", "9.0.3.189"))
+  assert_false(ipforest.match("blacklist", "10.128.1.2"))
+  assert_false(ipforest.append("blacklist", "10.128.1.2"))
+  assert_false(ipforest.compile("blacklist", "poptrie"))
+  assert_true(ipforest.free("blacklist"))
+end
+
+function test_shm()
+  ipforest.shm_unlink("/ipforest_test")
+  assert_false(ipforest.shm_attach("bans_r", "/ipforest_test"))
+  assert_true(ipforest.shm_create("bans", "/ipforest_test", 4096))
+  assert_false(ipforest.shm_create("bans2", "/ipforest_test"))
+  assert_true(ipforest.shm_attach("bans_r", "/ipforest_test"))
+  assert_true(ipforest.append("bans", "10.128.1.0/24"))
+  assert_true(ipforest.append_many("bans", { "1.2.3.4", "192.168.0.10-30" }))
+  assert_true(ipforest.match("bans_r", "10.128.1.2"))
+  assert_true(ipforest.match("bans_r", "192.168.0.20"))
+  assert_false(ipforest.match("bans_r", "192.168.0.31"))
+  assert_false(ipforest.append("bans_r", "8.8.8.8"))
+  assert_false(ipforest.append("bans", "10.128.1"))
+  assert_true(ipforest.reset("bans"))
+  assert_false(ipforest.match("bans_r", "1.2.3.4"))
+  assert_true(ipforest.free("bans"))
+  assert_false(ipforest.shm_create("bans", "/ipforest_test", 8192))
+  assert_true(ipforest.shm_create("bans", "/ipforest_test", 4096))
+  assert_true(ipforest.free("bans"))
+  assert_true(ipforest.shm_create("bans", "/ipforest_test"))
+  assert_true(ipforest.free("bans"))
+  assert_true(ipforest.free("bans_r"))
+  assert_true(ipforest.shm_unlink("/ipforest_test"))
+  -- left sized without magic by a creator that died
+  local f = assert(io.open("/dev/shm/ipforest_test", "w"))
+  f:write(string.rep("\0", 4096))
+  f:close()
+  assert_false(ipforest.shm_attach("bans_r", "/ipforest_test"))
+  assert_true(ipforest.shm_create("bans", "/ipforest_test", 4096))
+  assert_true(ipforest.append("bans", "10.128.1.0/24"))
+  assert_true(ipforest.shm_attach("bans_r", "/ipforest_test"))
+  assert_true(ipforest.match("bans_r", "10.128.1.2"))
+  assert_true(ipforest.free("bans"))
+  assert_true(ipforest.free("bans_r"))
+  assert_true(ipforest.shm_unlink("/ipforest_test"))
+end
+
+function test_mmdb()
+  assert_false(ipforest.load_mmdb("geo", "./nonexist.mmdb"))
+  assert_false(ipforest.load_mmdb("geo", "./blacklist.txt"))
+  assert_true(ipforest.load_mmdb("geo", "./test.mmdb"))
+  assert_true(ipforest.match("geo", "1.2.3.4"))
+  assert_true(ipforest.match("geo", "10.200.0.1"))
+  assert_true(ipforest.match("geo", "192.168.1.200"))
+  assert_false(ipforest.match("geo", "192.168.1.1"))
+  assert_false(ipforest.match("geo", "1.2.4.1"))
+  assert_equal("US", ipforest.value("geo", "1.2.3.4", "country", "iso_code"))
+  assert_equal("United States", ipforest.value("geo", "1.2.3.4", "country", "names", "en"))
+  assert_equal("anycast", ipforest.value("geo", "1.2.3.4", "tags", 2))
+  assert_false(ipforest.value("geo", "1.2.3.4", "tags", 3))
+  assert_false(ipforest.value("geo", "1.2.3.4", "nope"))
+  assert_false(ipforest.value("geo", "192.168.1.1"))
+  local rec = ipforest.value("geo", "1.2.3.4")
+  assert_equal(64500, rec.asn)
+  assert_equal(0.5, rec.score)
+  assert_equal(-7, rec.delta)
+  assert_true(rec.anycast)
+  assert_equal("cdn", rec.tags[1])
+  assert_equal(0, #ipforest.value("geo", "192.168.1.200", "tags"))
+  assert_false(ipforest.append("geo", "10.128.1.2"))
+  assert_false(ipforest.value("blacklist", "1.2.3.4"))
+  assert_true(ipforest.free("geo"))
+end
+
+function test_append_ttl()
+  assert_true(ipforest.load("blacklist", "./blacklist.txt"))
+  assert_false(ipforest.match("blacklist", "10.128.1.2"))
+  assert_true(ipforest.append("blacklist", "10.128.1.0/24", 600))
+  assert_true(ipforest.match("blacklist", "10.128.1.2"))
+  assert_true(ipforest.append("blacklist", "10.129.1.2", 0.001))
+  local t = os.clock()
+  while os.clock() - t < 0.01 do end
+  assert_false(ipforest.match("blacklist", "10.129.1.2"))
+  assert_equal(0, ipforest.expire("blacklist", 1024))
+  assert_true(ipforest.match("blacklist", "10.128.1.2"))
+  assert_false(ipforest.expire("whitelist"))
+  assert_false(ipforest.append("blacklist", "10.128.1", 600))
+end
+
+function test_hits()
+  assert_true(ipforest.load("blacklist", "./blacklist.txt", "poptrie"))
+  assert_false(ipforest.top_hits("blacklist"))
+  assert_true(ipforest.count_hits("blacklist", true))
+  assert_true(ipforest.match("blacklist", "127.0.0.1"))
+  assert_true(ipforest.match("blacklist", "127.0.0.2"))
+  assert_true(ipforest.match("blacklist", "13.13.13.13"))
+  assert_false(ipforest.match("blacklist", "10.128.1.2"))
+  local top = ipforest.top_hits("blacklist", 1)
+  assert_equal(1, #top)
+  assert_equal("127.0.0.0/8", top[1].prefix)
+  assert_equal(2, top[1].hits)
+  local all = ipforest.dump_hits("blacklist")
+  assert_equal(2, all["127.0.0.0/8"])
+  assert_equal(1, all["13.13.13.13/32"])
+  assert_equal(0, all["14.14.14.14/31"])
+  assert_true(ipforest.reset_hits("blacklist"))
+  assert_equal(0, #ipforest.top_hits("blacklist"))
+  assert_true(ipforest.count_hits("blacklist", false))
+  assert_false(ipforest.reset_hits("blacklist"))
+  assert_true(ipforest.count_hits("blacklist", true))
+  assert_true(ipforest.freeze("blacklist"))
+  assert_false(ipforest.top_hits("blacklist"))
+  assert_false(ipforest.count_hits("blacklist", true))
+  assert_true(ipforest.count_hits("blacklist", false))
+  assert_true(ipforest.free("blacklist"))
+end
+
+function test_freeze()
+  assert_true(ipforest.load("blacklist", "./blacklist.txt"))
+  assert_true(ipforest.load("blacklist2", "./blacklist.txt"))
+  assert_true(ipforest.freeze("blacklist"))
+  local nodes = ipforest.frozen_nodes()
+  assert_true(nodes > 0)
+  assert_true(ipforest.freeze("blacklist2"))
+  assert_equal(nodes, ipforest.frozen_nodes())
+  assert_true(ipforest.match("blacklist", "127.0.0.1"))
+  assert_true(ipforest.match("blacklist2", "14.14.14.20"))
+  assert_false(ipforest.match("blacklist2", "14.14.14.21"))
+  assert_true(ipforest.match("blacklist", "255.255.255.255"))
+  assert_false(ipforest.match("blacklist", "10.128.1.2"))
+  assert_false(ipforest.append("blacklist", "10.128.1.0/24"))
+  assert_false(ipforest.compile("blacklist"))
+  assert_true(ipforest.free("blacklist"))
+  assert_true(ipforest.free("blacklist2"))
+end
+
+function test_heavy_hitters()
+  assert_false(ipforest.count("requests", "1.2.3.4"))
+  assert_true(ipforest.counter("requests", 3600, 16))
+  assert_false(ipforest.match("requests", "1.2.3.4"))
+  for i = 1, 60 do
+    assert_true(ipforest.count("requests", "1.2.3.4"))
+  end
+  for i = 1, 30 do
+    assert_true(ipforest.count("requests", "1.2.3." .. i))
+  end
+  for i = 1, 100 do
+    assert_true(ipforest.count("requests", "10." .. i .. ".0.1"))
+  end
+  assert_false(ipforest.count("requests", "bad"))
+  local hitters, total = ipforest.heavy_hitters("requests", 0.2)
+  assert_true(total > 189 and total <= 190)
+  assert_equal(3, #hitters)
+  assert_equal("1.2.3.4/32", hitters[1].prefix)
+  assert_equal("1.2.3.0/24", hitters[2].prefix)
+  assert_equal("1.2.0.0/16", hitters[3].prefix)
+  assert_true(hitters[2].count > 89 and hitters[2].count <= 90)
+  assert_equal(0, hitters[2].error)
+  assert_true(ipforest.counter("requests", false))
+  assert_false(ipforest.heavy_hitters("requests"))
+  assert_true(ipforest.counter("requests", 60, 1024, { 32, 8 }))
+  assert_true(ipforest.count("requests", "9.9.9.9", 5))
+  hitters = ipforest.heavy_hitters("requests")
+  assert_equal("9.9.9.9/32", hitters[1].prefix)
+  assert_equal("9.0.0.0/8", hitters[2].prefix)
+  assert_false(ipforest.counter("requests", 60, 1024, { 32, 32 }))
+  assert_true(ipforest.free("requests"))
+end
+
+function test_prefix_queries()
+  assert_true(ipforest.load("blacklist", "./blacklist.txt"))
+  assert_true(ipforest.covers("blacklist", "127.1.0.0/16"))
+  assert_true(ipforest.covers("blacklist", "14.14.14.16/30"))
+  assert_false(ipforest.covers("blacklist", "14.14.14.12/30"))
+  assert_true(ipforest.overlaps("blacklist", "14.14.14.12/30"))
+  assert_false(ipforest.overlaps("blacklist", "10.128.0.0/16"))
+  assert_false(ipforest.covers("blacklist", "bad"))
+  local got = {}
+  for prefix in ipforest.prefixes_in("blacklist", "14.14.14.0/24") do
+    table.insert(got, prefix)
+  end
+  assert_equal(3, #got)
+  assert_equal("14.14.14.14/31", got[1])
+  assert_equal("14.14.14.16/30", got[2])
+  assert_equal("14.14.14.20/32", got[3])
+  got = {}
+  for prefix in ipforest.prefixes_in("blacklist", "127.5.0.0/16") do
+    table.insert(got, prefix)
+  end
+  assert_equal(1, #got)
+  assert_equal("127.0.0.0/8", got[1])
+  for prefix in ipforest.prefixes_in("blacklist", "10.128.0.0/16") do
+    fail("no prefix expected")
+  end
+  assert_true(ipforest.freeze("blacklist"))
+  local ok, err = ipforest.covers("blacklist", "127.1.0.0/16")
+  assert_nil(ok)
+  assert_string(err)
+  assert_nil(ipforest.overlaps("blacklist", "14.14.14.12/30"))
+  assert_nil(ipforest.prefixes_in("blacklist", "14.14.14.0/24"))
+  assert_false(ipforest.covers("nonexist", "127.1.0.0/16"))
+  assert_true(ipforest.free("blacklist"))
+end
+
+function test_diff()
+  assert_true(ipforest.load("old", "./blacklist.txt"))
+  assert_true(ipforest.load("new", "./blacklist.txt"))
+  for prefix in ipforest.diff("old", "new") do
+    fail("no change expected")
+  end
+  assert_true(ipforest.append("new", "10.128.1.0/24"))
+  assert_true(ipforest.append("old", "10.128.2.0/25"))
+  assert_true(ipforest.append("old", "10.128.2.128/25"))
+  local got = {}
+  for prefix, added in ipforest.diff("old", "new") do
+    table.insert(got, (added and "+" or "-") .. prefix)
+  end
+  assert_equal(2, #got)
+  assert_equal("+10.128.1.0/24", got[1])
+  assert_equal("-10.128.2.0/24", got[2])
+  assert_true(ipforest.freeze("old"))
+  assert_true(ipforest.freeze("new"))
+  assert_equal(2, ipforest.diff("old", "new", "./diff.txt"))
+  local f = io.open("./diff.txt")
+  assert_equal("+10.128.1.0/24", f:read("*l"))
+  assert_equal("-10.128.2.0/24", f:read("*l"))
+  f:close()
+  os.remove("./diff.txt")
+  assert_false(ipforest.diff("old", "nonexist", "./diff.txt"))
+  assert_false(ipforest.diff("old", "nonexist"))
+  assert_true(ipforest.free("old"))
+  assert_true(ipforest.free("new"))
+end
+
+function test_diff_frozen_loaded()
+  assert_true(ipforest.load("master", "./blacklist.txt"))
+  assert_true(ipforest.freeze("master"))
+  assert_true(ipforest.load("new", "./blacklist.txt"))
+  assert_true(ipforest.append("new", "10.128.1.0/24"))
+  local got = {}
+  for prefix, added in ipforest.diff("master", "new") do
+    table.insert(got, (added and "+" or "-") .. prefix)
+  end
+  assert_equal(1, #got)
+  assert_equal("+10.128.1.0/24", got[1])
+  assert_equal(1, ipforest.diff("new", "master", "./diff.txt"))
+  local f = io.open("./diff.txt")
+  assert_equal("-10.128.1.0/24", f:read("*l"))
+  f:close()
+  os.remove("./diff.txt")
+  assert_true(ipforest.load_mmdb("mmdb", "./test.mmdb"))
+  local ok, err = ipforest.diff("master", "mmdb", "./diff.txt")
+  assert_false(ok)
+  assert_string(err)
+  assert_nil(io.open("./diff.txt"))
+  assert_false(ipforest.diff("mmdb", "new"))
+  assert_true(ipforest.free("mmdb"))
+  assert_true(ipforest.free("master"))
+  assert_true(ipforest.free("new"))
+end
+
+function test_metrics()
+  assert_true(ipforest.load("blacklist", "./blacklist.txt"))
+  assert_false(ipforest.metrics("blacklist"))
+  assert_true(ipforest.instrument("blacklist", 1))
+  assert_true(ipforest.match("blacklist", "127.0.0.1"))
+  assert_true(ipforest.match("blacklist", "13.13.13.13"))
+  assert_false(ipforest.match("blacklist", "100.64.0.1"))
+  local m = ipforest.metrics("blacklist")
+  assert_equal(3, m.calls)
+  assert_equal(2, m.hits)
+  assert_equal(1, m.misses)
+  assert_equal(1, m.depth[3])
+  assert_equal(1, m.depth[8])
+  assert_equal(1, m.depth[32])
+  assert_equal(3, m.latency_ns.count)
+  local buckets = m.latency_ns.buckets
+  assert_equal(0, buckets[1].le)
+  assert_equal(1, buckets[2].le)
+  assert_equal(3, buckets[3].le)
+  assert_equal(math.huge, buckets[#buckets].le)
+  assert_equal(3, buckets[#buckets].count)
+  assert_equal(3, ipforest.metrics().blacklist.calls)
+  assert_true(ipforest.instrument("blacklist", false))
+  assert_false(ipforest.metrics("blacklist"))
+  assert_nil(next(ipforest.metrics()))
+end
+
+function test_metrics_with_hits()
+  assert_true(ipforest.load("blacklist", "./blacklist.txt"))
+  assert_true(ipforest.instrument("blacklist", 1))
+  assert_true(ipforest.count_hits("blacklist", true))
+  assert_true(ipforest.match("blacklist", "127.0.0.1"))
+  assert_true(ipforest.count_hits("blacklist", false))
+  assert_true(ipforest.match("blacklist", "127.0.0.1"))
+  local m = ipforest.metrics("blacklist")
+  assert_table(m)
+  assert_equal(2, m.calls)
+  assert_true(ipforest.free("blacklist"))
+end
+
+function test_load_string()
+  local f = io.open("./blacklist.txt", "r")
+  local data = f:read("*a")
+  f:close()
+  assert_true(ipforest.load_string("blacklist", data))
+  assert_true(ipforest.match("blacklist", "11.11.11.128"))
+  assert_false(ipforest.match("blacklist", "11.11.11.129"))
+  assert_true(ipforest.load_string("blacklist", "1.1.1.1\r\n2.2.2.0/24", "poptrie"))
+  assert_true(ipforest.match("blacklist", "2.2.2.9"))
+  assert_false(ipforest.load_string("blacklist", "1.1.1.x\n"))
+end
+
+function test_builder()
+  local f = io.open("./blacklist.txt", "r")
+  local data = f:read("*a")
+  f:close()
+  local b = ipforest.builder()
+  for i = 1, #data, 7 do
+    assert_true(b:feed(data:sub(i, i + 6)))
+  end
+  assert_true(b:commit("blacklist"))
+  assert_true(ipforest.match("blacklist", "14.14.14.20"))
+  assert_false(ipforest.match("blacklist", "14.14.14.21"))
+  assert_false(b:feed("1.1.1.x\n"))
+  assert_false(b:feed("1.1.1.1\n"))
+  assert_false(b:commit("blacklist"))
+  assert_true(b:feed("1.1.1.1"))
+  assert_true(b:commit("blacklist"))
+  assert_true(ipforest.match("blacklist", "1.1.1.1"))
+end
@@ -0,0 +1,219 @@
+/*
+ * check libipforest through ipforest.h alone, linked against the shared
+ * library so that nothing but the exported api is reachable
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ipforest.h"
+
+#define IP(a, b, c, d) (((uint32_t)(a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+#define THREADS 4
+#define ROUNDS 20000
+
+static int failed;
+
+#define check(name, cond) do {                                   \
+    if (cond) {                                                   \
+        printf("ok   %s\n", name);                                \
+    } else {                                                      \
+        printf("FAIL %s (%s:%d)\n", name, __FILE__, __LINE__);    \
+        failed = 1;                                               \
+    }                                                             \
+} while (0)
+
+static const char list[] =
+    "# host\n"
+    "13.13.13.13\n"
+    "# network\n"
+    "10.0.0.0/9\n"
+    "# ip range\n"
+    "14.14.14.14-20\n";
+
+static const uint32_t addrs[] = {
+    IP(13, 13, 13, 13), IP(13, 13, 13, 14), IP(10, 1, 2, 3), IP(10, 128, 1, 2),
+    IP(14, 14, 14, 13), IP(14, 14, 14, 14), IP(14, 14, 14, 20), IP(14, 14, 14, 21),
+    IP(192, 168, 1, 1), IP(0, 0, 0, 0), IP(255, 255, 255, 255)
+};
+
+static const unsigned char expected[] = { 1, 0, 1, 0, 0, 1, 1, 0, 0, 0, 0 };
+
+#define NADDRS (sizeof(addrs) / sizeof(addrs[0]))
+
+static int
+write_list(const char *fname, const char *data)
+{
+    FILE *f;
+    int ok;
+
+    f = fopen(fname, "w");
+    if (!f) {
+        return 0;
+    }
+    ok = fputs(data, f) >= 0;
+    return fclose(f) == 0 && ok;
+}
+
+static int
+lookups_expected(const ipforest_t *forest)
+{
+    size_t i;
+
+    for (i = 0; i < NADDRS; i++) {
+        if (ipforest_lookup(forest, addrs[i]) != expected[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void *
+lookup_thread(void *arg)
+{
+    const ipforest_t *forest;
+    unsigned char results[NADDRS];
+    int round;
+
+    forest = arg;
+    for (round = 0; round < ROUNDS; round++) {
+        if (!lookups_expected(forest)
+            || ipforest_lookup_batch(forest, addrs, NADDRS, results) != 4
+            || memcmp(results, expected, NADDRS) != 0) {
+            return arg;
+        }
+    }
+    return NULL;
+}
+
+static void
+test_lookup(void)
+{
+    ipforest_t *forest;
+    unsigned char results[NADDRS];
+
+    forest = ipforest_create();
+    check("create", forest != NULL);
+    if (!forest) {
+        return;
+    }
+
+    check("empty", ipforest_lookup(forest, IP(13, 13, 13, 13)) == 0);
+    check("load string", ipforest_load_string(forest, list, strlen(list)));
+    check("lookup", lookups_expected(forest));
+
+    memset(results, 0xff, sizeof(results));
+    check("lookup batch", ipforest_lookup_batch(forest, addrs, NADDRS, results) == 4
+                          && memcmp(results, expected, NADDRS) == 0);
+
+    check("insert", ipforest_insert(forest, IP(192, 168, 0, 0), 16));
+    check("insert match", ipforest_lookup(forest, IP(192, 168, 1, 1)));
+    check("insert bad length", !ipforest_insert(forest, 0, 33));
+    check("append", ipforest_append(forest, "13.13.13.14"));
+    check("append match", ipforest_lookup(forest, IP(13, 13, 13, 14)));
+    check("append bad line", !ipforest_append(forest, "10.0.0"));
+
+    check("compile poptrie", ipforest_compile(forest, "poptrie"));
+    check("compiled lookup", ipforest_lookup(forest, IP(192, 168, 1, 1))
+                             && !ipforest_lookup(forest, IP(10, 128, 1, 2)));
+
+    ipforest_free(forest);
+}
+
+static void
+test_frozen_threads(void)
+{
+    ipforest_t *forest;
+    pthread_t threads[THREADS];
+    void *ret;
+    int i, started, bad;
+
+    forest = ipforest_create();
+    if (!forest || !ipforest_load_string(forest, list, strlen(list))) {
+        check("frozen create", 0);
+        if (forest) {
+            ipforest_free(forest);
+        }
+        return;
+    }
+
+    check("freeze", ipforest_freeze(forest, "dag"));
+    check("frozen insert", !ipforest_insert(forest, IP(192, 168, 0, 0), 16));
+    check("frozen append", !ipforest_append(forest, "192.168.0.0/16"));
+    check("frozen lookup", lookups_expected(forest));
+
+    bad = 0;
+    for (started = 0; started < THREADS; started++) {
+        if (pthread_create(&threads[started], NULL, lookup_thread, forest) != 0) {
+            bad = 1;
+            break;
+        }
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], &ret);
+        if (ret) {
+            bad = 1;
+        }
+    }
+    check("frozen threads", !bad);
+
+    ipforest_free(forest);
+}
+
+static void
+test_load_cached(void)
+{
+    char fname[] = "/tmp/test_libipforest.XXXXXX";
+    ipforest_t *forest;
+    int fd, rebuilt;
+
+    fd = mkstemp(fname);
+    if (fd < 0) {
+        check("cached tmpfile", 0);
+        return;
+    }
+    close(fd);
+
+    forest = ipforest_create();
+    if (!forest || !write_list(fname, list)) {
+        check("cached create", 0);
+        goto done;
+    }
+
+    rebuilt = -1;
+    check("cached first", ipforest_load_cached(forest, fname, &rebuilt) && rebuilt == 1);
+    check("cached lookup", lookups_expected(forest));
+    check("cached unchanged", ipforest_load_cached(forest, fname, &rebuilt) && rebuilt == 0);
+    check("cached no out", ipforest_load_cached(forest, fname, NULL));
+
+    /* an insert makes the tree differ from the file */
+    check("cached insert", ipforest_insert(forest, IP(192, 168, 0, 0), 16));
+    check("cached after insert", ipforest_load_cached(forest, fname, &rebuilt) && rebuilt == 1);
+    check("cached insert gone", !ipforest_lookup(forest, IP(192, 168, 1, 1)));
+
+    check("cached rewrite", write_list(fname, "192.168.0.0/16\n"));
+    check("cached after rewrite", ipforest_load_cached(forest, fname, &rebuilt) && rebuilt == 1);
+    check("cached new list", ipforest_lookup(forest, IP(192, 168, 1, 1))
+                             && !ipforest_lookup(forest, IP(13, 13, 13, 13)));
+
+    check("cached missing", !ipforest_load_cached(forest, "/nonexist/list.txt", &rebuilt));
+
+done:
+    if (forest) {
+        ipforest_free(forest);
+    }
+    unlink(fname);
+}
+
+int
+main(void)
+{
+    test_lookup();
+    test_frozen_threads();
+    test_load_cached();
+
+    return failed;
+}